@@ -3,18 +3,66 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "me.h"
 
+static const char *help =
+    "FinTEx Matching Engine ASCII Logger\n"
+    "Copyright (C) 2024  Gabriel de Brito\n"
+    "\n"
+    "Usage: %s [options]\n"
+    "Prints every event published by the engine.\n"
+    "Options:\n"
+    "\n"
+    "-c --conflated\n"
+    "	Instead, print the latest state of the securities that changed every\n"
+    "	this many milliseconds, as -c=100. Needs the engine to be started\n"
+    "	with -C. Never falls behind, but misses what happened in between.\n";
+
+static const char *order_names[] = {
+    [ME_ORDER_MARKET] = "MARKET",
+    [ME_ORDER_LIMIT] = "LIMIT",
+    [ME_ORDER_IOC] = "IOC",
+    [ME_ORDER_FOK] = "FOK",
+    [ME_ORDER_STOP] = "STOP",
+    [ME_ORDER_STOP_LIMIT] = "STOP LIMIT",
+    [ME_ORDER_ICEBERG] = "ICEBERG",
+};
+
+/* As me-stats, "?" for a type this doesn't know. */
+static const char *order_name(MeOrderType type) {
+  size_t n = sizeof(order_names) / sizeof(order_names[0]);
+  return (size_t)type < n && order_names[type] ? order_names[type] : "?";
+}
+
 static inline void print_market_order(MeOrder *o, int64_t id) {
   printf("%8ld: NEW ORDER (MARKET): SIDE=%s QUANTITY=%ld ID=%ld\n", id,
          o->side == ME_SIDE_BUY ? "BUY" : "SELL", o->quantity, o->order_id);
 }
 
 static inline void print_limit_order(MeOrder *o, int64_t id) {
-  printf("%8ld: NEW ORDER (LIMIT): SIDE=%s QUANTITY=%ld PRICE=%ld ID=%ld\n", id,
-         o->side == ME_SIDE_BUY ? "BUY" : "SELL", o->quantity, o->price,
-         o->order_id);
+  printf("%8ld: NEW ORDER (%s): SIDE=%s QUANTITY=%ld PRICE=%ld ID=%ld\n", id,
+         order_name(o->ord_type), o->side == ME_SIDE_BUY ? "BUY" : "SELL",
+         o->quantity, o->price, o->order_id);
+}
+
+static inline void print_stop_order(MeStopOrder *s, int64_t id) {
+  MeOrder *o = &s->order;
+  printf("%8ld: NEW ORDER (%s): SIDE=%s QUANTITY=%ld ", id,
+         order_name(o->ord_type), o->side == ME_SIDE_BUY ? "BUY" : "SELL",
+         o->quantity);
+  if (o->ord_type == ME_ORDER_STOP_LIMIT) printf("PRICE=%ld ", o->price);
+  printf("STOP=%ld ID=%ld\n", s->stop_price, o->order_id);
+}
+
+static inline void print_iceberg_order(MeIcebergOrder *i, int64_t id) {
+  MeOrder *o = &i->order;
+  printf("%8ld: NEW ORDER (ICEBERG): SIDE=%s QUANTITY=%ld PRICE=%ld "
+         "DISPLAY=%ld ID=%ld\n",
+         id, o->side == ME_SIDE_BUY ? "BUY" : "SELL", o->quantity, o->price,
+         i->display, o->order_id);
 }
 
 static inline void print_trade(MeTrade *t, int64_t id) {
@@ -28,10 +76,39 @@ static inline void print_cancel(MeOrderID id, int64_t security_id) {
   printf("%8ld: CANCEL ORDER: ID=%ld\n", security_id, id);
 }
 
+static inline void print_amend(MeOrder *o, int64_t id) {
+  printf("%8ld: AMEND ORDER: SIDE=%s QUANTITY=%ld PRICE=%ld ID=%ld\n", id,
+         o->side == ME_SIDE_BUY ? "BUY" : "SELL", o->quantity, o->price,
+         o->order_id);
+}
+
+static inline void print_mass_cancel(MeMassCancel *m, int64_t id) {
+  /* By the side flags. */
+  static const char *sides[] = {"BOTH", "BUY", "SELL", "BOTH"};
+
+  printf("%8ld: MASS CANCEL: SIDE=%s OWNER=", id, sides[m->flags & 3]);
+  if (m->flags & ME_MASS_CANCEL_OWNER)
+    printf("%u", m->owner);
+  else
+    printf("ANY");
+  printf(" CANCELLED=%lu\n", m->cancelled);
+}
+
 static inline void print_executed(MeOrder *order, int64_t id) {
   printf("%8ld: ORDER EXECUTED: ID=%ld\n", id, order->order_id);
 }
 
+static inline void print_depth(MeDepth *d, int64_t id) {
+  static const char *actions[] = {
+      [ME_DEPTH_ADD] = "ADD",
+      [ME_DEPTH_CHANGE] = "CHANGE",
+      [ME_DEPTH_DELETE] = "DELETE",
+  };
+  printf("%8ld: DEPTH %s: SIDE=%s LEVEL=%ld PRICE=%ld QUANTITY=%ld\n", id,
+         actions[d->action], d->side == ME_SIDE_BUY ? "BUY" : "SELL",
+         d->level, d->price, d->quantity);
+}
+
 static inline void print_message(MeMessage *message) {
   switch (message->msg_type) {
     case ME_MESSAGE_PANIC:
@@ -44,6 +121,11 @@ static inline void print_message(MeMessage *message) {
     case ME_MESSAGE_NEW_ORDER:
       if (message->message.order.ord_type == ME_ORDER_MARKET) {
         print_market_order(&message->message.order, message->security_id);
+      } else if (message->message.order.ord_type == ME_ORDER_STOP ||
+                 message->message.order.ord_type == ME_ORDER_STOP_LIMIT) {
+        print_stop_order(&message->message.stop, message->security_id);
+      } else if (message->message.order.ord_type == ME_ORDER_ICEBERG) {
+        print_iceberg_order(&message->message.iceberg, message->security_id);
       } else {
         print_limit_order(&message->message.order, message->security_id);
       }
@@ -54,26 +136,86 @@ static inline void print_message(MeMessage *message) {
     case ME_MESSAGE_CANCEL_ORDER:
       print_cancel(message->message.to_cancel, message->security_id);
       break;
+    case ME_MESSAGE_AMEND_ORDER:
+      print_amend(&message->message.order, message->security_id);
+      break;
+    case ME_MESSAGE_MASS_CANCEL:
+      print_mass_cancel(&message->message.mass_cancel, message->security_id);
+      break;
     case ME_MESSAGE_ORDER_EXECUTED:
       print_executed(&message->message.order, message->security_id);
       break;
+    case ME_MESSAGE_DEPTH:
+      print_depth(&message->message.depth, message->security_id);
+      break;
+    case ME_MESSAGE_CHECKPOINT:
+      printf("CHECKPOINT: MESSAGES=%lu\n", message->message.checkpoint);
+      break;
+    case ME_MESSAGE_EXPIRE:
+      /* Only journaled, expired orders are published as cancelled. */
+      break;
+  }
+}
+
+static int print_conflated(long interval_ms) {
+  MeConflatedPage *page;
+  MeConflated state;
+  uint64_t *seen;
+  struct timespec interval = {interval_ms / 1000,
+                              (interval_ms % 1000) * 1000000};
+
+  if ((errno = me_conflated_open(&page)) != 0) {
+    perror("Could not open the conflated state. Is the engine running with -C");
+    return errno;
+  }
+  seen = calloc(page->n_securities, sizeof(uint64_t));
+
+  for (;;) {
+    for (int64_t i = 0; i < page->n_securities; i++) {
+      me_conflated_read(page, i, &state);
+      if (state.updates == seen[i]) continue;
+      seen[i] = state.updates;
+      printf("%8ld: STATE: MARKET PRICE=%ld BID=%ld@%ld ASK=%ld@%ld\n", i,
+             state.market_price, state.bid_quantity, state.bid,
+             state.ask_quantity, state.ask);
+    }
+    fflush(stdout);
+    nanosleep(&interval, NULL);
   }
 }
 
-int main(void) {
+int main(int argc, char *argv[]) {
   MeClientContext context;
-  MeMessage message;
+  MeMessage messages[ME_FRAME_MESSAGES];
+  long interval_ms = 0;
+  int64_t n;
+
+  for (int i = 1; i < argc; i++) {
+    if (sscanf(argv[i], "-c=%ld", &interval_ms) == 1 ||
+        sscanf(argv[i], "--conflated=%ld", &interval_ms) == 1) {
+      continue;
+    } else {
+      printf(help, argv[0]);
+      return strcmp(argv[i], "-h") != 0 && strcmp(argv[i], "--help") != 0;
+    }
+  }
+  if (interval_ms > 0) return print_conflated(interval_ms);
   if (me_client_init_context(&context) != 0) {
     fprintf(stderr, "Could not init client context. Is the engine running?\n");
-    fprintf(stderr, "Opening queues %s and %s failed ", me_in_queue_name,
-            me_out_queue_name);
+    fprintf(stderr, "Opening %s or queues %s and %s failed ", me_shm_name,
+            me_in_queue_name, me_out_queue_name);
     perror("with");
     return errno;
   }
 
-  while (!me_client_get_message(&context, &message)) print_message(&message);
+  while ((n = me_client_get_messages(&context, messages, ME_FRAME_MESSAGES)) >
+         0)
+    for (int64_t i = 0; i < n; i++) print_message(&messages[i]);
 
-  perror("Retriving message failed");
+  if (errno == EPIPE)
+    fprintf(stderr, "Evicted by the engine for falling behind.\n");
+  else
+    perror("Retriving message failed");
 
   return 1;
 }
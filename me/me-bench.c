@@ -0,0 +1,592 @@
+/* clock_gettime, CLOCK_MONOTONIC and syscall. */
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <omp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "me.h"
+
+static const char *help =
+    "FinTEx Matching Engine Benchmark\n"
+    "Copyright (C) 2024  Gabriel de Brito\n"
+    "\n"
+    "Usage: %s [options]\n"
+    "All options are in the form -o=v or --option=v\n"
+    "Replays a random order mix against the engine and reports throughput and\n"
+    "latency as JSON. Latency goes from the time an order was meant to be\n"
+    "sent (its MeOrder.timestamp, or the send time of a cancel) to the time\n"
+    "its echo is received, so a stalled engine is not hidden by a stalled\n"
+    "sender (coordinated omission). When the engine runs in process, the\n"
+    "cache misses of its threads while measuring are reported too, or null\n"
+    "if the hardware counters aren't available (e.g. in most VMs), and so\n"
+    "is the time it took to match each message (as in me-stats), which\n"
+    "leaves out the transport and needs no counters.\n"
+    "Options:\n"
+    "\n"
+    "-n --messages\n"
+    "	Amount of measured messages. Defaults to 200000.\n"
+    "-s --securities\n"
+    "	Amount of securities the messages are spread over. Defaults to 16.\n"
+    "-d --depth\n"
+    "	Price levels per side filled before measuring, and how far from the\n"
+    "	mid price passive orders are placed. Defaults to 10.\n"
+    "-l --level-orders\n"
+    "	Orders per level filled before measuring. Defaults to 4.\n"
+    "-m --mix\n"
+    "	Percentages of passive limit orders, cancels, aggressive limit orders\n"
+    "	and market orders, comma separated. Defaults to 50,35,10,5.\n"
+    "-r --rate\n"
+    "	Messages per second to send. 0 sends as fast as possible, which makes\n"
+    "	the latencies meaningless. Defaults to 100000.\n"
+    "-w --workers\n"
+    "	Run the engine in sharded mode with this many workers. Defaults to 0.\n"
+    "-T --threads\n"
+    "	OpenMP threads of the engine when not sharded. Defaults to the OpenMP\n"
+    "	default.\n"
+    "-t --transport\n"
+    "	Either shm or mq. Defaults to shm.\n"
+    "-c --cache-size\n"
+    "	Memory given to the engine. Defaults to 268435456.\n"
+    "-p --pool-size\n"
+    "	Memory given to the engine for overflow books. Defaults to 67108864.\n"
+    "-M --memory\n"
+    "	How to map the engine memory, as in me -m (huge, prefault, lock and\n"
+    "	numa, comma separated). Unset by default, allocating it with malloc.\n"
+    "-j --journal\n"
+    "	Journal the in process engine to this path (see me -j). It should\n"
+    "	not exist, or it's replayed first. Disabled by default.\n"
+    "-J --journal-sync\n"
+    "	Sync the journal every this many messages. Defaults to 0.\n"
+    "-x --external\n"
+    "	Use an engine that is already running instead of starting one. Its\n"
+    "	security count must be at least --securities.\n"
+    "-S --seed\n"
+    "	Seed of the order generator. Defaults to 1.\n"
+    "-o --output\n"
+    "	File to write the JSON results to. Defaults to the standard output.\n";
+
+#define MID_PRICE 1000
+
+typedef struct {
+  int64_t messages;
+  int64_t securities;
+  int64_t depth;
+  int64_t level_orders;
+  int mix[4];
+  int64_t rate;
+  int workers;
+  int threads;
+  MeTransport transport;
+  size_t cache_size;
+  size_t pool_size;
+  int memory;
+  char *journal;
+  int64_t journal_sync;
+  int external;
+  uint64_t seed;
+  char *output;
+} Config;
+
+/* Resting passive orders that may be cancelled, per security. */
+typedef struct {
+  int64_t used;
+  MeOrderID *ids;
+} Resting;
+
+static Config config = {
+    .messages = 200000,
+    .securities = 16,
+    .depth = 10,
+    .level_orders = 4,
+    .mix = {50, 35, 10, 5},
+    .rate = 100000,
+    .workers = 0,
+    .threads = 0,
+    .transport = ME_TRANSPORT_SHM,
+    .cache_size = 256 * 1024 * 1024,
+    .pool_size = 64 * 1024 * 1024,
+    .memory = 0,
+    .journal = NULL,
+    .journal_sync = 0,
+    .external = 0,
+    .seed = 1,
+    .output = NULL,
+};
+
+static MeContext *engine;
+static MeClientContext client;
+
+/* Indexed by order ID. Filled by the sender and read by the receiver. */
+static MeTimestamp *cancel_sent;
+static uint8_t *seen;
+static int64_t n_ids;
+
+/* Written by the receiver only. */
+static uint64_t *new_latencies;
+static uint64_t *cancel_latencies;
+static int64_t n_new_latencies;
+static int64_t n_cancel_latencies;
+static int64_t warmup_received;
+static int64_t measured_received;
+static MeTimestamp last_receipt;
+
+/* Match times of the in process engine while measuring, in ticks. */
+static MeHistogram matched;
+static double ticks_per_ns;
+
+static int64_t warmup_messages;
+
+/* Hardware counters of the engine threads. */
+typedef struct {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+  int fd;
+} Counter;
+
+#define L1D_READ_MISSES                                             \
+  (PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |     \
+   PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+
+static Counter counters[] = {
+    {"cache_references", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES,
+     -1},
+    {"cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, -1},
+    {"l1d_read_misses", PERF_TYPE_HW_CACHE, L1D_READ_MISSES, -1},
+};
+
+#define N_COUNTERS ((int)(sizeof(counters) / sizeof(counters[0])))
+
+/* Counts the calling thread and the ones it creates afterwards, which only
+ * add up once they exit. Start disabled, so warming up isn't counted. */
+static void open_counters(void) {
+  struct perf_event_attr attr;
+
+  for (int i = 0; i < N_COUNTERS; i++) {
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = counters[i].type;
+    attr.config = counters[i].config;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    counters[i].fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+}
+
+static void toggle_counters(int enable) {
+  for (int i = 0; i < N_COUNTERS; i++)
+    if (counters[i].fd != -1)
+      ioctl(counters[i].fd,
+            enable ? PERF_EVENT_IOC_ENABLE : PERF_EVENT_IOC_DISABLE, 0);
+}
+
+static inline MeTimestamp now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (MeTimestamp)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+static inline uint64_t next_random(void) {
+  /* xorshift64. */
+  config.seed ^= config.seed << 13;
+  config.seed ^= config.seed >> 7;
+  config.seed ^= config.seed << 17;
+  return config.seed;
+}
+
+static void *run_engine(void *arg) {
+  (void)arg;
+  open_counters();
+  if (config.workers > 0) {
+    me_run_sharded(engine, config.workers, NULL, NULL);
+  } else {
+    if (config.threads > 0) omp_set_num_threads(config.threads);
+    me_run(engine, NULL, NULL);
+  }
+  return NULL;
+}
+
+/* Keeps draining until the engine panics, so it never blocks publishing. */
+static void *receive(void *arg) {
+  MeMessage msgs[ME_FRAME_MESSAGES];
+  int64_t n;
+  (void)arg;
+
+  while ((n = me_client_get_messages(&client, msgs, ME_FRAME_MESSAGES)) > 0) {
+    MeTimestamp t = now();
+
+    for (int64_t i = 0; i < n; i++) {
+      MeMessage *msg = &msgs[i];
+      MeOrderID id;
+
+      if (msg->msg_type == ME_MESSAGE_PANIC) return NULL;
+
+      if (msg->msg_type == ME_MESSAGE_NEW_ORDER) {
+        /* Market orders are echoed again if they rest. */
+        id = msg->message.order.order_id;
+        if (id >= (MeOrderID)n_ids || seen[id]) continue;
+        seen[id] = 1;
+        if ((int64_t)id <= warmup_messages) {
+          __atomic_add_fetch(&warmup_received, 1, __ATOMIC_RELEASE);
+          continue;
+        }
+        new_latencies[n_new_latencies++] = t - msg->message.order.timestamp;
+      } else if (msg->msg_type == ME_MESSAGE_CANCEL_ORDER) {
+        id = msg->message.to_cancel;
+        if (id >= (MeOrderID)n_ids) continue;
+        cancel_latencies[n_cancel_latencies++] =
+            t - __atomic_load_n(&cancel_sent[id], __ATOMIC_ACQUIRE);
+      } else {
+        continue;
+      }
+
+      last_receipt = t;
+      __atomic_add_fetch(&measured_received, 1, __ATOMIC_RELEASE);
+    }
+  }
+
+  perror("Retriving message failed");
+  return NULL;
+}
+
+static void send_order(MeOrderID id, int64_t security, MeSide side,
+                       MeOrderType type, int64_t price, int64_t quantity,
+                       MeTimestamp timestamp) {
+  MeMessage msg = {0};
+  msg.msg_type = ME_MESSAGE_NEW_ORDER;
+  msg.security_id = security;
+  msg.message.order.side = side;
+  msg.message.order.quantity = quantity;
+  msg.message.order.ord_type = type;
+  msg.message.order.price = price;
+  msg.message.order.order_id = id;
+  msg.message.order.timestamp = timestamp;
+  me_client_send_message(&client, &msg);
+}
+
+static inline int64_t passive_price(MeSide side) {
+  int64_t away = 1 + next_random() % config.depth;
+  return side == ME_SIDE_BUY ? MID_PRICE - away : MID_PRICE + away;
+}
+
+static void warmup(Resting *resting) {
+  MeOrderID id = 1;
+
+  for (int64_t s = 0; s < config.securities; s++) {
+    for (int64_t l = 1; l <= config.depth; l++) {
+      for (int64_t o = 0; o < config.level_orders; o++) {
+        send_order(id, s, ME_SIDE_BUY, ME_ORDER_LIMIT, MID_PRICE - l,
+                   1 + next_random() % 100, now());
+        resting[s].ids[resting[s].used++] = id++;
+        send_order(id, s, ME_SIDE_SELL, ME_ORDER_LIMIT, MID_PRICE + l,
+                   1 + next_random() % 100, now());
+        resting[s].ids[resting[s].used++] = id++;
+      }
+    }
+  }
+
+  while (__atomic_load_n(&warmup_received, __ATOMIC_ACQUIRE) < warmup_messages)
+    ;
+}
+
+static MeTimestamp replay(Resting *resting) {
+  MeOrderID id = warmup_messages + 1;
+  MeTimestamp start = now();
+  MeTimestamp intended = start;
+  MeMessage msg = {0};
+
+  for (int64_t i = 0; i < config.messages; i++) {
+    int64_t s = next_random() % config.securities;
+    MeSide side = next_random() % 2 ? ME_SIDE_BUY : ME_SIDE_SELL;
+    int64_t quantity = 1 + next_random() % 100;
+    int kind = next_random() % 100;
+
+    if (config.rate > 0) {
+      intended = start + (MeTimestamp)i * 1000000000 / config.rate;
+      while (now() < intended)
+        ;
+    } else {
+      intended = now();
+    }
+
+    if (kind < config.mix[0]) {
+      send_order(id, s, side, ME_ORDER_LIMIT, passive_price(side), quantity,
+                 intended);
+      resting[s].ids[resting[s].used++] = id++;
+    } else if (kind < config.mix[0] + config.mix[1] && resting[s].used > 0) {
+      int64_t pick = next_random() % resting[s].used;
+      MeOrderID target = resting[s].ids[pick];
+      resting[s].ids[pick] = resting[s].ids[--resting[s].used];
+      __atomic_store_n(&cancel_sent[target], intended, __ATOMIC_RELEASE);
+      msg.msg_type = ME_MESSAGE_CANCEL_ORDER;
+      msg.security_id = s;
+      msg.message.to_cancel = target;
+      me_client_send_message(&client, &msg);
+    } else if (kind < config.mix[0] + config.mix[1] + config.mix[2]) {
+      /* Also covers cancels when there's nothing left to cancel. */
+      int64_t price = side == ME_SIDE_BUY ? MID_PRICE + config.depth
+                                          : MID_PRICE - config.depth;
+      send_order(id++, s, side, ME_ORDER_LIMIT, price, quantity, intended);
+    } else {
+      send_order(id++, s, side, ME_ORDER_MARKET, 0, quantity, intended);
+    }
+  }
+
+  return start;
+}
+
+static int compare(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void print_latencies(FILE *f, const char *name, uint64_t *lat,
+                            int64_t n, int last) {
+  double mean = 0;
+
+  qsort(lat, n, sizeof(uint64_t), compare);
+  for (int64_t i = 0; i < n; i++) mean += (double)lat[i] / n;
+
+  fprintf(f, "    \"%s\": {\"count\": %ld", name, n);
+  if (n > 0) {
+    fprintf(f,
+            ", \"mean\": %.0f, \"p50\": %lu, \"p99\": %lu, \"p99.9\": %lu, "
+            "\"max\": %lu",
+            mean, lat[(n - 1) * 50 / 100], lat[(n - 1) * 99 / 100],
+            lat[(n - 1) * 999 / 1000], lat[n - 1]);
+  }
+  fprintf(f, "}%s\n", last ? "" : ",");
+}
+
+static void report(MeTimestamp start) {
+  FILE *f = stdout;
+  double duration = (double)(last_receipt - start) / 1e9;
+  uint64_t *all =
+      malloc((n_new_latencies + n_cancel_latencies) * sizeof(uint64_t));
+
+  memcpy(all, new_latencies, n_new_latencies * sizeof(uint64_t));
+  memcpy(all + n_new_latencies, cancel_latencies,
+         n_cancel_latencies * sizeof(uint64_t));
+
+  if (config.output != NULL && (f = fopen(config.output, "w")) == NULL) {
+    perror("Opening output failed");
+    exit(1);
+  }
+
+  fprintf(f, "{\n");
+  fprintf(f,
+          "  \"config\": {\"messages\": %ld, \"securities\": %ld, "
+          "\"depth\": %ld, \"level_orders\": %ld, \"mix\": [%d, %d, %d, %d], "
+          "\"rate\": %ld, \"workers\": %d, \"threads\": %d, "
+          "\"transport\": \"%s\", \"memory\": %d, \"external\": %s},\n",
+          config.messages, config.securities, config.depth,
+          config.level_orders, config.mix[0], config.mix[1], config.mix[2],
+          config.mix[3], config.rate, config.workers, config.threads,
+          config.transport == ME_TRANSPORT_SHM ? "shm" : "mq", config.memory,
+          config.external ? "true" : "false");
+  fprintf(f, "  \"duration_s\": %.6f,\n", duration);
+  fprintf(f, "  \"throughput_msgs_per_s\": %.0f,\n",
+          config.messages / duration);
+  fprintf(f, "  \"engine_counters\": {");
+  for (int i = 0; i < N_COUNTERS; i++) {
+    uint64_t value;
+    fprintf(f, "%s\"%s\": ", i == 0 ? "" : ", ", counters[i].name);
+    if (counters[i].fd != -1 &&
+        read(counters[i].fd, &value, sizeof(value)) == sizeof(value))
+      fprintf(f, "%lu", value);
+    else
+      fprintf(f, "null");
+  }
+  fprintf(f, "},\n");
+  if (matched.count > 0)
+    fprintf(f,
+            "  \"match_ns\": {\"count\": %lu, \"p50\": %.0f, \"p99\": %.0f, "
+            "\"p99.9\": %.0f, \"max\": %.0f},\n",
+            matched.count, me_stats_percentile(&matched, 0.5) / ticks_per_ns,
+            me_stats_percentile(&matched, 0.99) / ticks_per_ns,
+            me_stats_percentile(&matched, 0.999) / ticks_per_ns,
+            matched.max / ticks_per_ns);
+  else
+    fprintf(f, "  \"match_ns\": null,\n");
+  fprintf(f, "  \"latency_ns\": {\n");
+  print_latencies(f, "all", all, n_new_latencies + n_cancel_latencies, 0);
+  print_latencies(f, "new_order", new_latencies, n_new_latencies, 0);
+  print_latencies(f, "cancel", cancel_latencies, n_cancel_latencies, 1);
+  fprintf(f, "  }\n}\n");
+
+  if (f != stdout) fclose(f);
+  free(all);
+}
+
+static int parse_memory(const char *flags) {
+  int memory = 0;
+
+  if (strstr(flags, "huge") != NULL) memory |= ME_MEMORY_HUGE_PAGES;
+  if (strstr(flags, "prefault") != NULL) memory |= ME_MEMORY_PREFAULT;
+  if (strstr(flags, "lock") != NULL) memory |= ME_MEMORY_LOCK;
+  if (strstr(flags, "numa") != NULL) memory |= ME_MEMORY_NUMA;
+  return memory;
+}
+
+static void parse(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    if (sscanf(argv[i], "-n=%ld", &config.messages) == 1 ||
+        sscanf(argv[i], "--messages=%ld", &config.messages) == 1 ||
+        sscanf(argv[i], "-s=%ld", &config.securities) == 1 ||
+        sscanf(argv[i], "--securities=%ld", &config.securities) == 1 ||
+        sscanf(argv[i], "-d=%ld", &config.depth) == 1 ||
+        sscanf(argv[i], "--depth=%ld", &config.depth) == 1 ||
+        sscanf(argv[i], "-l=%ld", &config.level_orders) == 1 ||
+        sscanf(argv[i], "--level-orders=%ld", &config.level_orders) == 1 ||
+        sscanf(argv[i], "-m=%d,%d,%d,%d", &config.mix[0], &config.mix[1],
+               &config.mix[2], &config.mix[3]) == 4 ||
+        sscanf(argv[i], "--mix=%d,%d,%d,%d", &config.mix[0], &config.mix[1],
+               &config.mix[2], &config.mix[3]) == 4 ||
+        sscanf(argv[i], "-r=%ld", &config.rate) == 1 ||
+        sscanf(argv[i], "--rate=%ld", &config.rate) == 1 ||
+        sscanf(argv[i], "-w=%d", &config.workers) == 1 ||
+        sscanf(argv[i], "--workers=%d", &config.workers) == 1 ||
+        sscanf(argv[i], "-T=%d", &config.threads) == 1 ||
+        sscanf(argv[i], "--threads=%d", &config.threads) == 1 ||
+        sscanf(argv[i], "-c=%zu", &config.cache_size) == 1 ||
+        sscanf(argv[i], "--cache-size=%zu", &config.cache_size) == 1 ||
+        sscanf(argv[i], "-p=%zu", &config.pool_size) == 1 ||
+        sscanf(argv[i], "--pool-size=%zu", &config.pool_size) == 1 ||
+        sscanf(argv[i], "-J=%ld", &config.journal_sync) == 1 ||
+        sscanf(argv[i], "--journal-sync=%ld", &config.journal_sync) == 1 ||
+        sscanf(argv[i], "-S=%lu", &config.seed) == 1 ||
+        sscanf(argv[i], "--seed=%lu", &config.seed) == 1) {
+      continue;
+    } else if (strcmp(argv[i], "-t=mq") == 0 ||
+               strcmp(argv[i], "--transport=mq") == 0) {
+      config.transport = ME_TRANSPORT_MQUEUE;
+    } else if (strcmp(argv[i], "-t=shm") == 0 ||
+               strcmp(argv[i], "--transport=shm") == 0) {
+      config.transport = ME_TRANSPORT_SHM;
+    } else if (strcmp(argv[i], "-x") == 0 ||
+               strcmp(argv[i], "--external") == 0) {
+      config.external = 1;
+    } else if (strncmp(argv[i], "-j=", 3) == 0) {
+      config.journal = argv[i] + 3;
+    } else if (strncmp(argv[i], "--journal=", 10) == 0) {
+      config.journal = argv[i] + 10;
+    } else if (strncmp(argv[i], "-M=", 3) == 0) {
+      config.memory = parse_memory(argv[i] + 3);
+    } else if (strncmp(argv[i], "--memory=", 9) == 0) {
+      config.memory = parse_memory(argv[i] + 9);
+    } else if (strncmp(argv[i], "-o=", 3) == 0) {
+      config.output = argv[i] + 3;
+    } else if (strncmp(argv[i], "--output=", 9) == 0) {
+      config.output = argv[i] + 9;
+    } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+      printf(help, argv[0]);
+      exit(0);
+    } else {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      exit(1);
+    }
+  }
+
+  if (config.messages <= 0 || config.securities <= 0 || config.depth <= 0 ||
+      config.level_orders <= 0 || config.seed == 0 ||
+      config.mix[0] + config.mix[1] + config.mix[2] + config.mix[3] != 100) {
+    fprintf(stderr, "Invalid configuration. See --help.\n");
+    exit(1);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  pthread_t engine_thread;
+  pthread_t receiver_thread;
+  MeMessage panic;
+  Resting *resting;
+
+  parse(argc, argv);
+
+  warmup_messages = config.securities * config.depth * config.level_orders * 2;
+  n_ids = warmup_messages + config.messages + 1;
+  cancel_sent = calloc(n_ids, sizeof(MeTimestamp));
+  seen = calloc(n_ids, sizeof(uint8_t));
+  new_latencies = malloc(config.messages * sizeof(uint64_t));
+  cancel_latencies = malloc(config.messages * sizeof(uint64_t));
+  resting = malloc(config.securities * sizeof(Resting));
+  for (int64_t s = 0; s < config.securities; s++) {
+    resting[s].used = 0;
+    resting[s].ids = malloc(n_ids * sizeof(MeOrderID));
+  }
+
+  if (!config.external) {
+    if (config.memory != 0)
+      engine = me_map_context(config.cache_size, config.pool_size,
+                              config.securities, config.transport,
+                              config.memory, malloc);
+    else
+      engine = me_alloc_context(config.cache_size, config.pool_size,
+                                config.securities, config.transport, malloc);
+    if (engine == NULL || errno != 0) {
+      perror("Could not allocate the engine context");
+      return 1;
+    }
+    if (config.journal != NULL &&
+        (errno = me_journal_open(engine, config.journal,
+                                 config.journal_sync)) != 0) {
+      perror("Could not open the journal");
+      return 1;
+    }
+    pthread_create(&engine_thread, NULL, run_engine, NULL);
+  }
+
+  if (me_client_init_context(&client) != 0) {
+    fprintf(stderr, "Could not init client context. Is the engine running?\n");
+    fprintf(stderr, "Opening %s or queues %s and %s failed ", me_shm_name,
+            me_in_queue_name, me_out_queue_name);
+    perror("with");
+    return errno;
+  }
+  pthread_create(&receiver_thread, NULL, receive, NULL);
+
+  warmup(resting);
+  toggle_counters(1);
+  /* Each engine thread clears its histograms before its next message. */
+  if (!config.external)
+    __atomic_add_fetch(&engine->stats->reset, 1, __ATOMIC_RELAXED);
+  MeTimestamp start = replay(resting);
+  while (__atomic_load_n(&measured_received, __ATOMIC_ACQUIRE) <
+         config.messages)
+    ;
+  toggle_counters(0);
+
+  /* The counters are only complete once the engine threads exit. */
+  if (!config.external) {
+    panic.msg_type = ME_MESSAGE_PANIC;
+    me_client_send_message(&client, &panic);
+    pthread_join(receiver_thread, NULL);
+    pthread_join(engine_thread, NULL);
+    for (int t = 0; t < ME_STATS_THREADS; t++) {
+      MeThreadStats *thread = &engine->stats->threads[t];
+      for (int c = 0; c < ME_STATS_CLASSES; c++)
+        if (c != me_stats_class(ME_MESSAGE_PANIC, 0))
+          me_stats_merge(&matched, &thread->histograms[c][ME_STATS_MATCH]);
+    }
+    ticks_per_ns = engine->stats->ticks_per_ns;
+    me_dealloc_context(engine, free);
+  }
+  me_client_close_context(&client);
+
+  report(start);
+
+  return 0;
+}
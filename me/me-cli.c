@@ -12,34 +12,70 @@ static const char *help =
     "Copyright (C) 2024  Gabriel de Brito\n"
     "\n"
     "Usage: %s <security ID> <message type> [message arguments]\n"
-    "Message arguments are in the form key=value\n"
+    "   or: %s - < messages\n"
+    "Message arguments are in the form key=value. With -, reads a message\n"
+    "per line from the standard input, as <security ID> <message type>\n"
+    "[message arguments], and sends them in batches of up to %d over a\n"
+    "single connection.\n"
     "\n"
     "Message types:\n"
     "buy\n"
     "	quantity=<number>\n"
     "	price=<number (zero or unset for market order)>\n"
+    "	type=<ioc or fok (unset to rest what isn't executed)>\n"
+    "	owner=<participant ID>\n"
+    "	expires=<seconds from now to cancel it (unset for never)>\n"
+    "	stop=<market price to enter it at (unset to enter it now)>\n"
+    "	display=<quantity shown at a time (unset to show it all)>\n"
     "sell\n"
     "	quantity=<number>\n"
     "	price=<number (zero or unset for market order)>\n"
+    "	type=<ioc or fok (unset to rest what isn't executed)>\n"
+    "	owner=<participant ID>\n"
+    "	expires=<seconds from now to cancel it (unset for never)>\n"
+    "	stop=<market price to enter it at (unset to enter it now)>\n"
+    "	display=<quantity shown at a time (unset to show it all)>\n"
     "set\n"
     "	price=<number>\n"
     "cancel\n"
     "	id=<order ID>\n"
+    "amend\n"
+    "	id=<order ID>\n"
+    "	quantity=<number (zero or unset to cancel)>\n"
+    "	price=<number (zero or unset to keep it)>\n"
+    "mass\n"
+    "	side=<buy or sell (unset for both)>\n"
+    "	owner=<participant ID (unset for everyone's orders)>\n"
+    "	orders=<1 to also get a cancellation for every order>\n"
     "panic\n"
     "	no arguments.\n"
+    "checkpoint\n"
+    "	no arguments. Needs the engine to be started with a snapshot path.\n"
     "\n"
-    "The panic message ignores the security ID.\n"
+    "The panic and checkpoint messages ignore the security ID. A mass\n"
+    "cancellation to security -1 cancels the orders of every security.\n"
     "Examples:\n"
     "$ %s 0 panic # to shutdown the engine\n"
     "$ %s 3 buy quantity=30 # buy 30 from security 3, market order\n"
-    "$ %s 5 sell quantity=20 price=10 # sell 20 of security 5, limit of 10\n";
+    "$ %s 5 sell quantity=20 price=10 # sell 20 of security 5, limit of 10\n"
+    "$ printf '1 buy quantity=5 price=9\\n1 sell quantity=5\\n' | %s -\n";
+
+/* Messages read from the standard input before sending them. */
+#define BATCH 1024
+/* Tokens of a line. */
+#define MAX_ARGS 16
 
 void build_order(MeMessage *message, char *argv[], int argc, MeSide side) {
   struct timespec time;
+  char type[8] = "";
+  unsigned int expires = 0;
+  unsigned long display = 0;
   message->msg_type = ME_MESSAGE_NEW_ORDER;
   message->message.order.side = side;
   message->message.order.quantity = 0;
   message->message.order.price = 0;
+  message->message.order.owner = 0;
+  message->message.stop.stop_price = 0;
   if (clock_gettime(CLOCK_REALTIME, &time)) {
     perror("Order build failed due to failure in retrieving timestamp");
     exit(1);
@@ -53,12 +89,42 @@ void build_order(MeMessage *message, char *argv[], int argc, MeSide side) {
     if (sscanf(argv[i], "price=%lu",
                (unsigned long *)&message->message.order.price))
       continue;
+    if (sscanf(argv[i], "type=%7s", type)) continue;
+    if (sscanf(argv[i], "owner=%u", &message->message.order.owner)) continue;
+    if (sscanf(argv[i], "expires=%u", &expires)) continue;
+    if (sscanf(argv[i], "stop=%lu",
+               (unsigned long *)&message->message.stop.stop_price))
+      continue;
+    if (sscanf(argv[i], "display=%lu", &display)) continue;
   }
+  message->message.order.expires = expires ? time.tv_sec + expires : 0;
 
-  if (message->message.order.price == 0)
+  if (display != 0 && (message->message.stop.stop_price != 0 ||
+                       type[0] != '\0' || message->message.order.price == 0)) {
+    fprintf(stderr, "Only limit orders can have a display quantity\n");
+    exit(1);
+  } else if (display != 0) {
+    message->message.order.ord_type = ME_ORDER_ICEBERG;
+    message->message.iceberg.display = display;
+  } else if (message->message.stop.stop_price != 0 && type[0] != '\0') {
+    fprintf(stderr, "Stop orders can't be of type %s\n", type);
+    exit(1);
+  } else if (message->message.stop.stop_price != 0) {
+    message->message.order.ord_type = message->message.order.price == 0
+                                          ? ME_ORDER_STOP
+                                          : ME_ORDER_STOP_LIMIT;
+  } else if (!strcmp(type, "ioc")) {
+    message->message.order.ord_type = ME_ORDER_IOC;
+  } else if (!strcmp(type, "fok")) {
+    message->message.order.ord_type = ME_ORDER_FOK;
+  } else if (type[0] != '\0') {
+    fprintf(stderr, "Unknown order type: %s\n", type);
+    exit(1);
+  } else if (message->message.order.price == 0) {
     message->message.order.ord_type = ME_ORDER_MARKET;
-  else
+  } else {
     message->message.order.ord_type = ME_ORDER_LIMIT;
+  }
 }
 
 void build_set_price(MeMessage *message, char *argv[], int argc) {
@@ -87,44 +153,162 @@ void build_cancel(MeMessage *message, char *argv[], int argc) {
   }
 }
 
-void build_panic(MeMessage *message) { message->msg_type = ME_MESSAGE_PANIC; }
+void build_amend(MeMessage *message, char *argv[], int argc) {
+  struct timespec time;
+  message->msg_type = ME_MESSAGE_AMEND_ORDER;
+  message->message.order.order_id = 0;
+  message->message.order.quantity = 0;
+  message->message.order.price = 0;
+  if (clock_gettime(CLOCK_REALTIME, &time)) {
+    perror("Amend build failed due to failure in retrieving timestamp");
+    exit(1);
+  }
+  message->message.order.timestamp = (MeTimestamp)time.tv_nsec;
 
-int main(int argc, char *argv[]) {
-  MeClientContext context;
-  MeMessage message;
+  for (int i = 3; i < argc; i++) {
+    if (sscanf(argv[i], "id=%lu",
+               (unsigned long *)&message->message.order.order_id))
+      continue;
+    if (sscanf(argv[i], "quantity=%lu",
+               (unsigned long *)&message->message.order.quantity))
+      continue;
+    if (sscanf(argv[i], "price=%lu",
+               (unsigned long *)&message->message.order.price))
+      continue;
+  }
 
-  if (argc < 3) {
-    printf(help, argv[0], argv[0], argv[0], argv[0]);
-    return 1;
+  if (message->message.order.order_id == 0) {
+    fprintf(stderr, "Refusing to send amendment to ID 0\n");
+    exit(1);
+  }
+}
+
+void build_mass_cancel(MeMessage *message, char *argv[], int argc) {
+  MeMassCancel *mass = &message->message.mass_cancel;
+  char side[8];
+  int orders;
+
+  message->msg_type = ME_MESSAGE_MASS_CANCEL;
+  mass->flags = 0;
+  mass->owner = 0;
+  mass->cancelled = 0;
+
+  for (int i = 3; i < argc; i++) {
+    if (sscanf(argv[i], "side=%7s", side)) {
+      if (!strcmp(side, "buy")) {
+        mass->flags |= ME_MASS_CANCEL_BUY;
+      } else if (!strcmp(side, "sell")) {
+        mass->flags |= ME_MASS_CANCEL_SELL;
+      } else {
+        fprintf(stderr, "Unknown side: %s\n", side);
+        exit(1);
+      }
+      continue;
+    }
+    if (sscanf(argv[i], "owner=%u", &mass->owner)) {
+      mass->flags |= ME_MASS_CANCEL_OWNER;
+      continue;
+    }
+    if (sscanf(argv[i], "orders=%d", &orders)) {
+      if (orders) mass->flags |= ME_MASS_CANCEL_ORDERS;
+      continue;
+    }
   }
+}
+
+void build_panic(MeMessage *message) { message->msg_type = ME_MESSAGE_PANIC; }
+
+void build_checkpoint(MeMessage *message) {
+  message->msg_type = ME_MESSAGE_CHECKPOINT;
+}
+
+static void print_help(char *name) {
+  printf(help, name, name, BATCH, name, name, name, name, name);
+}
 
-  sscanf(argv[1], "%zd", &message.security_id);
+/* Fills message from argv as given in the command line. Returns 0 or 1 if
+ * the message type is unknown. */
+int build(MeMessage *message, char *argv[], int argc) {
+  sscanf(argv[1], "%zd", &message->security_id);
 
   if (!strcmp(argv[2], "buy")) {
-    build_order(&message, argv, argc, ME_SIDE_BUY);
+    build_order(message, argv, argc, ME_SIDE_BUY);
   } else if (!strcmp(argv[2], "sell")) {
-    build_order(&message, argv, argc, ME_SIDE_SELL);
+    build_order(message, argv, argc, ME_SIDE_SELL);
   } else if (!strcmp(argv[2], "set")) {
-    build_set_price(&message, argv, argc);
+    build_set_price(message, argv, argc);
   } else if (!strcmp(argv[2], "cancel")) {
-    build_cancel(&message, argv, argc);
+    build_cancel(message, argv, argc);
+  } else if (!strcmp(argv[2], "amend")) {
+    build_amend(message, argv, argc);
+  } else if (!strcmp(argv[2], "mass")) {
+    build_mass_cancel(message, argv, argc);
   } else if (!strcmp(argv[2], "panic")) {
-    build_panic(&message);
+    build_panic(message);
+  } else if (!strcmp(argv[2], "checkpoint")) {
+    build_checkpoint(message);
   } else {
     fprintf(stderr, "Unknown message type: %s\n", argv[2]);
-    printf(help, argv[0], argv[0], argv[0], argv[0]);
+    return 1;
+  }
+  return 0;
+}
+
+/* Sends the messages read from the standard input. */
+int send_input(MeClientContext *context, char *name) {
+  static MeMessage batch[BATCH];
+  char line[1024];
+  char *args[MAX_ARGS];
+  int64_t n = 0;
+  int64_t line_no = 0;
+  int r;
+
+  args[0] = name;
+  while (fgets(line, sizeof(line), stdin) != NULL) {
+    int argc = 1;
+    line_no++;
+    for (char *token = strtok(line, " \t\n"); token != NULL && argc < MAX_ARGS;
+         token = strtok(NULL, " \t\n"))
+      args[argc++] = token;
+    if (argc == 1) continue;
+    if (argc < 3 || build(&batch[n], args, argc) != 0) {
+      fprintf(stderr, "Skipping line %ld\n", line_no);
+      continue;
+    }
+    if (++n == BATCH) {
+      if ((r = me_client_send_messages(context, batch, n)) != 0) return r;
+      n = 0;
+    }
+  }
+  return me_client_send_messages(context, batch, n);
+}
+
+int main(int argc, char *argv[]) {
+  MeClientContext context;
+  MeMessage message;
+  int from_input = argc == 2 && !strcmp(argv[1], "-");
+
+  if (!from_input && argc < 3) {
+    print_help(argv[0]);
+    return 1;
+  }
+  if (!from_input && build(&message, argv, argc) != 0) {
+    print_help(argv[0]);
     return 1;
   }
 
   if (me_client_init_context(&context) != 0) {
     fprintf(stderr, "Could not init client context. Is the engine running?\n");
-    fprintf(stderr, "Opening queues %s and %s failed ", me_in_queue_name,
-            me_out_queue_name);
+    fprintf(stderr, "Opening %s or queues %s and %s failed ", me_shm_name,
+            me_in_queue_name, me_out_queue_name);
     perror("with");
     return errno;
   }
 
-  me_client_send_message(&context, &message);
+  if (from_input)
+    errno = send_input(&context, argv[0]);
+  else
+    me_client_send_message(&context, &message);
   if (errno) {
     perror("shit: ");
     printf("\n");
@@ -0,0 +1,168 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "me.h"
+
+static const char *help =
+    "FinTEx Matching Engine Journal\n"
+    "Copyright (C) 2024  Gabriel de Brito\n"
+    "\n"
+    "Usage: %s [options] <journal>\n"
+    "Prints every record of a journal written by the engine (see me -j).\n"
+    "Options:\n"
+    "\n"
+    "-v --verify\n"
+    "	Only check the records and print a summary. Fails if the header is\n"
+    "	bad or a record the engine synced is torn. The engine's threads\n"
+    "	write their records at once, so a crash can tear any of the last\n"
+    "	ones; it replays up to the first torn one and drops the rest, which\n"
+    "	aren't printed either.\n";
+
+static const char *order_names[] = {
+    [ME_ORDER_MARKET] = "MARKET",
+    [ME_ORDER_LIMIT] = "LIMIT",
+    [ME_ORDER_IOC] = "IOC",
+    [ME_ORDER_FOK] = "FOK",
+    [ME_ORDER_STOP] = "STOP",
+    [ME_ORDER_STOP_LIMIT] = "STOP LIMIT",
+    [ME_ORDER_ICEBERG] = "ICEBERG",
+};
+
+/* As me-stats, "?" for a type this doesn't know. */
+static const char *order_name(MeOrderType type) {
+  size_t n = sizeof(order_names) / sizeof(order_names[0]);
+  return (size_t)type < n && order_names[type] ? order_names[type] : "?";
+}
+
+/* By the side flags of a mass cancellation. */
+static const char *mass_sides[] = {"BOTH", "BUY", "SELL", "BOTH"};
+
+static const char *side(MeOrder *o) {
+  return o->side == ME_SIDE_BUY ? "BUY" : "SELL";
+}
+
+static int valid_record(MeJournalRecord *record, uint64_t seq) {
+  return record->seq == seq && record->checksum == me_journal_checksum(record);
+}
+
+static void print_record(MeJournalRecord *record) {
+  MeMessage *m = &record->msg;
+  MeOrder *o = &m->message.order;
+  MeMassCancel *mass = &m->message.mass_cancel;
+
+  printf("%10lu %8ld: ", record->seq, m->security_id);
+  switch (m->msg_type) {
+    case ME_MESSAGE_NEW_ORDER:
+      if (o->ord_type == ME_ORDER_MARKET)
+        printf("NEW ORDER (MARKET): SIDE=%s QUANTITY=%ld ID=%ld OWNER=%u",
+               side(o), o->quantity, o->order_id, o->owner);
+      else
+        printf("NEW ORDER (%s): SIDE=%s QUANTITY=%ld PRICE=%ld ID=%ld OWNER=%u",
+               order_name(o->ord_type), side(o), o->quantity, o->price,
+               o->order_id, o->owner);
+      if (o->ord_type == ME_ORDER_STOP || o->ord_type == ME_ORDER_STOP_LIMIT)
+        printf(" STOP=%ld", m->message.stop.stop_price);
+      if (o->ord_type == ME_ORDER_ICEBERG)
+        printf(" DISPLAY=%ld", m->message.iceberg.display);
+      if (o->expires != 0) printf(" EXPIRES=%u", o->expires);
+      printf("\n");
+      break;
+    case ME_MESSAGE_CANCEL_ORDER:
+      printf("CANCEL ORDER: ID=%ld\n", m->message.to_cancel);
+      break;
+    case ME_MESSAGE_AMEND_ORDER:
+      printf("AMEND ORDER: QUANTITY=%ld PRICE=%ld ID=%ld\n", o->quantity,
+             o->price, o->order_id);
+      break;
+    case ME_MESSAGE_MASS_CANCEL:
+      printf("MASS CANCEL: SIDE=%s OWNER=", mass_sides[mass->flags & 3]);
+      if (mass->flags & ME_MASS_CANCEL_OWNER)
+        printf("%u\n", mass->owner);
+      else
+        printf("ANY\n");
+      break;
+    case ME_MESSAGE_EXPIRE:
+      printf("EXPIRE: UNTIL=%lu\n", m->message.expire);
+      break;
+    case ME_MESSAGE_SET_MARKET_PRICE:
+      printf("SET MARKET PRICE: PRICE=%ld\n", m->message.set_market_price);
+      break;
+    default:
+      printf("UNEXPECTED MESSAGE TYPE %d\n", m->msg_type);
+      break;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  char *path = NULL;
+  int verify = 0;
+  struct stat st;
+  int fd;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verify") == 0) {
+      verify = 1;
+    } else if (argv[i][0] != '-' && path == NULL) {
+      path = argv[i];
+    } else {
+      printf(help, argv[0]);
+      return strcmp(argv[i], "-h") != 0 && strcmp(argv[i], "--help") != 0;
+    }
+  }
+  if (path == NULL) {
+    printf(help, argv[0]);
+    return 1;
+  }
+
+  if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+    perror("Opening the journal failed");
+    return errno;
+  }
+  if ((size_t)st.st_size < sizeof(MeJournalHeader)) {
+    fprintf(stderr, "%s is too short to be a journal.\n", path);
+    return 1;
+  }
+  MeJournalHeader *header =
+      mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (header == MAP_FAILED) {
+    perror("Mapping the journal failed");
+    return errno;
+  }
+  if (header->magic != ME_JOURNAL_MAGIC ||
+      header->version != ME_JOURNAL_VERSION ||
+      header->record_size != sizeof(MeJournalRecord)) {
+    fprintf(stderr, "%s is not a journal of this engine version.\n", path);
+    return 1;
+  }
+
+  MeJournalRecord *records = (MeJournalRecord *)(header + 1);
+  uint64_t n = (st.st_size - sizeof(MeJournalHeader)) / sizeof(MeJournalRecord);
+  uint64_t valid = 0;
+  /* Records checking past the first torn one. */
+  uint64_t dropped = 0;
+
+  for (; valid < n && valid_record(&records[valid], valid); valid++)
+    if (!verify) print_record(&records[valid]);
+  for (uint64_t i = valid + 1; i < n; i++)
+    if (valid_record(&records[i], i)) dropped++;
+
+  int ok = valid >= header->synced;
+  if (verify || !ok)
+    fprintf(verify ? stdout : stderr,
+            "%s: %ld securities, %lu records, %lu dropped past a torn one. "
+            "%s\n",
+            path, header->n_securities, valid, dropped,
+            ok ? "OK" : "CORRUPT");
+
+  munmap(header, st.st_size);
+  close(fd);
+
+  return !ok;
+}
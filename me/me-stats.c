@@ -0,0 +1,138 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "me.h"
+
+static const char *help =
+    "FinTEx Matching Engine Statistics\n"
+    "Copyright (C) 2024  Gabriel de Brito\n"
+    "\n"
+    "Usage: %s [options]\n"
+    "Prints the latency histograms of a running engine, in nanoseconds,\n"
+    "summed over all of its threads. \"match\" goes from dequeuing a message\n"
+    "to having it matched and \"publish\" from there to having its events\n"
+    "sent. Then prints how much of the overflow pool is used, by block size,\n"
+    "how often it couldn't be extended (cancelling the orders needing it),\n"
+    "how long checkpoints stopped matching and took to be written, and how\n"
+    "many subscribers were evicted for falling behind.\n"
+    "Options:\n"
+    "\n"
+    "-r --reset\n"
+    "	Clears the histograms after printing them. Each engine thread clears\n"
+    "	its own when it handles its next message.\n";
+
+static const char *message_names[] = {
+    [ME_MESSAGE_NEW_ORDER] = "NEW ORDER",
+    [ME_MESSAGE_CANCEL_ORDER] = "CANCEL ORDER",
+    [ME_MESSAGE_SET_MARKET_PRICE] = "SET MARKET PRICE",
+    [ME_MESSAGE_TRADE] = "TRADE",
+    [ME_MESSAGE_ORDER_EXECUTED] = "ORDER EXECUTED",
+    [ME_MESSAGE_PANIC] = "PANIC",
+    [ME_MESSAGE_CHECKPOINT] = "CHECKPOINT",
+    [ME_MESSAGE_DEPTH] = "DEPTH",
+    [ME_MESSAGE_AMEND_ORDER] = "AMEND ORDER",
+    [ME_MESSAGE_MASS_CANCEL] = "MASS CANCEL",
+    [ME_MESSAGE_EXPIRE] = "EXPIRE",
+};
+
+static const char *order_names[] = {
+    [ME_ORDER_MARKET] = "MARKET",
+    [ME_ORDER_LIMIT] = "LIMIT",
+    [ME_ORDER_IOC] = "IOC",
+    [ME_ORDER_FOK] = "FOK",
+    [ME_ORDER_STOP] = "STOP",
+    [ME_ORDER_STOP_LIMIT] = "STOP LIMIT",
+    [ME_ORDER_ICEBERG] = "ICEBERG",
+};
+
+static const char *phase_names[] = {
+    [ME_STATS_MATCH] = "match",
+    [ME_STATS_PUBLISH] = "publish",
+};
+
+static void class_name(int class, char *buf, size_t size) {
+  int i = class - ME_STATS_MESSAGE_TYPES;
+  size_t n_orders = sizeof(order_names) / sizeof(order_names[0]);
+  size_t n_messages = sizeof(message_names) / sizeof(message_names[0]);
+
+  if (i >= 0)
+    snprintf(buf, size, "NEW ORDER (%s)",
+             (size_t)i < n_orders && order_names[i] ? order_names[i] : "?");
+  else
+    snprintf(buf, size, "%s",
+             (size_t)class < n_messages && message_names[class]
+                 ? message_names[class]
+                 : "?");
+}
+
+int main(int argc, char *argv[]) {
+  MeStats *stats;
+  MeHistogram sum;
+  char name[64];
+  int reset = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--reset") == 0) {
+      reset = 1;
+    } else {
+      printf(help, argv[0]);
+      return strcmp(argv[i], "-h") != 0 && strcmp(argv[i], "--help") != 0;
+    }
+  }
+
+  if (me_stats_open(&stats) != 0) {
+    perror("Could not open the statistics. Is the engine running?");
+    return errno;
+  }
+
+  double ns = stats->ticks_per_ns;
+  printf("%-24s %-8s %12s %10s %10s %10s %10s\n", "MESSAGE", "PHASE", "COUNT",
+         "P50", "P99", "P99.9", "MAX");
+
+  for (int class = 0; class < ME_STATS_CLASSES; class++) {
+    for (int phase = 0; phase < ME_STATS_PHASES; phase++) {
+      memset(&sum, 0, sizeof(MeHistogram));
+      for (int t = 0; t < ME_STATS_THREADS; t++)
+        me_stats_merge(&sum, &stats->threads[t].histograms[class][phase]);
+      if (sum.count == 0) continue;
+
+      class_name(class, name, sizeof(name));
+      printf("%-24s %-8s %12lu %10.0f %10.0f %10.0f %10.0f\n", name,
+             phase_names[phase], sum.count,
+             me_stats_percentile(&sum, 0.5) / ns,
+             me_stats_percentile(&sum, 0.99) / ns,
+             me_stats_percentile(&sum, 0.999) / ns, sum.max / ns);
+    }
+  }
+
+  MePoolStats *pool = &stats->pool;
+  printf("\nPOOL %lu bytes, %lu carved, %lu extensions, %lu failed\n",
+         pool->size, pool->carved, pool->extensions, pool->failures);
+  printf("%-24s %12s %12s\n", "BLOCK", "IN USE", "HIGH WATER");
+  for (int class = 0; class < ME_POOL_CLASSES; class++) {
+    if (pool->high_water[class] == 0) continue;
+    printf("%-24lu %12lu %12lu\n", (uint64_t)1 << class, pool->in_use[class],
+           pool->high_water[class]);
+  }
+
+  MeCheckpointStats *checkpoints = &stats->checkpoints;
+  printf("\nCHECKPOINTS %lu taken, %lu written, %lu failed, %lu skipped\n",
+         checkpoints->taken, checkpoints->written, checkpoints->failed,
+         checkpoints->skipped);
+  if (checkpoints->taken > 0)
+    printf("Matching stopped for %.0f ns (at most %.0f ns)\n",
+           checkpoints->pause / ns, checkpoints->max_pause / ns);
+  if (checkpoints->written > 0)
+    printf("Last written in %.3f ms, reflecting %lu messages\n",
+           checkpoints->write / ns / 1e6, checkpoints->messages);
+
+  printf("\nSUBSCRIBERS %lu evicted\n", stats->evictions);
+
+  if (reset) __atomic_add_fetch(&stats->reset, 1, __ATOMIC_RELAXED);
+  me_stats_close(stats);
+
+  return 0;
+}
@@ -1,566 +1,3266 @@
+/* shm_open, mmap, ftruncate, sched_yield, sched_setaffinity, getcpu, kill,
+ * MAP_NORESERVE and MAP_HUGETLB. */
+#define _GNU_SOURCE
+
 #include "me.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <linux/mempolicy.h>
 #include <mqueue.h>
 #include <omp.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Shared memory rings.
+ */
+
+/* Iterations spent spinning on an empty (or full) ring before yielding. */
+#define SPIN_LIMIT 4096
+
+static inline void relax(uint64_t *spins) {
+  if (++(*spins) < SPIN_LIMIT) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+  } else {
+    /* Nothing to do anyway, so we can afford the syscall. */
+    *spins = 0;
+    sched_yield();
+  }
+}
 
-/* Most of the matching logic was implemented for buy orders and them
- * copy-pasted to sell ones, which is not exactly a good pratice but does the
- * job. */
+static void ring_init(MeRing *ring) {
+  ring->head = 0;
+  ring->tail = 0;
+  for (uint64_t i = 0; i < ME_RING_SLOTS; i++) ring->slots[i].seq = i;
+}
 
-MeContext *me_alloc_context(size_t l2_s, int64_t n_secs,
-                            void *(*allocate)(size_t)) {
-  MeContext *context;
-  struct mq_attr qattr;
-  mqd_t dumb_q;
+static inline void ring_push(MeRing *ring, MeMessage *msg) {
+  uint64_t spins = 0;
+  uint64_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  MeRingSlot *slot;
+
+  for (;;) {
+    slot = &ring->slots[pos & (ME_RING_SLOTS - 1)];
+    int64_t diff =
+        (int64_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (int64_t)pos;
+    if (diff == 0) {
+      /* On failure pos is reloaded with the current tail. */
+      if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else {
+      /* Ring full (diff < 0) or someone else took the slot. */
+      if (diff < 0) relax(&spins);
+      pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    }
+  }
 
-  errno = 0;
+  slot->msg = *msg;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
 
-  if (l2_s < ME_MINIMUM_MEMORY(n_secs) || n_secs == 0) {
-    errno = EDOM;
-    return NULL;
+/* As ring_push, but returns 0 rather than waiting if the ring is full. */
+static inline int ring_try_push(MeRing *ring, MeMessage *msg) {
+  uint64_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  MeRingSlot *slot;
+
+  for (;;) {
+    slot = &ring->slots[pos & (ME_RING_SLOTS - 1)];
+    int64_t diff =
+        (int64_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (int64_t)pos;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    }
   }
 
-  if (!(context = allocate(l2_s))) return NULL;
+  slot->msg = *msg;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+  return 1;
+}
 
-  context->n_securities = n_secs;
-  context->allocate = allocate;
+/* Reserves n consecutive slots at once, so a frame is published with a single
+ * compare-and-swap. */
+static inline void ring_push_n(MeRing *ring, MeMessage *msgs, int64_t n) {
+  uint64_t spins = 0;
+  uint64_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  int64_t i;
+
+  for (;;) {
+    for (i = 0; i < n; i++) {
+      MeRingSlot *slot = &ring->slots[(pos + i) & (ME_RING_SLOTS - 1)];
+      if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + i) break;
+    }
+    if (i == n) {
+      if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + n, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else {
+      relax(&spins);
+      pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    }
+  }
+
+  for (i = 0; i < n; i++) {
+    MeRingSlot *slot = &ring->slots[(pos + i) & (ME_RING_SLOTS - 1)];
+    slot->msg = msgs[i];
+    __atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+  }
+}
+
+/* Returns 0 if the ring is empty. */
+static inline int ring_try_pop(MeRing *ring, MeMessage *msg) {
+  uint64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  MeRingSlot *slot;
+
+  for (;;) {
+    slot = &ring->slots[pos & (ME_RING_SLOTS - 1)];
+    int64_t diff = (int64_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+                   (int64_t)(pos + 1);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    }
+  }
+
+  *msg = slot->msg;
+  __atomic_store_n(&slot->seq, pos + ME_RING_SLOTS, __ATOMIC_RELEASE);
+  return 1;
+}
+
+static inline void ring_pop(MeRing *ring, MeMessage *msg) {
+  uint64_t spins = 0;
+  while (!ring_try_pop(ring, msg)) relax(&spins);
+}
+
+/* Waits for at least one message and takes up to max of the consecutive ones
+ * that are ready with a single compare-and-swap, up to a panic, so what's
+ * behind it is left for the next run. Returns how many, 0 if none came by the
+ * Unix time until (if not 0). */
+static inline int64_t ring_pop_n(MeRing *ring, MeMessage *msgs, int64_t max,
+                                 time_t until) {
+  uint64_t spins = 0;
+  uint64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  int64_t n;
+
+  for (;;) {
+    for (n = 0; n < max; n++) {
+      MeRingSlot *slot = &ring->slots[(pos + n) & (ME_RING_SLOTS - 1)];
+      if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + n + 1) break;
+      /* Still there, as the compare-and-swap fails if it was taken. */
+      if (slot->msg.msg_type == ME_MESSAGE_PANIC) {
+        n++;
+        break;
+      }
+    }
+    if (n > 0) {
+      if (__atomic_compare_exchange_n(&ring->head, &pos, pos + n, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else {
+      relax(&spins);
+      /* Only after yielding. */
+      if (until != 0 && spins == 0 && time(NULL) >= until) return 0;
+      pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    }
+  }
+
+  for (int64_t i = 0; i < n; i++) {
+    MeRingSlot *slot = &ring->slots[(pos + i) & (ME_RING_SLOTS - 1)];
+    msgs[i] = slot->msg;
+    __atomic_store_n(&slot->seq, pos + i + ME_RING_SLOTS, __ATOMIC_RELEASE);
+  }
+  return n;
+}
+
+/*
+ * Statistics.
+ */
+
+static const char *me_stats_name = "/fintexmestats";
+
+static inline uint64_t ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+#endif
+}
+
+static double calibrate_ticks(void) {
+  struct timespec start, end;
+  int64_t elapsed;
+  uint64_t start_ticks = ticks();
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed = (end.tv_sec - start.tv_sec) * 1000000000 +
+              (end.tv_nsec - start.tv_nsec);
+  } while (elapsed < 10000000);
+
+  return (double)(ticks() - start_ticks) / elapsed;
+}
+
+static int open_stats(MeStats **stats, int create) {
+  int fd;
+  int flags = create ? O_CREAT | O_RDWR : O_RDWR;
+
+  if ((fd = shm_open(me_stats_name, flags, 0777)) == -1) return errno;
+  if (create && ftruncate(fd, sizeof(MeStats)) == -1) {
+    close(fd);
+    return errno;
+  }
+  *stats =
+      mmap(NULL, sizeof(MeStats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (*stats == MAP_FAILED) return errno;
+
+  /* ftruncate already zeroed the histograms. */
+  if (create) (*stats)->ticks_per_ns = calibrate_ticks();
+  return 0;
+}
+
+int me_stats_class(MeMessageType msg_type, MeOrderType ord_type) {
+  if (msg_type == ME_MESSAGE_NEW_ORDER)
+    return ME_STATS_MESSAGE_TYPES + (ord_type % ME_STATS_ORDER_TYPES);
+  return msg_type % ME_STATS_MESSAGE_TYPES;
+}
+
+static inline int64_t stats_bucket(uint64_t value) {
+  if (value < (1 << ME_STATS_SUB_BITS)) return value;
+  int msb = 63 - __builtin_clzll(value);
+  return (int64_t)(msb - ME_STATS_SUB_BITS + 1) << ME_STATS_SUB_BITS |
+         ((value >> (msb - ME_STATS_SUB_BITS)) &
+          ((1 << ME_STATS_SUB_BITS) - 1));
+}
+
+uint64_t me_stats_bucket_value(int64_t bucket) {
+  if (bucket < (1 << ME_STATS_SUB_BITS)) return bucket;
+  int msb = (bucket >> ME_STATS_SUB_BITS) + ME_STATS_SUB_BITS - 1;
+  uint64_t sub = bucket & ((1 << ME_STATS_SUB_BITS) - 1);
+  return ((1 << ME_STATS_SUB_BITS) | sub) << (msb - ME_STATS_SUB_BITS);
+}
+
+void me_stats_merge(MeHistogram *into, MeHistogram *from) {
+  into->count += from->count;
+  if (from->max > into->max) into->max = from->max;
+  for (int64_t i = 0; i < ME_STATS_BUCKETS; i++)
+    into->buckets[i] += from->buckets[i];
+}
+
+uint64_t me_stats_percentile(MeHistogram *histogram, double fraction) {
+  uint64_t target = fraction * histogram->count;
+  uint64_t seen = 0;
+
+  if (histogram->count == 0) return 0;
+  for (int64_t i = 0; i < ME_STATS_BUCKETS; i++) {
+    seen += histogram->buckets[i];
+    if (seen > target) return me_stats_bucket_value(i);
+  }
+  return histogram->max;
+}
+
+static inline void stats_record(MeHistogram *histogram, uint64_t value) {
+  histogram->count++;
+  histogram->buckets[stats_bucket(value)]++;
+  if (value > histogram->max) histogram->max = value;
+}
+
+int me_stats_open(MeStats **stats) { return open_stats(stats, 0); }
+
+void me_stats_close(MeStats *stats) { munmap(stats, sizeof(MeStats)); }
+
+/*
+ * Broadcast of the engine events (see MeBroadcast).
+ */
+
+static void broadcast_init(MeBroadcast *broadcast) {
+  broadcast->tail = 0;
+  broadcast->gate = 0;
+  memset(broadcast->subscribers, 0, sizeof(broadcast->subscribers));
+  for (uint64_t i = 0; i < ME_RING_SLOTS; i++) broadcast->slots[i].seq = 0;
+}
+
+static inline int process_gone(pid_t pid) {
+  return kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+/* Lowest cursor of the active subscribers, or the tail if there are none. */
+static uint64_t broadcast_gate(MeBroadcast *broadcast) {
+  uint64_t gate = __atomic_load_n(&broadcast->tail, __ATOMIC_RELAXED);
+
+  for (int i = 0; i < ME_SUBSCRIBERS; i++) {
+    MeSubscriber *s = &broadcast->subscribers[i];
+    if (__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != ME_SUBSCRIBER_ACTIVE)
+      continue;
+    uint64_t cursor = __atomic_load_n(&s->cursor, __ATOMIC_ACQUIRE);
+    if (cursor < gate) gate = cursor;
+  }
+  return gate;
+}
+
+/* Stops waiting for the subscribers keeping positions up to end from being
+ * written, if they ran out of patience or their process is gone. */
+static void broadcast_evict(MeContext *context, MeBroadcast *broadcast,
+                            uint64_t end, int impatient) {
+  for (int i = 0; i < ME_SUBSCRIBERS; i++) {
+    MeSubscriber *s = &broadcast->subscribers[i];
+    uint64_t state = ME_SUBSCRIBER_ACTIVE;
+    if (__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) != state ||
+        __atomic_load_n(&s->cursor, __ATOMIC_ACQUIRE) + ME_RING_SLOTS >= end ||
+        !(impatient || process_gone(s->pid)))
+      continue;
+    if (__atomic_compare_exchange_n(&s->state, &state, ME_SUBSCRIBER_EVICTED,
+                                    0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      __atomic_add_fetch(&context->stats->evictions, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/* Waits until positions up to end can be written. */
+static void broadcast_wait(MeContext *context, MeBroadcast *broadcast,
+                           uint64_t end) {
+  uint64_t patience =
+      ME_SUBSCRIBER_PATIENCE_MS * 1e6 * context->stats->ticks_per_ns;
+  uint64_t spins = 0;
+  uint64_t started = 0;
+
+  for (;;) {
+    uint64_t gate = broadcast_gate(broadcast);
+    __atomic_store_n(&broadcast->gate, gate, __ATOMIC_RELAXED);
+    if (end <= gate + ME_RING_SLOTS) return;
+
+    if (started == 0) {
+      /* The gate was just stale, unless someone is really behind. */
+      broadcast_evict(context, broadcast, end, 0);
+      started = ticks();
+    } else if (ticks() - started > patience) {
+      broadcast_evict(context, broadcast, end, 1);
+    }
+    relax(&spins);
+  }
+}
+
+/* Like ring_push_n, but slots are reused once every subscriber read them. */
+static inline void broadcast_push_n(MeContext *context, MeBroadcast *broadcast,
+                                    MeMessage *msgs, int64_t n) {
+  uint64_t pos = __atomic_load_n(&broadcast->tail, __ATOMIC_RELAXED);
+
+  do {
+    if (pos + n > __atomic_load_n(&broadcast->gate, __ATOMIC_RELAXED) +
+                      ME_RING_SLOTS)
+      broadcast_wait(context, broadcast, pos + n);
+    /* On failure pos is reloaded and checked against the gate again. */
+  } while (!__atomic_compare_exchange_n(&broadcast->tail, &pos, pos + n, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  for (int64_t i = 0; i < n; i++) {
+    uint64_t at = pos + i;
+    MeRingSlot *slot = &broadcast->slots[at & (ME_RING_SLOTS - 1)];
+    uint64_t spins = 0;
+
+    /* Without subscribers, the thread writing the previous lap may still be
+     * at it. */
+    while ((int64_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) <
+           (int64_t)at + 1 - ME_RING_SLOTS)
+      relax(&spins);
+    __atomic_store_n(&slot->seq, at, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    slot->msg = msgs[i];
+    __atomic_store_n(&slot->seq, at + 1, __ATOMIC_RELEASE);
+  }
+}
+
+/* Starts at the tail. Entries of dead processes are reused. */
+static int broadcast_subscribe(MeBroadcast *broadcast,
+                               MeSubscriber **subscriber) {
+  for (int i = 0; i < ME_SUBSCRIBERS; i++) {
+    MeSubscriber *s = &broadcast->subscribers[i];
+    uint64_t state = __atomic_load_n(&s->state, __ATOMIC_ACQUIRE);
+    if (state == ME_SUBSCRIBER_JOINING ||
+        (state != ME_SUBSCRIBER_FREE && !process_gone(s->pid)))
+      continue;
+    if (!__atomic_compare_exchange_n(&s->state, &state, ME_SUBSCRIBER_JOINING,
+                                     0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      continue;
+
+    s->pid = getpid();
+    __atomic_store_n(&s->cursor,
+                     __atomic_load_n(&broadcast->tail, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    /* Producers only look at the cursor once it's active. */
+    __atomic_store_n(&s->state, ME_SUBSCRIBER_ACTIVE, __ATOMIC_RELEASE);
+    *subscriber = s;
+    return 0;
+  }
+  return EUSERS;
+}
+
+/* Returns 1 if a message was read, 0 if there's none yet and -1 once
+ * evicted. */
+static inline int broadcast_try_read(MeBroadcast *broadcast,
+                                     MeSubscriber *subscriber, MeMessage *msg) {
+  uint64_t pos = __atomic_load_n(&subscriber->cursor, __ATOMIC_RELAXED);
+  MeRingSlot *slot = &broadcast->slots[pos & (ME_RING_SLOTS - 1)];
+
+  if (__atomic_load_n(&subscriber->state, __ATOMIC_RELAXED) !=
+      ME_SUBSCRIBER_ACTIVE)
+    return -1;
+
+  int64_t diff = (int64_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) -
+                 (int64_t)(pos + 1);
+  if (diff < 0) return 0;
+  if (diff == 0) {
+    *msg = slot->msg;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == pos + 1) {
+      __atomic_store_n(&subscriber->cursor, pos + 1, __ATOMIC_RELEASE);
+      return 1;
+    }
+  }
+  /* Lapped, which only happens when the engine stopped waiting for us. */
+  return -1;
+}
+
+static int open_shm(MeShm **shm, int create) {
+  int fd;
+  int flags = create ? O_CREAT | O_RDWR : O_RDWR;
+
+  if ((fd = shm_open(me_shm_name, flags, 0777)) == -1) return errno;
+  if (create && ftruncate(fd, sizeof(MeShm)) == -1) {
+    close(fd);
+    return errno;
+  }
+  *shm = mmap(NULL, sizeof(MeShm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (*shm == MAP_FAILED) return errno;
+
+  if (create) {
+    ring_init(&(*shm)->incoming);
+    broadcast_init(&(*shm)->outcoming);
+  }
+  return 0;
+}
+
+/*
+ * Conflated state.
+ */
+
+static inline size_t conflated_size(int64_t n_securities) {
+  return sizeof(MeConflatedPage) + n_securities * sizeof(MeConflated);
+}
+
+int me_conflated_open(MeConflatedPage **page) {
+  struct stat st;
+  int fd;
+
+  if ((fd = shm_open(me_conflated_name, O_RDONLY, 0)) == -1) return errno;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return errno;
+  }
+  *page = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (*page == MAP_FAILED) return errno;
+  if ((size_t)st.st_size < conflated_size((*page)->n_securities)) {
+    munmap(*page, st.st_size);
+    return EINVAL;
+  }
+  return 0;
+}
+
+void me_conflated_close(MeConflatedPage *page) {
+  munmap(page, conflated_size(page->n_securities));
+}
+
+void me_conflated_read(MeConflatedPage *page, int64_t security_id,
+                       MeConflated *state) {
+  MeConflated *slot = &page->securities[security_id];
+  uint64_t spins = 0;
+  uint64_t seq;
+
+  for (;;) {
+    seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      relax(&spins);
+      continue;
+    }
+    state->updates = __atomic_load_n(&slot->updates, __ATOMIC_RELAXED);
+    state->market_price =
+        __atomic_load_n(&slot->market_price, __ATOMIC_RELAXED);
+    state->bid = __atomic_load_n(&slot->bid, __ATOMIC_RELAXED);
+    state->bid_quantity =
+        __atomic_load_n(&slot->bid_quantity, __ATOMIC_RELAXED);
+    state->ask = __atomic_load_n(&slot->ask, __ATOMIC_RELAXED);
+    state->ask_quantity =
+        __atomic_load_n(&slot->ask_quantity, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) break;
+  }
+  state->seq = seq;
+}
+
+/* Already in the past, so mq_timedreceive doesn't wait. */
+static const struct timespec no_wait = {0, 0};
+
+static int open_queues(MeContext *context) {
+  struct mq_attr qattr;
+  struct mq_attr frame_qattr;
+  mqd_t dumb_q;
 
   /* Create a dumb queue to get the attributes. */
   if ((dumb_q = mq_open("/fintexmedumb", O_CREAT | O_RDWR | O_NONBLOCK, 0777,
                         NULL)) == -1) {
-    return context;
+    return errno;
   }
 
   mq_getattr(dumb_q, &qattr);
   mq_close(dumb_q);
   mq_unlink("/fintexmedumb");
   qattr.mq_msgsize = sizeof(MeMessage);
+  frame_qattr = qattr;
+  frame_qattr.mq_msgsize = sizeof(MeFrame);
 
   if ((context->incoming =
            mq_open(me_in_queue_name, O_CREAT | O_RDWR, 0777, &qattr)) == -1) {
-    return context;
+    return errno;
+  }
+  if ((context->outcoming = mq_open(me_out_queue_name, O_CREAT | O_RDWR, 0777,
+                                    &frame_qattr)) == -1) {
+    return errno;
+  }
+
+  return 0;
+}
+
+/*
+ * Overflow pool.
+ */
+
+/* Blocks are at least big enough for the free list pointer. */
+static inline int pool_class(size_t size) {
+  return size <= sizeof(void *) ? 3 : 64 - __builtin_clzll(size - 1);
+}
+
+static inline size_t pool_round(size_t size) {
+  return (size_t)1 << pool_class(size);
+}
+
+static void pool_add(MePool *pool, MeArena *arena, size_t size, int mapped) {
+  arena->size = size;
+  arena->mapped = mapped;
+  arena->next = pool->arenas;
+  pool->arenas = arena;
+  pool->next = (size_t)(arena + 1);
+  pool->end = pool->next + size;
+  pool->stats->size += size;
+}
+
+/* The new arena must fit a block aligned to its size. The pool at least
+ * doubles, so there are few arenas. */
+static int pool_extend(MeContext *context, MePool *pool, size_t block) {
+  size_t size = pool->arena_s > 2 * block ? pool->arena_s : 2 * block;
+  if (size < pool->stats->size) size = pool->stats->size;
+  MeArena *arena = context->allocate(sizeof(MeArena) + size);
+
+  if (arena == NULL) return errno;
+  pool_add(pool, arena, size, 0);
+  return 0;
+}
+
+/* The first arena is allocated unless one is given. */
+static int pool_init(MeContext *context, MePool *pool, size_t pool_s,
+                     MeArena *arena) {
+  omp_init_lock(&pool->lock);
+  pool->arenas = NULL;
+  pool->next = 0;
+  pool->end = 0;
+  pool->arena_s = pool_s;
+  memset(pool->free, 0, sizeof(pool->free));
+  pool->stats = &context->stats->pool;
+  memset(pool->stats, 0, sizeof(MePoolStats));
+
+  if (pool_s == 0) return 0;
+  if (arena == NULL) return pool_extend(context, pool, 0);
+  pool_add(pool, arena, pool_s, 1);
+  return 0;
+}
+
+static void *pool_alloc(MeContext *context, size_t size) {
+  MePool *pool = &context->pool;
+  int class = pool_class(size);
+  size_t block = (size_t)1 << class;
+  size_t start;
+  void *p;
+
+  omp_set_lock(&pool->lock);
+  if ((p = pool->free[class]) != NULL) {
+    pool->free[class] = *(void **)p;
+  } else {
+    start = (pool->next + block - 1) & ~(block - 1);
+    if (start + block > pool->end) {
+      if (pool_extend(context, pool, block)) {
+        pool->stats->failures++;
+        omp_unset_lock(&pool->lock);
+        return NULL;
+      }
+      pool->stats->extensions++;
+      start = (pool->next + block - 1) & ~(block - 1);
+    }
+    pool->stats->carved += start + block - pool->next;
+    pool->next = start + block;
+    p = (void *)start;
+  }
+
+  if (++pool->stats->in_use[class] > pool->stats->high_water[class])
+    pool->stats->high_water[class] = pool->stats->in_use[class];
+  omp_unset_lock(&pool->lock);
+
+  return p;
+}
+
+static void pool_free(MeContext *context, void *p, size_t size) {
+  MePool *pool = &context->pool;
+  int class = pool_class(size);
+
+  omp_set_lock(&pool->lock);
+  *(void **)p = pool->free[class];
+  pool->free[class] = p;
+  pool->stats->in_use[class]--;
+  omp_unset_lock(&pool->lock);
+}
+
+static void pool_destroy(MePool *pool, void deallocate(void *)) {
+  MeArena *next;
+
+  for (MeArena *arena = pool->arenas; arena != NULL; arena = next) {
+    next = arena->next;
+    if (!arena->mapped) deallocate(arena);
   }
-  if ((context->outcoming =
-           mq_open(me_out_queue_name, O_CREAT | O_RDWR, 0777, &qattr)) == -1) {
-    return context;
+  omp_destroy_lock(&pool->lock);
+}
+
+/* Whether the memory was carved from the context rather than the pool. */
+static inline int in_context(MeContext *context, void *p) {
+  return (size_t)p - (size_t)context < context->size;
+}
+
+/*
+ * Journal.
+ */
+
+/* FNV-1a over words. MeMessage has int64_t fields, so its size is a multiple
+ * of 8. */
+uint64_t me_journal_checksum(MeJournalRecord *record) {
+  uint64_t h = 0xcbf29ce484222325ull ^ record->seq;
+  uint64_t word;
+
+  for (size_t i = 0; i < sizeof(MeMessage); i += sizeof(uint64_t)) {
+    memcpy(&word, (char *)&record->msg + i, sizeof(uint64_t));
+    h = (h ^ word) * 0x100000001b3ull;
+    h ^= h >> 32;
   }
 
+  return h;
+}
+
+/* Called with the journal locked, or before matching. */
+static int journal_grow(MeJournal *journal, size_t end) {
+  size_t size =
+      (end + ME_JOURNAL_CHUNK - 1) / ME_JOURNAL_CHUNK * ME_JOURNAL_CHUNK;
+
+  if (end > ME_JOURNAL_RESERVE) return ENOSPC;
+  if (size > ME_JOURNAL_RESERVE) size = ME_JOURNAL_RESERVE;
+  if (ftruncate(journal->fd, size) == -1) return errno;
+  __atomic_store_n(&journal->size, size, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/* Grows the file if the record with the sequence number doesn't fit yet. */
+static inline int journal_room(MeJournal *journal, uint64_t seq) {
+  size_t end = sizeof(MeJournalHeader) + (seq + 1) * sizeof(MeJournalRecord);
+  int r = 0;
+
+  if (end <= __atomic_load_n(&journal->size, __ATOMIC_ACQUIRE)) return 0;
+  omp_set_lock(&journal->lock);
+  if (end > journal->size) r = journal_grow(journal, end);
+  omp_unset_lock(&journal->lock);
+  return r;
+}
+
+static inline int journal_valid(MeJournalRecord *record, uint64_t seq) {
+  return __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE) == seq &&
+         record->checksum == me_journal_checksum(record);
+}
+
+/* Records up to which the calling thread syncs the journal once it published
+ * what it matched, 0 if none. */
+static uint64_t journal_due = 0;
+#pragma omp threadprivate(journal_due)
+
+/* Called with the security locked (or by the worker owning it), so the
+ * records of each security are in the order they're matched. Sequence
+ * numbers are taken without locking, but only once the file has room for the
+ * record, so none is skipped. Returns 0, or an errno value without taking
+ * one. */
+static inline int journal_append(MeContext *context, MeMessage *msg) {
+  MeJournal *journal = &context->journal;
+  MeJournalRecord record;
+  uint64_t seq = __atomic_load_n(&journal->next, __ATOMIC_RELAXED);
+  int r;
+
+  do {
+    if ((r = journal_room(journal, seq)) != 0) return r;
+  } while (!__atomic_compare_exchange_n(&journal->next, &seq, seq + 1, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  /* The sequence number goes last, so a record checking is whole. */
+  memcpy(&record.msg, msg, sizeof(MeMessage));
+  record.seq = seq;
+  record.checksum = me_journal_checksum(&record);
+  memcpy(&journal->records[seq].msg, msg, sizeof(MeMessage));
+  journal->records[seq].checksum = record.checksum;
+  __atomic_store_n(&journal->records[seq].seq, seq, __ATOMIC_RELEASE);
+
+  if (journal->sync_every > 0 && (seq + 1) % journal->sync_every == 0)
+    journal_due = seq + 1;
+  return 0;
+}
+
+/* Syncs the records since the last sync up to the first one still being
+ * written, before the given one, and stores how many are synced. */
+static void journal_sync(MeJournal *journal, uint64_t upto) {
+  MeJournalHeader *header = journal->header;
+  uint64_t synced = __atomic_load_n(&header->synced, __ATOMIC_RELAXED);
+  uint64_t end = synced;
+  size_t page = sysconf(_SC_PAGESIZE);
+
+  while (end < upto && journal_valid(&journal->records[end], end)) end++;
+  if (end <= synced) return;
+
+  size_t from = (size_t)&journal->records[synced] & ~(page - 1);
+  if (msync((void *)from, (size_t)&journal->records[end] - from, MS_SYNC))
+    return;
+  while (synced < end &&
+         !__atomic_compare_exchange_n(&header->synced, &synced, end, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    continue;
+}
+
+/* Syncs the batch the last record of the calling thread completed, if any. */
+static inline void journal_flush(MeContext *context) {
+  if (journal_due == 0) return;
+  journal_sync(&context->journal, journal_due);
+  journal_due = 0;
+}
+
+/* Whether the engine is stopping as the journal failed. The threads then
+ * return on their own, see wake. */
+static inline int stopping(MeContext *context) {
+  return __atomic_load_n(&context->journal.error, __ATOMIC_RELAXED) != 0;
+}
+
+/* Sends a panic to a thread waiting for inbound messages, unless the queue is
+ * full, as the thread may be the one that would take it out. A full queue
+ * has messages for the waiting threads anyway. */
+static void wake(MeContext *context) {
+  MeMessage msg;
+
+  msg.msg_type = ME_MESSAGE_PANIC;
+  if (context->transport == ME_TRANSPORT_SHM)
+    ring_try_push(&context->shm->incoming, &msg);
+  else
+    mq_timedsend(context->incoming, (char *)&msg, sizeof(MeMessage), 1,
+                 &no_wait);
+}
+
+/* Records msg if journaling, returning whether it can be matched. The first
+ * message that can't be recorded stops the engine, and nothing is matched
+ * from then on, so the journal has every message that was. */
+static inline int journaled(MeContext *context, MeMessage *msg) {
+  MeJournal *journal = &context->journal;
+  int none = 0;
+  int r;
+
+  if (!context->journaling || (r = journal_append(context, msg)) == 0)
+    return 1;
+  if (__atomic_compare_exchange_n(&journal->error, &none, r, 0,
+                                  __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    wake(context);
+  return 0;
+}
+
+static void journal_close(MeJournal *journal) {
+  msync(journal->header, journal->size, MS_SYNC);
+  munmap(journal->header, ME_JOURNAL_RESERVE);
+  close(journal->fd);
+  omp_destroy_lock(&journal->lock);
+}
+
+/* Also the statistics. */
+static int open_transport(MeContext *context) {
+  int r;
+
+  if (context->transport == ME_TRANSPORT_SHM)
+    r = open_shm(&context->shm, 1);
+  else
+    r = open_queues(context);
+
+  return r ? r : open_stats(&context->stats, 1);
+}
+
+/* Carves the books of every security from the context. */
+static int init_context(MeContext *context, size_t l2_s, size_t pool_s,
+                        int64_t n_secs, MeTransport transport,
+                        void *(*allocate)(size_t), MeArena *arena) {
+  int r;
+
+  context->n_securities = n_secs;
+  context->size = l2_s;
+  context->allocate = allocate;
+  context->transport = transport;
+  context->sharded = 0;
+  context->shards = NULL;
+  context->n_shards = 0;
+  context->journaling = 0;
+  context->journal.error = 0;
+  context->replaying = 0;
+  context->journaled = 0;
+  context->depth = 0;
+  context->threads = 0;
+  context->conflated = NULL;
+  context->checkpoint = NULL;
+  context->checkpointer = 0;
+  context->parked = 0;
+  context->resumed = 0;
+
+  if ((r = open_transport(context))) return r;
+  if ((r = pool_init(context, &context->pool, pool_s, arena))) return r;
+
   size_t headers_s = sizeof(MeContext) + n_secs * sizeof(MeSecurityContext);
-  size_t full_book_s = (l2_s - headers_s) / (2 * n_secs);
-  context->buf_size = (full_book_s - sizeof(MeBook)) / sizeof(MeOrder);
+  /* Every security starts at a cache line. */
+  size_t security_s = (l2_s - headers_s - ME_CACHE_LINE) / n_secs /
+                      ME_CACHE_LINE * ME_CACHE_LINE;
+  size_t level_s = sizeof(MeLevel) + sizeof(int64_t);
+  /* Every order may open a level, but it's unusual for a side to have more
+   * levels than half of the orders. The ladders grow if it happens. The index
+   * wants about two entries per order, rounded down to a power of two. */
+  int64_t orders = (security_s - sizeof(MeBook)) /
+                   (sizeof(MeOrderNode) + level_s + 2 * sizeof(MeIndexEntry));
+  int index_shift = 64;
+  while (((int64_t)1 << (64 - index_shift + 1)) <= 2 * orders) index_shift--;
+  int64_t index_size = (int64_t)1 << (64 - index_shift);
+  context->buf_size =
+      (security_s - sizeof(MeBook) - index_size * sizeof(MeIndexEntry)) /
+      (sizeof(MeOrderNode) + level_s);
+  int64_t ladder_size = context->buf_size / 2;
+  /* Overflow books hold at least as many orders as the first ones. */
+  context->book_block =
+      pool_round(sizeof(MeBook) + context->buf_size * sizeof(MeOrderNode));
+  context->book_size =
+      (context->book_block - sizeof(MeBook)) / sizeof(MeOrderNode);
   context->contexts =
       (MeSecurityContext *)(((size_t)context) + sizeof(MeContext));
 
-  register MeBook *book = (MeBook *)(((size_t)context) + headers_s);
+  size_t start = (((size_t)context) + headers_s + ME_CACHE_LINE - 1) &
+                 ~(size_t)(ME_CACHE_LINE - 1);
+
+  for (int64_t i = 0; i < n_secs; i++) {
+    MeSecurityContext *ctx = &context->contexts[i];
+    register size_t region = start + i * security_s;
+    ctx->market_price = i;
+    ctx->applied = 0;
+    omp_init_lock(&ctx->lock);
+
+    /* Nodes are handed out in order, so there's no need to touch them now.
+     * Both MeBook and MeOrderNode are a cache line long. */
+    ctx->book = (MeBook *)region;
+    ctx->book->used = 0;
+    ctx->book->live = 0;
+    ctx->book->size = context->buf_size;
+    ctx->book->free = NULL;
+    ctx->overflow = NULL;
+    memset(&ctx->wheel, 0, sizeof(MeWheel));
+    memset(&ctx->buy_stops, 0, sizeof(MeTriggers));
+    memset(&ctx->sell_stops, 0, sizeof(MeTriggers));
+    memset(&ctx->stops, 0, sizeof(MeStopIndex));
+    memset(&ctx->reserves, 0, sizeof(MeReserves));
+    region += sizeof(MeBook) + context->buf_size * sizeof(MeOrderNode);
+
+    ctx->index.used = 0;
+    ctx->index.size = index_size;
+    ctx->index.shift = index_shift;
+    ctx->index.entries = (MeIndexEntry *)region;
+    memset(ctx->index.entries, 0, index_size * sizeof(MeIndexEntry));
+    region += index_size * sizeof(MeIndexEntry);
+
+    ctx->buy.used = 0;
+    ctx->buy.size = ladder_size;
+    ctx->buy.prices = (int64_t *)region;
+    region += ladder_size * sizeof(int64_t);
+    ctx->sell.used = 0;
+    ctx->sell.size = ladder_size;
+    ctx->sell.prices = (int64_t *)region;
+    region += ladder_size * sizeof(int64_t);
+    ctx->buy.levels = (MeLevel *)region;
+    region += ladder_size * sizeof(MeLevel);
+    ctx->sell.levels = (MeLevel *)region;
+  }
+
+  return 0;
+}
+
+MeContext *me_alloc_context(size_t l2_s, size_t pool_s, int64_t n_secs,
+                            MeTransport transport, void *(*allocate)(size_t)) {
+  MeContext *context;
+
+  errno = 0;
+
+  if (l2_s < ME_MINIMUM_MEMORY(n_secs) || n_secs == 0) {
+    errno = EDOM;
+    return NULL;
+  }
+
+  if (!(context = allocate(l2_s))) return NULL;
+
+  context->mapping = NULL;
+  context->mapping_s = 0;
+  context->memory = 0;
+  errno = init_context(context, l2_s, pool_s, n_secs, transport, allocate,
+                       NULL);
+  return context;
+}
+
+/* Huge pages must be reserved (vm.nr_hugepages) for MAP_HUGETLB to work.
+ * Otherwise the region is aligned to them and given to the kernel as a
+ * candidate for transparent huge pages. */
+static void *map_memory(size_t size, int memory, size_t *mapped) {
+  /* Not MAP_NORESERVE, so MAP_HUGETLB fails instead of faulting later when
+   * there aren't enough huge pages. */
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  long page = sysconf(_SC_PAGESIZE);
+  char *p = MAP_FAILED;
+
+  *mapped = size;
+  if (memory & ME_MEMORY_HUGE_PAGES) {
+    *mapped = (size + ME_HUGE_PAGE - 1) & ~(ME_HUGE_PAGE - 1);
+    p = mmap(NULL, *mapped, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB, -1,
+             0);
+  }
+  if (p == MAP_FAILED && (memory & ME_MEMORY_HUGE_PAGES)) {
+    char *reservation = mmap(NULL, *mapped + ME_HUGE_PAGE,
+                             PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (reservation == MAP_FAILED) return NULL;
+    p = (char *)(((size_t)reservation + ME_HUGE_PAGE - 1) &
+                 ~(ME_HUGE_PAGE - 1));
+    if (p > reservation) munmap(reservation, p - reservation);
+    munmap(p + *mapped, reservation + ME_HUGE_PAGE - p);
+    madvise(p, *mapped, MADV_HUGEPAGE);
+  } else if (p == MAP_FAILED) {
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+  }
+
+  if (memory & ME_MEMORY_PREFAULT)
+    for (size_t i = 0; i < *mapped; i += page) p[i] = 0;
+  if ((memory & ME_MEMORY_LOCK) && mlock(p, *mapped) == -1) {
+    int r = errno;
+    munmap(p, *mapped);
+    errno = r;
+    return NULL;
+  }
+  return p;
+}
+
+MeContext *me_map_context(size_t l2_s, size_t pool_s, int64_t n_secs,
+                          MeTransport transport, int memory,
+                          void *(*allocate)(size_t)) {
+  MeContext *context;
+  size_t arena_start =
+      (l2_s + ME_CACHE_LINE - 1) & ~(size_t)(ME_CACHE_LINE - 1);
+  size_t size = pool_s > 0 ? arena_start + sizeof(MeArena) + pool_s : l2_s;
+  size_t mapped;
+  int r;
 
-  /* Init first security context. */
-  context->contexts[0].market_price = 0;
-  omp_init_lock(&context->contexts[0].lock);
+  errno = 0;
+
+  if (l2_s < ME_MINIMUM_MEMORY(n_secs) || n_secs == 0) {
+    errno = EDOM;
+    return NULL;
+  }
+
+  if (!(context = map_memory(size, memory, &mapped))) return NULL;
+  /* From falling back to transparent huge pages. */
+  errno = 0;
+
+  context->mapping = context;
+  context->mapping_s = mapped;
+  context->memory = memory;
+  if ((r = init_context(context, l2_s, pool_s, n_secs, transport, allocate,
+                        (MeArena *)((char *)context + arena_start)))) {
+    munmap(context, mapped);
+    errno = r;
+    return NULL;
+  }
+  return context;
+}
+
+void me_dealloc_context(MeContext *context, void deallocate(void *)) {
+  if (context->transport == ME_TRANSPORT_SHM) {
+    munmap(context->shm, sizeof(MeShm));
+    shm_unlink(me_shm_name);
+  } else {
+    mq_close(context->incoming);
+    mq_close(context->outcoming);
+    mq_unlink(me_in_queue_name);
+    mq_unlink(me_out_queue_name);
+  }
+  munmap(context->stats, sizeof(MeStats));
+  shm_unlink(me_stats_name);
+  if (context->conflated != NULL) {
+    munmap(context->conflated, conflated_size(context->n_securities));
+    shm_unlink(me_conflated_name);
+  }
+  if (context->journaling) {
+    journal_sync(&context->journal, context->journal.next);
+    journal_close(&context->journal);
+  }
+
+  for (int64_t i = 0; i < context->n_securities; i++)
+    omp_destroy_lock(&context->contexts[i].lock);
+  pool_destroy(&context->pool, deallocate);
+
+  for (MeShards *shards = context->shards, *retired; shards != NULL;
+       shards = retired) {
+    retired = shards->retired;
+    deallocate(shards);
+  }
+  if (context->mapping != NULL)
+    munmap(context->mapping, context->mapping_s);
+  else
+    deallocate(context);
+}
+
+/*
+ * Snapshots.
+ */
+
+static const char zero_page[4096];
+
+static uint64_t applied(MeContext *context) {
+  uint64_t n = 0;
+  for (int64_t i = 0; i < context->n_securities; i++)
+    n += context->contexts[i].applied;
+  return n;
+}
+
+/* Skips the pages that are all zeroes, leaving holes in the file. */
+static int snapshot_segment(int fd, void *data, size_t size, size_t offset) {
+  for (size_t done = 0; done < size; done += sizeof(zero_page)) {
+    size_t n = size - done;
+    char *page = (char *)data + done;
+
+    if (n > sizeof(zero_page)) n = sizeof(zero_page);
+    if (memcmp(page, zero_page, n) == 0) continue;
+    if (pwrite(fd, page, n, offset + done) != (ssize_t)n) return errno;
+  }
+  return 0;
+}
+
+int me_snapshot_write(MeContext *context, const char *path) {
+  MeSnapshotHeader header;
+  char tmp[4096];
+  size_t offset = sizeof(MeSnapshotHeader);
+  size_t align = context->book_block > sizeof(zero_page) ? context->book_block
+                                                        : sizeof(zero_page);
+  int fd;
+  int r = 0;
+
+  memset(&header, 0, sizeof(header));
+  header.magic = ME_SNAPSHOT_MAGIC;
+  header.version = ME_SNAPSHOT_VERSION;
+  header.n_securities = context->n_securities;
+  header.journaled =
+      context->journaling ? context->journal.next : context->journaled;
+  header.messages = applied(context);
+  header.pool = *context->pool.stats;
+  header.alignment = align;
+
+  header.segments[0].base = (size_t)context;
+  header.segments[0].size = context->size;
+  header.n_segments = 1;
+  for (MeArena *arena = context->pool.arenas; arena != NULL;
+       arena = arena->next) {
+    if (header.n_segments == ME_SNAPSHOT_SEGMENTS) return E2BIG;
+    header.segments[header.n_segments].base = (size_t)arena;
+    header.segments[header.n_segments++].size = sizeof(MeArena) + arena->size;
+  }
+  for (uint64_t i = 0; i < header.n_segments; i++) {
+    offset += (header.segments[i].base - offset) & (align - 1);
+    header.segments[i].offset = offset;
+    offset += header.segments[i].size;
+  }
+
+  if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp))
+    return ENAMETOOLONG;
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) return errno;
+
+  if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) r = errno;
+  for (uint64_t i = 0; r == 0 && i < header.n_segments; i++)
+    r = snapshot_segment(fd, (void *)header.segments[i].base,
+                         header.segments[i].size, header.segments[i].offset);
+  if (r == 0 && (ftruncate(fd, offset) == -1 || fsync(fd) == -1)) r = errno;
+  close(fd);
+  if (r == 0 && rename(tmp, path) == -1) r = errno;
+  if (r != 0) unlink(tmp);
+
+  return r;
+}
+
+typedef struct {
+  MeSnapshotHeader *header;
+  char *mapping;
+} Relocation;
+
+/* Pointers into a segment are moved to where it was mapped, anything else
+ * (NULL and stale pointers in unused memory) is left as is. */
+static void *relocate(Relocation *r, void *p) {
+  size_t a = (size_t)p;
+
+  for (uint64_t i = 0; i < r->header->n_segments; i++) {
+    MeSnapshotSegment *s = &r->header->segments[i];
+    if (a - s->base < s->size) return r->mapping + s->offset + (a - s->base);
+  }
+  return p;
+}
+
+static void relocate_book(Relocation *r, MeBook *book) {
+  book->free = relocate(r, book->free);
+  for (MeOrderNode *n = book->free; n != NULL; n = n->next)
+    n->next = relocate(r, n->next);
+}
+
+static void relocate_ladder(Relocation *r, MeLadder *ladder) {
+  ladder->prices = relocate(r, ladder->prices);
+  ladder->levels = relocate(r, ladder->levels);
+  for (int64_t i = 0; i < ladder->used; i++) {
+    MeLevel *level = &ladder->levels[i];
+    level->head = relocate(r, level->head);
+    level->tail = relocate(r, level->tail);
+    for (MeOrderNode *n = level->head; n != NULL; n = n->next) {
+      n->next = relocate(r, n->next);
+      n->prev = relocate(r, n->prev);
+    }
+  }
+}
+
+static void relocate_wheel(Relocation *r, MeWheel *wheel) {
+  wheel->free = relocate(r, wheel->free);
+  for (MeTimer *t = wheel->free; t != NULL; t = t->next)
+    t->next = relocate(r, t->next);
+  for (int level = 0; level < ME_WHEEL_LEVELS; level++) {
+    for (int i = 0; i < ME_WHEEL_SLOTS; i++) {
+      wheel->slots[level][i] = relocate(r, wheel->slots[level][i]);
+      for (MeTimer *t = wheel->slots[level][i]; t != NULL; t = t->next)
+        t->next = relocate(r, t->next);
+    }
+  }
+}
+
+/* Full overflow books aren't linked anywhere, but they have no free nodes and
+ * their live nodes are reached through the ladders. */
+static void relocate_security(Relocation *r, MeSecurityContext *ctx) {
+  relocate_ladder(r, &ctx->buy);
+  relocate_ladder(r, &ctx->sell);
+
+  ctx->index.entries = relocate(r, ctx->index.entries);
+  for (int64_t i = 0; i < ctx->index.size; i++)
+    ctx->index.entries[i].node = relocate(r, ctx->index.entries[i].node);
+
+  ctx->book = relocate(r, ctx->book);
+  relocate_book(r, ctx->book);
+  ctx->overflow = relocate(r, ctx->overflow);
+  for (MeBook *book = ctx->overflow; book != NULL; book = book->next) {
+    book->next = relocate(r, book->next);
+    book->prev = relocate(r, book->prev);
+    relocate_book(r, book);
+  }
+  relocate_wheel(r, &ctx->wheel);
+  ctx->buy_stops.stops = relocate(r, ctx->buy_stops.stops);
+  ctx->sell_stops.stops = relocate(r, ctx->sell_stops.stops);
+  ctx->stops.entries = relocate(r, ctx->stops.entries);
+  ctx->reserves.entries = relocate(r, ctx->reserves.entries);
+  for (int64_t i = 0; i < ctx->reserves.size; i++)
+    ctx->reserves.entries[i].node =
+        relocate(r, ctx->reserves.entries[i].node);
+  omp_init_lock(&ctx->lock);
+}
+
+static void relocate_pool(Relocation *r, MePool *pool) {
+  pool->arenas = relocate(r, pool->arenas);
+  for (MeArena *arena = pool->arenas; arena != NULL; arena = arena->next) {
+    arena->next = relocate(r, arena->next);
+    arena->mapped = 1;
+  }
+  /* An arena that was carved to the end is just left alone. */
+  size_t left = pool->end - pool->next;
+  pool->next = (size_t)relocate(r, (void *)pool->next);
+  pool->end = pool->next + left;
+  for (int c = 0; c < ME_POOL_CLASSES; c++) {
+    pool->free[c] = relocate(r, pool->free[c]);
+    for (void **p = pool->free[c]; p != NULL; p = *p) *p = relocate(r, *p);
+  }
+  omp_init_lock(&pool->lock);
+}
+
+/* Maps the file at an address aligned to header->alignment, inside a bigger
+ * reservation which is returned. */
+static void *snapshot_map(int fd, MeSnapshotHeader *header, size_t size,
+                          size_t *reserved, char **mapping) {
+  char *reservation;
+
+  *reserved = size + header->alignment;
+  reservation = mmap(NULL, *reserved, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (reservation == MAP_FAILED) return NULL;
+
+  *mapping = (char *)(((size_t)reservation + header->alignment - 1) &
+                      ~(header->alignment - 1));
+  if (mmap(*mapping, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+           0) == MAP_FAILED) {
+    munmap(reservation, *reserved);
+    return NULL;
+  }
+  return reservation;
+}
+
+MeContext *me_snapshot_load(const char *path, MeTransport transport,
+                            void *(*allocate)(size_t)) {
+  MeSnapshotHeader header;
+  Relocation r;
+  MeContext *context;
+  struct stat st;
+  void *reservation;
+  size_t reserved;
+  int fd;
+
+  errno = 0;
+  if ((fd = open(path, O_RDONLY)) == -1) return NULL;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return NULL;
+  }
+  if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.magic != ME_SNAPSHOT_MAGIC ||
+      header.version != ME_SNAPSHOT_VERSION || header.n_segments == 0 ||
+      header.n_segments > ME_SNAPSHOT_SEGMENTS ||
+      (header.alignment & (header.alignment - 1)) != 0) {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+  reservation = snapshot_map(fd, &header, st.st_size, &reserved, &r.mapping);
+  close(fd);
+  if (reservation == NULL) return NULL;
+  r.header = (MeSnapshotHeader *)r.mapping;
+
+  context = (MeContext *)(r.mapping + r.header->segments[0].offset);
+  context->contexts = relocate(&r, context->contexts);
+  for (int64_t i = 0; i < context->n_securities; i++)
+    relocate_security(&r, &context->contexts[i]);
+  relocate_pool(&r, &context->pool);
+
+  context->allocate = allocate;
+  context->transport = transport;
+  context->sharded = 0;
+  context->shards = NULL;
+  context->n_shards = 0;
+  context->journaling = 0;
+  context->journal.error = 0;
+  context->replaying = 0;
+  context->journaled = r.header->journaled;
+  context->mapping = reservation;
+  context->mapping_s = reserved;
+  context->depth = 0;
+  context->threads = 0;
+  context->conflated = NULL;
+  context->checkpoint = NULL;
+  context->checkpointer = 0;
+  context->parked = 0;
+  context->resumed = 0;
+  context->memory = 0;
+
+  if ((errno = open_transport(context))) return context;
+  context->pool.stats = &context->stats->pool;
+  *context->pool.stats = r.header->pool;
+
+  return context;
+}
+
+/* Events of the message being handled by this thread. */
+static MeFrame outbound;
+#pragma omp threadprivate(outbound)
+
+static inline void flush(MeContext *context) {
+  if (outbound.used == 0) return;
+  if (context->replaying) {
+    outbound.used = 0;
+    return;
+  }
+
+  if (context->transport == ME_TRANSPORT_SHM)
+    broadcast_push_n(context, &context->shm->outcoming, outbound.messages,
+                     outbound.used);
+  else
+    mq_send(context->outcoming, (char *)&outbound,
+            sizeof(int64_t) + outbound.used * sizeof(MeMessage), 1);
+
+  outbound.used = 0;
+}
+
+static inline void publish(MeContext *context, MeMessage *msg) {
+  outbound.messages[outbound.used++] = *msg;
+  if (outbound.used == ME_FRAME_MESSAGES) flush(context);
+}
+
+#define sendmsg(context, msg) publish((context), (msg))
+
+/* In sharded mode every security is only touched by the worker owning it. */
+#define LOCK(context, ctx)                               \
+  do {                                                   \
+    if (!(context)->sharded) omp_set_lock(&(ctx)->lock); \
+  } while (0)
+#define UNLOCK(context, ctx)                               \
+  do {                                                     \
+    if (!(context)->sharded) omp_unset_lock(&(ctx)->lock); \
+  } while (0)
+
+/* Called by the only thread touching the security, so there's one writer. */
+static inline void conflate(MeContext *context, MeSecurityContext *ctx) {
+  MeConflated *slot = &context->conflated->securities[ctx - context->contexts];
+  MeLadder *buy = &ctx->buy;
+  MeLadder *sell = &ctx->sell;
+  uint64_t seq = slot->seq;
+
+  __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&slot->updates, slot->updates + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->market_price, ctx->market_price, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->bid, buy->used ? buy->prices[buy->used - 1] : 0,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->bid_quantity,
+                   buy->used ? buy->levels[buy->used - 1].quantity : 0,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->ask, sell->used ? sell->prices[sell->used - 1] : 0,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->ask_quantity,
+                   sell->used ? sell->levels[sell->used - 1].quantity : 0,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+int me_conflate(MeContext *context) {
+  size_t size = conflated_size(context->n_securities);
+  MeConflatedPage *page;
+  int fd;
+
+  if ((fd = shm_open(me_conflated_name, O_CREAT | O_RDWR, 0777)) == -1)
+    return errno;
+  if (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1) {
+    close(fd);
+    return errno;
+  }
+  page = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (page == MAP_FAILED) return errno;
+
+  /* Truncating zeroed it, so every slot starts even. */
+  page->n_securities = context->n_securities;
+  context->conflated = page;
+  for (int64_t i = 0; i < context->n_securities; i++)
+    conflate(context, &context->contexts[i]);
+  return 0;
+}
+
+/* Levels are kept sorted from the worst to the best price, so the top of the
+ * book is always the last one and consuming it doesn't move anything. */
+#define BETTER(side, a, b) ((side) == ME_SIDE_BUY ? (a) > (b) : (a) < (b))
+#define TOP(ladder) (&(ladder)->levels[(ladder)->used - 1])
+#define TOP_PRICE(ladder) ((ladder)->prices[(ladder)->used - 1])
+
+static inline void trade(MeContext *context, MeSecurityContext *ctx,
+                         MeOrder *aggressor, MeOrder *other, int64_t id,
+                         int64_t price) {
+  MeMessage send;
+  int64_t last_price = ctx->market_price;
+  ctx->market_price = price;
+
+  send.msg_type = ME_MESSAGE_TRADE;
+  send.security_id = id;
+  send.message.trade.aggressor = *aggressor;
+  send.message.trade.matched_id = other->order_id;
+  sendmsg(context, &send);
+
+  if (last_price != price) {
+    send.msg_type = ME_MESSAGE_SET_MARKET_PRICE;
+    send.message.set_market_price = price;
+    sendmsg(context, &send);
+  }
+}
+
+static inline void order_executed(MeContext *context, MeOrder *order,
+                                  int64_t id) {
+  MeMessage to_send;
+  to_send.msg_type = ME_MESSAGE_ORDER_EXECUTED;
+  to_send.security_id = id;
+  to_send.message.order = *order;
+  sendmsg(context, &to_send);
+}
+
+static inline void order_cancelled(MeContext *context, MeOrder *order,
+                                   int64_t id) {
+  MeMessage to_send;
+  to_send.msg_type = ME_MESSAGE_CANCEL_ORDER;
+  to_send.security_id = id;
+  to_send.message.to_cancel = order->order_id;
+  sendmsg(context, &to_send);
+}
+
+/* Publishes the level at idx as being at the given position. */
+static inline void depth_level(MeContext *context, MeSecurityContext *ctx,
+                               MeLadder *ladder, MeDepthAction action,
+                               int64_t level, int64_t idx) {
+  MeMessage send;
+
+  send.msg_type = ME_MESSAGE_DEPTH;
+  send.security_id = ctx - context->contexts;
+  send.message.depth.action = action;
+  send.message.depth.side = ladder == &ctx->buy ? ME_SIDE_BUY : ME_SIDE_SELL;
+  send.message.depth.level = level;
+  send.message.depth.price = ladder->prices[idx];
+  send.message.depth.quantity = ladder->levels[idx].quantity;
+  sendmsg(context, &send);
+}
+
+/* Publishes an ADD or CHANGE of the level at idx, if it's published. */
+static inline void depth_update(MeContext *context, MeSecurityContext *ctx,
+                                MeLadder *ladder, MeDepthAction action,
+                                int64_t idx) {
+  int64_t level = ladder->used - idx;
+
+  if (level <= context->depth)
+    depth_level(context, ctx, ladder, action, level, idx);
+}
+
+/* Publishes the removal of the level that was at the given position, and the
+ * level that took the last published one. */
+static inline void depth_delete(MeContext *context, MeSecurityContext *ctx,
+                                MeLadder *ladder, int64_t level,
+                                int64_t price) {
+  MeMessage send;
+
+  send.msg_type = ME_MESSAGE_DEPTH;
+  send.security_id = ctx - context->contexts;
+  send.message.depth.action = ME_DEPTH_DELETE;
+  send.message.depth.side = ladder == &ctx->buy ? ME_SIDE_BUY : ME_SIDE_SELL;
+  send.message.depth.level = level;
+  send.message.depth.price = price;
+  send.message.depth.quantity = 0;
+  sendmsg(context, &send);
+}
+
+static inline void depth_remove(MeContext *context, MeSecurityContext *ctx,
+                                MeLadder *ladder, int64_t level,
+                                int64_t price) {
+  if (level > context->depth) return;
+  depth_delete(context, ctx, ladder, level, price);
+  if (ladder->used >= context->depth)
+    depth_update(context, ctx, ladder, ME_DEPTH_ADD,
+                 ladder->used - context->depth);
+}
+
+#define BOOK_FULL(book) ((book)->free == NULL && (book)->used == (book)->size)
+
+static inline void link_book(MeSecurityContext *ctx, MeBook *book) {
+  book->prev = NULL;
+  book->next = ctx->overflow;
+  if (ctx->overflow != NULL) ctx->overflow->prev = book;
+  ctx->overflow = book;
+}
+
+static inline void unlink_book(MeSecurityContext *ctx, MeBook *book) {
+  if (book->prev != NULL)
+    book->prev->next = book->next;
+  else
+    ctx->overflow = book->next;
+  if (book->next != NULL) book->next->prev = book->prev;
+}
+
+static inline int add_book(MeContext *context, MeSecurityContext *ctx) {
+  MeBook *book = pool_alloc(context, context->book_block);
+
+  if (book == NULL) return ENOMEM;
+  book->used = 0;
+  book->live = 0;
+  book->size = context->book_size;
+  book->free = NULL;
+  link_book(ctx, book);
+  return 0;
+}
+
+/* Overflow books are only used while the first one is full, so they drain
+ * and can be given back to the pool. There must be room (see make_room). */
+static inline MeOrderNode *alloc_node(MeSecurityContext *ctx) {
+  MeOrderNode *node;
+  MeBook *book = ctx->book;
+
+  if (BOOK_FULL(book)) book = ctx->overflow;
+
+  if ((node = book->free) != NULL)
+    book->free = node->next;
+  else
+    node = &book->orders[book->used++];
+  book->live++;
+  if (book != ctx->book && BOOK_FULL(book)) unlink_book(ctx, book);
+
+  return node;
+}
+
+/* Overflow books are aligned to their size, so they're found by masking the
+ * address of their nodes. */
+static inline void free_node(MeContext *context, MeSecurityContext *ctx,
+                             MeOrderNode *node) {
+  MeBook *book = ctx->book;
+  if ((size_t)node - (size_t)book->orders >= book->size * sizeof(MeOrderNode))
+    book = (MeBook *)((size_t)node & ~(context->book_block - 1));
+  int full = BOOK_FULL(book);
+
+  node->next = book->free;
+  book->free = node;
+  book->live--;
+  if (book == ctx->book) return;
+
+  if (book->live == 0) {
+    if (!full) unlink_book(ctx, book);
+    pool_free(context, book, context->book_block);
+  } else if (full) {
+    link_book(ctx, book);
+  }
+}
+
+static inline void unlink_node(MeLevel *level, MeOrderNode *node) {
+  if (node->prev != NULL)
+    node->prev->next = node->next;
+  else
+    level->head = node->next;
+  if (node->next != NULL)
+    node->next->prev = node->prev;
+  else
+    level->tail = node->prev;
+}
+
+/* Fibonacci hashing, as clients usually hand out sequential IDs. */
+#define INDEX_HOME(index, id) \
+  ((int64_t)(((uint64_t)(id) * 11400714819323198485ull) >> (index)->shift))
+#define INDEX_NEXT(index, i) (((i) + 1) & ((index)->size - 1))
+
+static inline void index_put(MeIndex *index, MeOrderID id,
+                             MeOrderNode *node) {
+  int64_t i = INDEX_HOME(index, id);
+  while (index->entries[i].node != NULL) i = INDEX_NEXT(index, i);
+  index->entries[i].order_id = id;
+  index->entries[i].node = node;
+  index->used++;
+}
+
+static inline int grow_index(MeContext *context, MeIndex *index) {
+  MeIndexEntry *old = index->entries;
+  int64_t old_size = index->size;
+  MeIndexEntry *entries =
+      pool_alloc(context, 2 * old_size * sizeof(MeIndexEntry));
+
+  if (entries == NULL) return ENOMEM;
+  memset(entries, 0, 2 * old_size * sizeof(MeIndexEntry));
+  index->size *= 2;
+  index->shift--;
+  index->used = 0;
+  index->entries = entries;
+
+  for (int64_t i = 0; i < old_size; i++)
+    if (old[i].node != NULL) index_put(index, old[i].order_id, old[i].node);
+  if (!in_context(context, old))
+    pool_free(context, old, old_size * sizeof(MeIndexEntry));
+  return 0;
+}
+
+static inline MeOrderNode *index_find(MeIndex *index, MeOrderID id) {
+  int64_t i = INDEX_HOME(index, id);
+  for (; index->entries[i].node != NULL; i = INDEX_NEXT(index, i))
+    if (index->entries[i].order_id == id) return index->entries[i].node;
+  return NULL;
+}
+
+/* Looks for the node itself, so duplicated IDs are removed correctly. Uses
+ * backward shift deletion, so there are no tombstones to clean up. */
+static inline void index_remove(MeIndex *index, MeOrderNode *node) {
+  int64_t i = INDEX_HOME(index, node->order.order_id);
+  while (index->entries[i].node != node) i = INDEX_NEXT(index, i);
+
+  for (int64_t j = INDEX_NEXT(index, i); index->entries[j].node != NULL;
+       j = INDEX_NEXT(index, j)) {
+    int64_t home = INDEX_HOME(index, index->entries[j].order_id);
+    /* The entry can fill the hole only if its home isn't in (i, j]. */
+    if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+      index->entries[i] = index->entries[j];
+      i = j;
+    }
+  }
+
+  index->entries[i].node = NULL;
+  index->used--;
+}
+
+/* The first table of reserves, once there's an iceberg. */
+#define RESERVES_BITS 6
+
+static inline void reserve_put(MeReserves *reserves, MeReserve *reserve) {
+  int64_t i = INDEX_HOME(reserves, reserve->node->order.order_id);
+  while (reserves->entries[i].node != NULL) i = INDEX_NEXT(reserves, i);
+  reserves->entries[i] = *reserve;
+  reserves->used++;
+}
+
+static inline int grow_reserves(MeContext *context, MeReserves *reserves) {
+  MeReserve *old = reserves->entries;
+  int64_t old_size = reserves->size;
+  int64_t size = old_size > 0 ? 2 * old_size : 1 << RESERVES_BITS;
+  MeReserve *entries = pool_alloc(context, size * sizeof(MeReserve));
+
+  if (entries == NULL) return ENOMEM;
+  memset(entries, 0, size * sizeof(MeReserve));
+  reserves->size = size;
+  reserves->shift = old_size > 0 ? reserves->shift - 1 : 64 - RESERVES_BITS;
+  reserves->used = 0;
+  reserves->entries = entries;
+
+  for (int64_t i = 0; i < old_size; i++)
+    if (old[i].node != NULL) reserve_put(reserves, &old[i]);
+  if (old != NULL) pool_free(context, old, old_size * sizeof(MeReserve));
+  return 0;
+}
+
+/* Every node of a resting iceberg has one. */
+static inline MeReserve *reserve_find(MeReserves *reserves,
+                                      MeOrderNode *node) {
+  int64_t i = INDEX_HOME(reserves, node->order.order_id);
+  while (reserves->entries[i].node != node) i = INDEX_NEXT(reserves, i);
+  return &reserves->entries[i];
+}
+
+/* As index_remove. */
+static inline void reserve_remove(MeReserves *reserves, MeReserve *reserve) {
+  int64_t i = reserve - reserves->entries;
+
+  for (int64_t j = INDEX_NEXT(reserves, i); reserves->entries[j].node != NULL;
+       j = INDEX_NEXT(reserves, j)) {
+    int64_t home =
+        INDEX_HOME(reserves, reserves->entries[j].node->order.order_id);
+    if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+      reserves->entries[i] = reserves->entries[j];
+      i = j;
+    }
+  }
+
+  reserves->entries[i].node = NULL;
+  reserves->used--;
+}
+
+/* Index of the level with the given price or, if there's none, of where it
+ * should be inserted. */
+static inline int64_t find_level(MeLadder *ladder, MeSide side,
+                                 int64_t price) {
+  int64_t lo = 0;
+  int64_t hi = ladder->used;
+
+  while (lo < hi) {
+    int64_t mid = lo + (hi - lo) / 2;
+    if (BETTER(side, price, ladder->prices[mid]))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+/* Timers are carved from the pool this many bytes at a time, and recycled by
+ * each wheel. */
+#define TIMER_BLOCK 4096
+
+/* Puts the timer in the slot of the second it's due, which must not have
+ * passed. */
+static inline void wheel_put(MeWheel *wheel, MeTimer *timer, uint64_t due) {
+  uint64_t horizon = (uint64_t)1 << (ME_WHEEL_BITS * ME_WHEEL_LEVELS);
+  int level = 0;
+
+  /* It'll come back to the last level until then. */
+  if (due - wheel->now >= horizon) due = wheel->now + horizon - 1;
+  while (due - wheel->now >= (uint64_t)1 << (ME_WHEEL_BITS * (level + 1)))
+    level++;
+
+  MeTimer **slot = &wheel->slots[level][(due >> (ME_WHEEL_BITS * level)) &
+                                        (ME_WHEEL_SLOTS - 1)];
+  timer->next = *slot;
+  *slot = timer;
+}
+
+static inline int add_timers(MeContext *context, MeWheel *wheel) {
+  MeTimer *timers = pool_alloc(context, TIMER_BLOCK);
+
+  if (timers == NULL) return ENOMEM;
+  for (size_t i = 0; i < TIMER_BLOCK / sizeof(MeTimer); i++) {
+    timers[i].next = wheel->free;
+    wheel->free = &timers[i];
+  }
+  return 0;
+}
+
+/* Securities this thread expires the orders of, linked by MeWheel.next, -1
+ * if none. */
+static int64_t timed = -1;
+#pragma omp threadprivate(timed)
+
+/* Lists those from first, every step, with timers. Every thread of a run
+ * must be done before any matches, as the flags may be stale. */
+static void list_timed(MeContext *context, int64_t first, int64_t step) {
+  int64_t *link = &timed;
+
+  for (int64_t i = first; i < context->n_securities; i += step) {
+    MeWheel *wheel = &context->contexts[i].wheel;
+    wheel->listed = wheel->used > 0;
+    if (wheel->listed) {
+      *link = i;
+      link = &wheel->next;
+    }
+  }
+  *link = -1;
+}
+
+/* There must be a free timer (see make_room). The thread matching the
+ * security expires it from then on, unless another one already does. */
+static inline void add_timer(MeContext *context, MeSecurityContext *ctx,
+                             MeOrder *order) {
+  MeWheel *wheel = &ctx->wheel;
+  MeTimer *timer;
+
+  if (!wheel->listed) {
+    wheel->listed = 1;
+    wheel->next = timed;
+    timed = ctx - context->contexts;
+  }
+  timer = wheel->free;
+  wheel->free = timer->next;
+  wheel->used++;
+
+  timer->order_id = order->order_id;
+  /* Already due orders go in the next second. */
+  wheel_put(wheel, timer,
+            order->expires > wheel->now ? order->expires : wheel->now + 1);
+}
+
+static inline void free_timer(MeWheel *wheel, MeTimer *timer) {
+  timer->next = wheel->free;
+  wheel->free = timer;
+  wheel->used--;
+}
+
+static inline int wheel_empty(MeWheel *wheel, int level) {
+  for (int i = 0; i < ME_WHEEL_SLOTS; i++)
+    if (wheel->slots[level][i] != NULL) return 0;
+  return 1;
+}
+
+static inline int grow_ladder(MeContext *context, MeLadder *ladder) {
+  int64_t size = 2 * ladder->size;
+  int64_t *prices = pool_alloc(context, size * sizeof(int64_t));
+  MeLevel *levels;
+
+  if (prices == NULL) return ENOMEM;
+  if ((levels = pool_alloc(context, size * sizeof(MeLevel))) == NULL) {
+    pool_free(context, prices, size * sizeof(int64_t));
+    return ENOMEM;
+  }
+  memcpy(prices, ladder->prices, ladder->used * sizeof(int64_t));
+  memcpy(levels, ladder->levels, ladder->used * sizeof(MeLevel));
+  if (!in_context(context, ladder->levels)) {
+    pool_free(context, ladder->prices, ladder->size * sizeof(int64_t));
+    pool_free(context, ladder->levels, ladder->size * sizeof(MeLevel));
+  }
+  ladder->prices = prices;
+  ladder->levels = levels;
+  ladder->size = size;
+  return 0;
+}
+
+static inline void remove_level(MeLadder *ladder, int64_t idx) {
+  memmove(&ladder->prices[idx], &ladder->prices[idx + 1],
+          (ladder->used - idx - 1) * sizeof(int64_t));
+  memmove(&ladder->levels[idx], &ladder->levels[idx + 1],
+          (ladder->used - idx - 1) * sizeof(MeLevel));
+  ladder->used--;
+}
+
+/* Orders with the same price are still sorted by timestamp, but they usually
+ * arrive in order so this stops at the tail. */
+static inline void link_node(MeLevel *level, MeOrderNode *node) {
+  MeOrderNode *after = level->tail;
+  while (after != NULL && after->order.timestamp > node->order.timestamp)
+    after = after->prev;
+
+  node->prev = after;
+  node->next = after == NULL ? level->head : after->next;
+  if (node->next != NULL)
+    node->next->prev = node;
+  else
+    level->tail = node;
+  if (after != NULL)
+    after->next = node;
+  else
+    level->head = node;
+}
+
+/* Takes what resting the order needs from the pool before touching the book,
+ * so running out of memory can't leave it half updated. The hash tables are
+ * kept under 3/4 full, so probe sequences stay short. Returns 0 or ENOMEM. */
+static inline int make_room(MeContext *context, MeSecurityContext *ctx,
+                            MeOrder *order) {
+  MeLadder *ladder = order->side == ME_SIDE_BUY ? &ctx->buy : &ctx->sell;
+
+  if (BOOK_FULL(ctx->book) && ctx->overflow == NULL && add_book(context, ctx))
+    return ENOMEM;
+  if (4 * (ctx->index.used + 1) > 3 * ctx->index.size &&
+      grow_index(context, &ctx->index))
+    return ENOMEM;
+  if (ladder->used == ladder->size && grow_ladder(context, ladder))
+    return ENOMEM;
+  if (order->ord_type == ME_ORDER_ICEBERG &&
+      4 * (ctx->reserves.used + 1) > 3 * ctx->reserves.size &&
+      grow_reserves(context, &ctx->reserves))
+    return ENOMEM;
+  if (order->expires != 0 && ctx->wheel.free == NULL &&
+      add_timers(context, &ctx->wheel))
+    return ENOMEM;
+  return 0;
+}
+
+/* There must be room (see make_room). */
+static inline MeOrderNode *rest_order(MeContext *context,
+                                      MeSecurityContext *ctx, MeOrder *order) {
+  MeLadder *ladder = order->side == ME_SIDE_BUY ? &ctx->buy : &ctx->sell;
+  int64_t idx = find_level(ladder, order->side, order->price);
+  MeLevel *level = &ladder->levels[idx];
+  MeDepthAction action = ME_DEPTH_CHANGE;
+
+  if (idx == ladder->used || ladder->prices[idx] != order->price) {
+    memmove(&ladder->prices[idx + 1], &ladder->prices[idx],
+            (ladder->used - idx) * sizeof(int64_t));
+    memmove(level + 1, level, (ladder->used - idx) * sizeof(MeLevel));
+    ladder->used++;
+    ladder->prices[idx] = order->price;
+    level->quantity = 0;
+    level->head = NULL;
+    level->tail = NULL;
+    action = ME_DEPTH_ADD;
+  }
+
+  MeOrderNode *node = alloc_node(ctx);
+  node->order = *order;
+  level->quantity += order->quantity;
+  index_put(&ctx->index, order->order_id, node);
+  link_node(level, node);
+
+  depth_update(context, ctx, ladder, action, idx);
+  return node;
+}
+
+/* Shows the next part of an iceberg whose shown part was executed, as if it
+ * were entered at timestamp. Returns 0, dropping the reserve, if there's
+ * none left. */
+static inline int replenish(MeSecurityContext *ctx, MeLevel *level,
+                            MeOrderNode *node, MeTimestamp timestamp) {
+  MeReserve *reserve = reserve_find(&ctx->reserves, node);
+
+  if (reserve->hidden == 0) {
+    reserve_remove(&ctx->reserves, reserve);
+    return 0;
+  }
+  node->order.quantity =
+      reserve->hidden < reserve->display ? reserve->hidden : reserve->display;
+  node->order.timestamp = timestamp;
+  reserve->hidden -= node->order.quantity;
+  level->quantity += node->order.quantity;
+  unlink_node(level, node);
+  link_node(level, node);
+  return 1;
+}
+
+/* Whether the aggressor trades with orders at price. */
+static inline int crosses(MeOrder *aggressor, int64_t price) {
+  if (aggressor->ord_type == ME_ORDER_MARKET ||
+      ((aggressor->ord_type == ME_ORDER_IOC ||
+        aggressor->ord_type == ME_ORDER_FOK) &&
+       aggressor->price == 0))
+    return 1;
+  return !BETTER(aggressor->side, price, aggressor->price);
+}
+
+/* Matches the aggressor against the other side of the book while it crosses
+ * (market orders cross at any price). Returns the quantity left, which is not
+ * positive if the aggressor was fully executed. */
+static inline int64_t swipe(MeContext *context, MeSecurityContext *ctx,
+                            MeMessage *msg) {
+  MeOrder *aggressor = &msg->message.order;
+  MeLadder *ladder = aggressor->side == ME_SIDE_BUY ? &ctx->sell : &ctx->buy;
+  int64_t new_aggressor_quantity = aggressor->quantity;
+
+  while (ladder->used > 0) {
+    MeLevel *level = TOP(ladder);
+    int64_t price = TOP_PRICE(ladder);
+    if (!crosses(aggressor, price)) break;
+
+    MeOrderNode *matched = level->head;
+    int64_t new_matched_quantity = matched->order.quantity;
+    new_aggressor_quantity -= new_matched_quantity;
+    new_matched_quantity -= aggressor->quantity;
+    trade(context, ctx, aggressor, &matched->order, msg->security_id, price);
+    level->quantity -= new_matched_quantity <= 0 ? matched->order.quantity
+                                                 : aggressor->quantity;
+    aggressor->quantity = new_aggressor_quantity;
+    matched->order.quantity = new_matched_quantity;
+
+    if (new_matched_quantity > 0) {
+      order_executed(context, aggressor, msg->security_id);
+      depth_update(context, ctx, ladder, ME_DEPTH_CHANGE, ladder->used - 1);
+      return new_aggressor_quantity;
+    }
+
+    if (matched->order.ord_type == ME_ORDER_ICEBERG &&
+        replenish(ctx, level, matched, aggressor->timestamp)) {
+      depth_update(context, ctx, ladder, ME_DEPTH_CHANGE, ladder->used - 1);
+    } else {
+      order_executed(context, &matched->order, msg->security_id);
+      if ((level->head = matched->next) != NULL) {
+        level->head->prev = NULL;
+        depth_update(context, ctx, ladder, ME_DEPTH_CHANGE, ladder->used - 1);
+      } else {
+        ladder->used--;
+        depth_remove(context, ctx, ladder, 1, price);
+      }
+      index_remove(&ctx->index, matched);
+      free_node(context, ctx, matched);
+    }
+
+    if (new_aggressor_quantity <= 0) {
+      order_executed(context, aggressor, msg->security_id);
+      return new_aggressor_quantity;
+    }
+  }
+
+  return new_aggressor_quantity;
+}
+
+/* Rests what's left of an iceberg, showing up to display of it. There must
+ * be room (see make_room). */
+static inline void rest_iceberg(MeContext *context, MeSecurityContext *ctx,
+                                MeOrder *order, int64_t display) {
+  MeOrder shown = *order;
+  MeReserve reserve;
+
+  if (display <= 0 || display > order->quantity) display = order->quantity;
+  shown.quantity = display;
+  reserve.node = rest_order(context, ctx, &shown);
+  reserve.display = display;
+  reserve.hidden = order->quantity - display;
+  reserve_put(&ctx->reserves, &reserve);
+}
+
+/* Rests what's left of a new order, or cancels it if the pool ran out. */
+static inline void rest(MeContext *context, MeSecurityContext *ctx,
+                        MeMessage *msg) {
+  MeOrder *order = &msg->message.order;
+
+  if (make_room(context, ctx, order) != 0) {
+    order_cancelled(context, order, msg->security_id);
+    return;
+  }
+  if (order->ord_type == ME_ORDER_ICEBERG)
+    rest_iceberg(context, ctx, order, msg->message.iceberg.display);
+  else
+    rest_order(context, ctx, order);
+  if (order->expires != 0) add_timer(context, ctx, order);
+}
+
+static inline void swipe_market(MeContext *context, MeSecurityContext *ctx,
+                                MeMessage *msg) {
+  /* Propagate the new order message. */
+  sendmsg(context, msg);
+
+  if (swipe(context, ctx, msg) > 0) {
+    msg->message.order.ord_type = ME_ORDER_LIMIT;
+    msg->message.order.price = ctx->market_price;
+    /* Propagate again as limit. */
+    sendmsg(context, msg);
+
+    rest(context, ctx, msg);
+  }
+}
+
+/* Also icebergs. */
+static inline void swipe_limit(MeContext *context, MeSecurityContext *ctx,
+                               MeMessage *msg) {
+  /* Propagate the new order message. */
+  sendmsg(context, msg);
+
+  /* Don't need to propagate again. */
+  if (swipe(context, ctx, msg) > 0) rest(context, ctx, msg);
+}
+
+/* Whether the book has enough crossing quantity to execute the order. Only
+ * looks at the levels it would consume. */
+static inline int fillable(MeSecurityContext *ctx, MeOrder *order) {
+  MeLadder *ladder = order->side == ME_SIDE_BUY ? &ctx->sell : &ctx->buy;
+  int64_t available = 0;
+
+  for (int64_t i = ladder->used - 1; i >= 0; i--) {
+    if (!crosses(order, ladder->prices[i])) break;
+    if ((available += ladder->levels[i].quantity) >= order->quantity)
+      return 1;
+  }
+  return 0;
+}
+
+static inline void swipe_immediate(MeContext *context, MeSecurityContext *ctx,
+                                   MeMessage *msg) {
+  MeOrder *order = &msg->message.order;
+
+  /* Propagate the new order message. */
+  sendmsg(context, msg);
+
+  /* A FOK that can't be filled is cancelled without trading. */
+  if ((order->ord_type != ME_ORDER_FOK || fillable(ctx, order)) &&
+      swipe(context, ctx, msg) <= 0)
+    return;
+
+  order_cancelled(context, order, msg->security_id);
+}
+
+/* Where a stop goes, after those triggering no later. BETTER reads as
+ * further from triggering, for stops. */
+static inline int64_t find_stop(MeTriggers *triggers, MeSide side,
+                                int64_t stop_price) {
+  int64_t lo = 0;
+  int64_t hi = triggers->used;
+
+  while (lo < hi) {
+    int64_t mid = (lo + hi) / 2;
+    if (BETTER(side, triggers->stops[mid].stop_price, stop_price))
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+/* The first table of stops, once there's one. */
+#define STOPS_BITS 6
+
+static inline void stop_put(MeStopIndex *stops, MeStopEntry *entry) {
+  int64_t i = INDEX_HOME(stops, entry->order_id);
+  while (stops->entries[i].used) i = INDEX_NEXT(stops, i);
+  stops->entries[i] = *entry;
+  stops->used++;
+}
+
+static inline int grow_stops(MeContext *context, MeStopIndex *stops) {
+  MeStopEntry *old = stops->entries;
+  int64_t old_size = stops->size;
+  int64_t size = old_size > 0 ? 2 * old_size : 1 << STOPS_BITS;
+  MeStopEntry *entries = pool_alloc(context, size * sizeof(MeStopEntry));
+
+  if (entries == NULL) return ENOMEM;
+  memset(entries, 0, size * sizeof(MeStopEntry));
+  stops->size = size;
+  stops->shift = old_size > 0 ? stops->shift - 1 : 64 - STOPS_BITS;
+  stops->used = 0;
+  stops->entries = entries;
+
+  for (int64_t i = 0; i < old_size; i++)
+    if (old[i].used) stop_put(stops, &old[i]);
+  if (old != NULL) pool_free(context, old, old_size * sizeof(MeStopEntry));
+  return 0;
+}
+
+/* The first entry with the ID, NULL if there's none. */
+static inline MeStopEntry *stop_find(MeStopIndex *stops, MeOrderID id) {
+  if (stops->used == 0) return NULL;
+  for (int64_t i = INDEX_HOME(stops, id); stops->entries[i].used;
+       i = INDEX_NEXT(stops, i))
+    if (stops->entries[i].order_id == id) return &stops->entries[i];
+  return NULL;
+}
+
+/* As index_remove. */
+static inline void stop_remove(MeStopIndex *stops, MeStopEntry *entry) {
+  int64_t i = entry - stops->entries;
+
+  for (int64_t j = INDEX_NEXT(stops, i); stops->entries[j].used;
+       j = INDEX_NEXT(stops, j)) {
+    int64_t home = INDEX_HOME(stops, stops->entries[j].order_id);
+    if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) {
+      stops->entries[i] = stops->entries[j];
+      i = j;
+    }
+  }
+
+  stops->entries[i].used = 0;
+  stops->used--;
+}
+
+/* Removes the entry of a stop taken out of the triggers of side, which may
+ * share its ID with others. */
+static inline void stop_forget(MeStopIndex *stops, MeSide side,
+                               MeStopOrder *stop) {
+  int64_t i = INDEX_HOME(stops, stop->order.order_id);
+
+  while (stops->entries[i].order_id != stop->order.order_id ||
+         stops->entries[i].side != side ||
+         stops->entries[i].stop_price != stop->stop_price)
+    i = INDEX_NEXT(stops, i);
+  stop_remove(stops, &stops->entries[i]);
+}
 
-  context->contexts[0].buy = book;
-  book = (MeBook *)(((size_t)context->contexts[0].buy) + full_book_s);
-  context->contexts[0].sell = book;
-  book = (MeBook *)(((size_t)context->contexts[0].sell) + full_book_s);
+static inline int grow_triggers(MeContext *context, MeTriggers *triggers) {
+  int64_t size = triggers->size > 0 ? 2 * triggers->size : 64;
+  MeStopOrder *stops = pool_alloc(context, size * sizeof(MeStopOrder));
 
-  context->contexts[0].buy->used = 0;
-  context->contexts[0].sell->used = 0;
-  context->contexts[0].buy->next = NULL;
-  context->contexts[0].sell->next = NULL;
+  if (stops == NULL) return ENOMEM;
+  memcpy(stops, triggers->stops, triggers->used * sizeof(MeStopOrder));
+  if (triggers->stops != NULL)
+    pool_free(context, triggers->stops, triggers->size * sizeof(MeStopOrder));
+  triggers->stops = stops;
+  triggers->size = size;
+  return 0;
+}
 
-  /* Init the rest. */
-  for (int64_t i = 1; i < n_secs; i++) {
-    context->contexts[i].market_price = i;
-    omp_init_lock(&context->contexts[i].lock);
+/* Cancels the stop if the pool ran out. */
+static inline void add_stop(MeContext *context, MeSecurityContext *ctx,
+                            MeMessage *msg) {
+  MeStopOrder *stop = &msg->message.stop;
+  MeTriggers *triggers =
+      stop->order.side == ME_SIDE_BUY ? &ctx->buy_stops : &ctx->sell_stops;
+  int64_t idx = find_stop(triggers, stop->order.side, stop->stop_price);
+  MeStopEntry entry = {stop->order.order_id, stop->stop_price,
+                       stop->order.side, stop->order.expires, 1};
 
-    context->contexts[i].buy = book;
-    book = (MeBook *)(((size_t)context->contexts[i].buy) + full_book_s);
-    context->contexts[i].sell = book;
-    book = (MeBook *)(((size_t)context->contexts[i].sell) + full_book_s);
+  /* Propagate the new order message. */
+  sendmsg(context, msg);
 
-    context->contexts[i].buy->used = 0;
-    context->contexts[i].sell->used = 0;
-    context->contexts[i].buy->next = NULL;
-    context->contexts[i].sell->next = NULL;
+  if ((triggers->used == triggers->size && grow_triggers(context, triggers)) ||
+      (4 * (ctx->stops.used + 1) > 3 * ctx->stops.size &&
+       grow_stops(context, &ctx->stops)) ||
+      (stop->order.expires != 0 && ctx->wheel.free == NULL &&
+       add_timers(context, &ctx->wheel))) {
+    order_cancelled(context, &stop->order, msg->security_id);
+    return;
   }
-
-  return context;
+  memmove(&triggers->stops[idx + 1], &triggers->stops[idx],
+          (triggers->used - idx) * sizeof(MeStopOrder));
+  triggers->stops[idx] = *stop;
+  triggers->used++;
+  stop_put(&ctx->stops, &entry);
+  if (stop->order.expires != 0) add_timer(context, ctx, &stop->order);
 }
 
-void me_dealloc_context(MeContext *context, void deallocate(void *)) {
-  mq_close(context->incoming);
-  mq_close(context->outcoming);
-  mq_unlink(me_in_queue_name);
-  mq_unlink(me_out_queue_name);
+/* Takes the next stop of a side if the market price reached it. */
+static inline int pop_stop(MeSecurityContext *ctx, MeTriggers *triggers,
+                           MeSide side, MeStopOrder *stop) {
+  if (triggers->used == 0 ||
+      BETTER(side, triggers->stops[triggers->used - 1].stop_price,
+             ctx->market_price))
+    return 0;
+  *stop = triggers->stops[--triggers->used];
+  stop_forget(&ctx->stops, side, stop);
+  return 1;
+}
 
-  for (int64_t i = 0; i < context->n_securities; i++)
-    omp_destroy_lock(&context->contexts[i].lock);
+/* Enters the triggered stops one by one, as each may move the price. They
+ * keep their stop price in the NEW_ORDER propagated. */
+static inline void trigger_stops(MeContext *context, MeSecurityContext *ctx,
+                                 int64_t id) {
+  MeMessage msg;
+  MeOrder *order = &msg.message.order;
+
+  msg.msg_type = ME_MESSAGE_NEW_ORDER;
+  msg.security_id = id;
+  while (pop_stop(ctx, &ctx->buy_stops, ME_SIDE_BUY, &msg.message.stop) ||
+         pop_stop(ctx, &ctx->sell_stops, ME_SIDE_SELL, &msg.message.stop)) {
+    if (order->ord_type == ME_ORDER_STOP) {
+      order->ord_type = ME_ORDER_MARKET;
+      order->price = 0;
+      swipe_market(context, ctx, &msg);
+    } else {
+      order->ord_type = ME_ORDER_LIMIT;
+      swipe_limit(context, ctx, &msg);
+    }
+  }
+}
 
-  deallocate(context);
+/* Takes a waiting stop out, returning whether there was one with the ID. It's
+ * looked for among those with its stop price only. */
+static inline int cancel_stop(MeSecurityContext *ctx, MeOrderID id) {
+  MeStopEntry *entry = stop_find(&ctx->stops, id);
+  MeTriggers *triggers;
+  int64_t i;
+
+  if (entry == NULL) return 0;
+  triggers = entry->side == ME_SIDE_BUY ? &ctx->buy_stops : &ctx->sell_stops;
+  i = find_stop(triggers, entry->side, entry->stop_price);
+  while (triggers->stops[i].order.order_id != id) i++;
+  memmove(&triggers->stops[i], &triggers->stops[i + 1],
+          (triggers->used - i - 1) * sizeof(MeStopOrder));
+  triggers->used--;
+  stop_remove(&ctx->stops, entry);
+  return 1;
 }
 
-#define sendmsg(context, msg) \
-  (mq_send((context)->outcoming, (char *)(msg), sizeof(MeMessage), 1))
+static inline void new_order(MeContext *context, MeSecurityContext *ctx,
+                             MeMessage *msg) {
+  LOCK(context, ctx);
+  if (!journaled(context, msg)) {
+    UNLOCK(context, ctx);
+    return;
+  }
+  ctx->applied++;
+  if (msg->message.order.ord_type == ME_ORDER_MARKET)
+    swipe_market(context, ctx, msg);
+  else if (msg->message.order.ord_type == ME_ORDER_LIMIT ||
+           msg->message.order.ord_type == ME_ORDER_ICEBERG)
+    swipe_limit(context, ctx, msg);
+  else if (msg->message.order.ord_type == ME_ORDER_STOP ||
+           msg->message.order.ord_type == ME_ORDER_STOP_LIMIT)
+    add_stop(context, ctx, msg);
+  else
+    swipe_immediate(context, ctx, msg);
+  trigger_stops(context, ctx, msg->security_id);
+  if (context->conflated != NULL) conflate(context, ctx);
+  UNLOCK(context, ctx);
+}
 
 static inline void set_market_price(MeContext *context, MeSecurityContext *ctx,
                                     MeMessage *msg) {
-  omp_set_lock(&ctx->lock);
+  LOCK(context, ctx);
+  if (!journaled(context, msg)) {
+    UNLOCK(context, ctx);
+    return;
+  }
+  ctx->applied++;
   ctx->market_price = msg->message.set_market_price;
-  omp_unset_lock(&ctx->lock);
-  /* Propagate the message to the outcoming. */
+  /* Propagate the message to the outcoming, before the stops it triggers. */
   sendmsg(context, msg);
+  trigger_stops(context, ctx, msg->security_id);
+  if (context->conflated != NULL) conflate(context, ctx);
+  UNLOCK(context, ctx);
 }
 
-#define LEFT(a) (2 * (a) + 1)
-#define RIGHT(a) (2 * (a) + 2)
-#define PARENT(a) (((a) - ((a) + 1) % 2) / 2)
+/* Takes a resting order out of the book. */
+static inline void remove_order(MeContext *context, MeSecurityContext *ctx,
+                                MeOrderNode *node) {
+  MeLadder *ladder = node->order.side == ME_SIDE_BUY ? &ctx->buy : &ctx->sell;
+  int64_t idx = find_level(ladder, node->order.side, node->order.price);
+  MeLevel *level = &ladder->levels[idx];
+
+  level->quantity -= node->order.quantity;
+  unlink_node(level, node);
+  if (node->order.ord_type == ME_ORDER_ICEBERG)
+    reserve_remove(&ctx->reserves, reserve_find(&ctx->reserves, node));
+  if (level->head == NULL) {
+    int64_t price = ladder->prices[idx];
+    remove_level(ladder, idx);
+    depth_remove(context, ctx, ladder, ladder->used + 1 - idx, price);
+  } else {
+    depth_update(context, ctx, ladder, ME_DEPTH_CHANGE, idx);
+  }
+  index_remove(&ctx->index, node);
+  free_node(context, ctx, node);
+}
 
-#define BUY_GREATER_THAN(a, b) \
-  ((a).price > (b).price ||    \
-   ((a).price == (b).price && (a).timestamp < (b).timestamp))
-#define SELL_GREATER_THAN(a, b) \
-  ((a).price < (b).price ||     \
-   ((a).price == (b).price && (a).timestamp < (b).timestamp))
+static inline void cancel_order(MeContext *context, MeSecurityContext *ctx,
+                                MeMessage *msg) {
+  MeOrderNode *node;
 
-static inline void trade(MeContext *context, MeSecurityContext *ctx,
-                         MeOrder *aggressor, MeOrder *other, int64_t id,
-                         int64_t price) {
-  MeMessage send;
-  int64_t last_price = ctx->market_price;
-  ctx->market_price = price;
+  LOCK(context, ctx);
+  if (!journaled(context, msg)) {
+    UNLOCK(context, ctx);
+    return;
+  }
+  ctx->applied++;
+  /* Before the depth update it causes. */
+  sendmsg(context, msg);
 
-  send.msg_type = ME_MESSAGE_TRADE;
-  send.security_id = id;
-  send.message.trade.aggressor = *aggressor;
-  send.message.trade.matched_id = other->order_id;
-  sendmsg(context, &send);
+  if ((node = index_find(&ctx->index, msg->message.to_cancel)) != NULL)
+    remove_order(context, ctx, node);
+  else
+    cancel_stop(ctx, msg->message.to_cancel);
 
-  if (last_price != price) {
-    send.msg_type = ME_MESSAGE_SET_MARKET_PRICE;
-    send.message.set_market_price = price;
-    sendmsg(context, &send);
-  }
+  if (context->conflated != NULL) conflate(context, ctx);
+  UNLOCK(context, ctx);
 }
 
-static inline void order_executed(MeContext *context, MeOrder *order,
-                                  int64_t id) {
-  MeMessage to_send;
-  to_send.msg_type = ME_MESSAGE_ORDER_EXECUTED;
-  to_send.security_id = id;
-  to_send.message.order = *order;
-  sendmsg(context, &to_send);
-}
+/* Decreasing the quantity keeps the order where it is. Any other change
+ * takes it out and enters it again as a new order with the timestamp of the
+ * amend, which may trade before resting. The amend is propagated once,
+ * before the events it causes, as the order ends up (see
+ * ME_MESSAGE_AMEND_ORDER). */
+static inline void amend_order(MeContext *context, MeSecurityContext *ctx,
+                               MeMessage *msg) {
+  MeOrder *amend = &msg->message.order;
+  MeReserve *reserve = NULL;
+  MeOrderNode *node;
+  int64_t hidden = 0;
+
+  LOCK(context, ctx);
+  if (!journaled(context, msg)) {
+    UNLOCK(context, ctx);
+    return;
+  }
+  ctx->applied++;
 
-static inline void new_limit_buy(MeBook *book, MeOrder *order, int64_t buf_size,
-                                 void *(*allocate)(size_t)) {
-  int64_t new_pos = book->used;
-  int64_t parent = PARENT(new_pos);
+  if ((node = index_find(&ctx->index, amend->order_id)) != NULL &&
+      node->order.ord_type == ME_ORDER_ICEBERG) {
+    reserve = reserve_find(&ctx->reserves, node);
+    hidden = reserve->hidden;
+  }
 
-  if (new_pos > buf_size) {
-    if (book->next == NULL) {
-      book->next = allocate(sizeof(MeBook) + buf_size * sizeof(MeOrder));
-      book->next->next = NULL;
-      book->next->used = 0;
-    }
-    if (BUY_GREATER_THAN(book->orders[book->used], *order)) {
-      new_limit_buy(book->next, order, buf_size, allocate);
-      return;
+  if (node == NULL) {
+    amend->quantity = 0;
+    sendmsg(context, msg);
+  } else if ((amend->price == 0 || amend->price == node->order.price) &&
+             amend->quantity > 0 &&
+             amend->quantity <= node->order.quantity + hidden) {
+    MeLadder *ladder =
+        node->order.side == ME_SIDE_BUY ? &ctx->buy : &ctx->sell;
+    int64_t idx = find_level(ladder, node->order.side, node->order.price);
+    int64_t cut = node->order.quantity + hidden - amend->quantity;
+
+    if (reserve != NULL) {
+      reserve->hidden -= cut < hidden ? cut : hidden;
+      cut -= cut < hidden ? cut : hidden;
     }
-    new_limit_buy(book->next, &book->orders[parent], buf_size, allocate);
-    new_pos = parent;
-    parent = PARENT(new_pos);
-  }
+    ladder->levels[idx].quantity -= cut;
+    node->order.quantity -= cut;
+    *amend = node->order;
+    amend->quantity += reserve != NULL ? reserve->hidden : 0;
+    sendmsg(context, msg);
+    depth_update(context, ctx, ladder, ME_DEPTH_CHANGE, idx);
+  } else {
+    MeOrder order = node->order;
+    int64_t display = reserve != NULL ? reserve->display : 0;
+
+    if (amend->price != 0) order.price = amend->price;
+    order.quantity = amend->quantity > 0 ? amend->quantity : 0;
+    order.timestamp = amend->timestamp;
+    *amend = order;
+    sendmsg(context, msg);
 
-  /* PARENT(0) = 0. */
-  while (parent != new_pos && BUY_GREATER_THAN(*order, book->orders[parent])) {
-    book->orders[new_pos] = book->orders[parent];
-    new_pos = parent;
-    parent = PARENT(new_pos);
+    remove_order(context, ctx, node);
+    if (order.quantity > 0 && swipe(context, ctx, msg) > 0) {
+      /* Its timer stays. */
+      if (make_room(context, ctx, amend) != 0)
+        order_cancelled(context, amend, msg->security_id);
+      else if (order.ord_type == ME_ORDER_ICEBERG)
+        rest_iceberg(context, ctx, amend, display);
+      else
+        rest_order(context, ctx, amend);
+    }
+    trigger_stops(context, ctx, msg->security_id);
   }
-  book->orders[new_pos] = *order;
 
-  book->used++;
+  if (context->conflated != NULL) conflate(context, ctx);
+  UNLOCK(context, ctx);
 }
 
-static inline void new_limit_sell(MeBook *book, MeOrder *order,
-                                  int64_t buf_size, void *(*allocate)(size_t)) {
-  int64_t new_pos = book->used;
-  int64_t parent = PARENT(new_pos);
-
-  if (new_pos > buf_size) {
-    if (book->next == NULL) {
-      book->next = allocate(sizeof(MeBook) + buf_size * sizeof(MeOrder));
-      book->next->next = NULL;
-      book->next->used = 0;
+/* Unlinks the orders selected by mass from the levels of a side, leaving the
+ * empty levels for cancel_levels. Going from the worst level, those below the
+ * published depth are done before it's reached, so each published level that
+ * changed is sent from where it is: a CHANGE, or a DELETE and an ADD of the
+ * next level left below. Returns how many were cancelled. */
+static inline int64_t cancel_orders(MeContext *context, MeSecurityContext *ctx,
+                                    MeLadder *ladder, MeMassCancel *mass) {
+  MeMessage send;
+  int64_t cancelled = 0;
+  int64_t published = ladder->used < context->depth ? ladder->used
+                                                    : context->depth;
+  int64_t below = ladder->used - published - 1;
+
+  send.msg_type = ME_MESSAGE_CANCEL_ORDER;
+  send.security_id = ctx - context->contexts;
+  for (int64_t i = 0; i < ladder->used; i++) {
+    MeLevel *level = &ladder->levels[i];
+    int64_t quantity = level->quantity;
+    MeOrderNode *next;
+
+    for (MeOrderNode *node = level->head; node != NULL; node = next) {
+      next = node->next;
+      if ((mass->flags & ME_MASS_CANCEL_OWNER) &&
+          node->order.owner != mass->owner)
+        continue;
+      if (mass->flags & ME_MASS_CANCEL_ORDERS) {
+        send.message.to_cancel = node->order.order_id;
+        sendmsg(context, &send);
+      }
+      level->quantity -= node->order.quantity;
+      unlink_node(level, node);
+      if (node->order.ord_type == ME_ORDER_ICEBERG)
+        reserve_remove(&ctx->reserves, reserve_find(&ctx->reserves, node));
+      index_remove(&ctx->index, node);
+      free_node(context, ctx, node);
+      cancelled++;
     }
-    if (SELL_GREATER_THAN(book->orders[book->used], *order)) {
-      new_limit_sell(book->next, order, buf_size, allocate);
-      return;
+
+    if (ladder->used - i > published || level->quantity == quantity) continue;
+    if (level->head != NULL) {
+      depth_update(context, ctx, ladder, ME_DEPTH_CHANGE, i);
+      continue;
     }
-    new_limit_sell(book->next, &book->orders[parent], buf_size, allocate);
-    new_pos = parent;
-    parent = PARENT(new_pos);
+    depth_delete(context, ctx, ladder, ladder->used - i, ladder->prices[i]);
+    while (below >= 0 && ladder->levels[below].head == NULL) below--;
+    if (below >= 0)
+      depth_level(context, ctx, ladder, ME_DEPTH_ADD, context->depth, below--);
   }
+  return cancelled;
+}
 
-  /* PARENT(0) = 0. */
-  while (parent != new_pos && SELL_GREATER_THAN(*order, book->orders[parent])) {
-    book->orders[new_pos] = book->orders[parent];
-    new_pos = parent;
-    parent = PARENT(new_pos);
+/* Drops the waiting stops selected by mass, keeping the rest in order.
+ * Returns how many were cancelled. */
+static inline int64_t cancel_stops(MeContext *context, MeSecurityContext *ctx,
+                                   MeTriggers *triggers, MeMassCancel *mass) {
+  MeSide side = triggers == &ctx->buy_stops ? ME_SIDE_BUY : ME_SIDE_SELL;
+  MeMessage send;
+  int64_t used = 0;
+
+  send.msg_type = ME_MESSAGE_CANCEL_ORDER;
+  send.security_id = ctx - context->contexts;
+  for (int64_t i = 0; i < triggers->used; i++) {
+    MeOrder *order = &triggers->stops[i].order;
+    if ((mass->flags & ME_MASS_CANCEL_OWNER) && order->owner != mass->owner) {
+      triggers->stops[used++] = triggers->stops[i];
+      continue;
+    }
+    stop_forget(&ctx->stops, side, &triggers->stops[i]);
+    if (mass->flags & ME_MASS_CANCEL_ORDERS) {
+      send.message.to_cancel = order->order_id;
+      sendmsg(context, &send);
+    }
   }
-  book->orders[new_pos] = *order;
 
-  book->used++;
+  int64_t cancelled = triggers->used - used;
+  triggers->used = used;
+  return cancelled;
 }
 
-static inline void remove_first_sell(MeBook *book, int64_t buf_size) {
-  book->orders[0] = book->orders[book->used - 1];
-  book->used--;
-  MeOrder tmp;
-
-  /* I don't know how to optimize this and keep it readable. */
-  /* TODO: this whole thing probably needs a rewrite. */
-  int64_t i = 0;
-  uint8_t swapped = 1;
-  do {
-    if (book->used > LEFT(i) &&
-        SELL_GREATER_THAN(book->orders[LEFT(i)], book->orders[i])) {
-      tmp = book->orders[i];
-      book->orders[i] = book->orders[LEFT(i)];
-      book->orders[LEFT(i)] = tmp;
-      i = LEFT(i);
-    } else if (book->used > RIGHT(i) &&
-               SELL_GREATER_THAN(book->orders[RIGHT(i)], book->orders[i])) {
-      tmp = book->orders[i];
-      book->orders[i] = book->orders[RIGHT(i)];
-      book->orders[RIGHT(i)] = tmp;
-      i = RIGHT(i);
-    } else {
-      swapped = !swapped;
-    }
-  } while (!swapped);
+/* Drops the empty levels in one go. */
+static inline void cancel_levels(MeLadder *ladder) {
+  int64_t used = 0;
 
-  /* Tail recursive. Good. The insertion is guarantee to not recurse, of course.
-   * So it won't allocate too. */
-  if (book->next == NULL || book->next->used > 0) return;
-  new_limit_sell(book, &book->next->orders[0], buf_size, NULL);
-  remove_first_sell(book->next, buf_size);
+  for (int64_t i = 0; i < ladder->used; i++) {
+    if (ladder->levels[i].head == NULL) continue;
+    ladder->prices[used] = ladder->prices[i];
+    ladder->levels[used++] = ladder->levels[i];
+  }
+  ladder->used = used;
 }
 
-static inline void remove_first_buy(MeBook *book, int64_t buf_size) {
-  book->orders[0] = book->orders[book->used - 1];
-  book->used--;
-  MeOrder tmp;
+/* Sets how many orders were cancelled in msg, and only propagates it if
+ * asked to. */
+static inline void mass_cancel(MeContext *context, MeSecurityContext *ctx,
+                               MeMessage *msg, int propagate) {
+  MeMassCancel *mass = &msg->message.mass_cancel;
+  uint32_t sides = mass->flags & (ME_MASS_CANCEL_BUY | ME_MASS_CANCEL_SELL);
+  int64_t buy = 0;
+  int64_t sell = 0;
+
+  LOCK(context, ctx);
+  if (!journaled(context, msg)) {
+    UNLOCK(context, ctx);
+    return;
+  }
+  ctx->applied++;
+
+  if (sides != ME_MASS_CANCEL_SELL)
+    buy = cancel_orders(context, ctx, &ctx->buy, mass);
+  if (sides != ME_MASS_CANCEL_BUY)
+    sell = cancel_orders(context, ctx, &ctx->sell, mass);
+  mass->cancelled = buy + sell;
+  if (sides != ME_MASS_CANCEL_SELL)
+    mass->cancelled += cancel_stops(context, ctx, &ctx->buy_stops, mass);
+  if (sides != ME_MASS_CANCEL_BUY)
+    mass->cancelled += cancel_stops(context, ctx, &ctx->sell_stops, mass);
+  if (propagate) sendmsg(context, msg);
+  if (buy > 0) cancel_levels(&ctx->buy);
+  if (sell > 0) cancel_levels(&ctx->sell);
+
+  if (context->conflated != NULL) conflate(context, ctx);
+  UNLOCK(context, ctx);
+}
 
-  int64_t i = 0;
-  uint8_t swapped = 1;
-  do {
-    if (book->used > LEFT(i) &&
-        BUY_GREATER_THAN(book->orders[LEFT(i)], book->orders[i])) {
-      tmp = book->orders[i];
-      book->orders[i] = book->orders[LEFT(i)];
-      book->orders[LEFT(i)] = tmp;
-      i = LEFT(i);
-    } else if (book->used > RIGHT(i) &&
-               BUY_GREATER_THAN(book->orders[RIGHT(i)], book->orders[i])) {
-      tmp = book->orders[i];
-      book->orders[i] = book->orders[RIGHT(i)];
-      book->orders[RIGHT(i)] = tmp;
-      i = RIGHT(i);
-    } else {
-      swapped = !swapped;
-    }
-  } while (!swapped);
-  if (book->next == NULL || book->next->used > 0) return;
-  new_limit_buy(book, &book->next->orders[0], buf_size, NULL);
-  remove_first_buy(book->next, buf_size);
+/* When the resting order with the ID expires, setting node to it, or else the
+ * waiting stop. 0 if there's neither or it doesn't expire. */
+static inline uint32_t timer_due(MeSecurityContext *ctx, MeOrderID id,
+                                 MeOrderNode **node) {
+  MeStopEntry *stop;
+
+  if ((*node = index_find(&ctx->index, id)) != NULL &&
+      (*node)->order.expires != 0)
+    return (*node)->order.expires;
+  *node = NULL;
+  stop = stop_find(&ctx->stops, id);
+  return stop != NULL ? stop->expires : 0;
 }
 
-static inline void swipe_market_buy(MeContext *context, MeSecurityContext *ctx,
-                                    MeMessage *msg, void *(*allocate)(size_t)) {
-  int64_t new_aggressor_quantity = msg->message.order.quantity;
-  /* Propagate the new order message. */
-  sendmsg(context, msg);
+/* Steps the wheel second by second up to the Unix time in msg, cancelling
+ * the orders due. Journals msg if any was, so replaying expires them at the
+ * same point. */
+static inline void expire_orders(MeContext *context, MeSecurityContext *ctx,
+                                 MeMessage *msg) {
+  MeWheel *wheel = &ctx->wheel;
+  MeMessage send;
+  int64_t expired = 0;
+
+  send.msg_type = ME_MESSAGE_CANCEL_ORDER;
+  send.security_id = msg->security_id;
+
+  LOCK(context, ctx);
+  while (wheel->now < msg->message.expire && wheel->used > 0) {
+    MeTimer *timer;
+    MeTimer *next;
+    MeOrderNode *node;
+    int empty = 0;
+
+    /* With the lower levels empty, nothing happens until the next slot of
+     * the first that isn't, so replaying from scratch doesn't step through
+     * every second since 1970. */
+    while (wheel_empty(wheel, empty)) empty++;
+    if (empty > 0) {
+      uint64_t last =
+          wheel->now | (((uint64_t)1 << (ME_WHEEL_BITS * empty)) - 1);
+      if (last >= msg->message.expire) break;
+      wheel->now = last;
+    }
+    uint64_t now = ++wheel->now;
+
+    /* From the top, as a level may move timers to the slot of the next. */
+    for (int level = ME_WHEEL_LEVELS - 1; level > 0; level--) {
+      if (now & (((uint64_t)1 << (ME_WHEEL_BITS * level)) - 1)) continue;
+      MeTimer **slot = &wheel->slots[level][(now >> (ME_WHEEL_BITS * level)) &
+                                            (ME_WHEEL_SLOTS - 1)];
+      for (timer = *slot, *slot = NULL; timer != NULL; timer = next) {
+        next = timer->next;
+        uint32_t expires = timer_due(ctx, timer->order_id, &node);
+        if (expires == 0)
+          free_timer(wheel, timer);
+        else
+          wheel_put(wheel, timer, expires > now ? expires : now);
+      }
+    }
 
-  /* Book swipe. */
-  while (ctx->sell->used > 0) {
-    int64_t new_matched_quantity = ctx->sell->orders[0].quantity;
-    new_aggressor_quantity -= new_matched_quantity;
-    new_matched_quantity -= msg->message.order.quantity;
-    trade(context, ctx, &msg->message.order, &ctx->sell->orders[0],
-          msg->security_id, ctx->sell->orders[0].price);
-    msg->message.order.quantity = new_aggressor_quantity;
-    ctx->sell->orders[0].quantity = new_matched_quantity;
-
-    if (new_matched_quantity <= 0) {
-      order_executed(context, &ctx->sell->orders[0], msg->security_id);
-      remove_first_sell(ctx->sell, context->buf_size);
-      if (new_aggressor_quantity <= 0) {
-        order_executed(context, &msg->message.order, msg->security_id);
-        return;
+    MeTimer **slot = &wheel->slots[0][now & (ME_WHEEL_SLOTS - 1)];
+    for (timer = *slot, *slot = NULL; timer != NULL; timer = next) {
+      next = timer->next;
+      uint32_t expires = timer_due(ctx, timer->order_id, &node);
+      /* Or another order took its ID. */
+      if (expires != 0 && expires <= now) {
+        if (expired++ == 0) {
+          if (!journaled(context, msg)) {
+            /* Due again in the next step, whenever there's one. */
+            for (; timer != NULL; timer = next) {
+              next = timer->next;
+              wheel_put(wheel, timer, now + 1);
+            }
+            UNLOCK(context, ctx);
+            return;
+          }
+          ctx->applied++;
+        }
+        send.message.to_cancel = timer->order_id;
+        sendmsg(context, &send);
+        if (node != NULL)
+          remove_order(context, ctx, node);
+        else
+          cancel_stop(ctx, timer->order_id);
       }
-      /* new_aggressor_quantity <= 0 */
-    } else {
-      order_executed(context, &msg->message.order, msg->security_id);
-      return;
+      free_timer(wheel, timer);
     }
   }
+  if (wheel->now < msg->message.expire) wheel->now = msg->message.expire;
 
-  if (new_aggressor_quantity > 0) {
-    msg->message.order.ord_type = ME_ORDER_LIMIT;
-    msg->message.order.price = ctx->market_price;
-    /* Propagate again as limit. */
+  if (expired > 0 && context->conflated != NULL) conflate(context, ctx);
+  UNLOCK(context, ctx);
+}
+
+/* Securities matched by this thread, those with ids equal to shard modulo
+ * shards. */
+static int shard = 0;
+static int shards = 1;
+#pragma omp threadprivate(shard, shards)
+
+/* Sweeps for a MASS_CANCEL of every security this worker did in this run. */
+static uint64_t sweep = 0;
+#pragma omp threadprivate(sweep)
+
+/* Every security is journaled on its own, so replaying doesn't depend on
+ * the sharding. Workers add up what they cancelled, and the last one done
+ * propagates it, after the CANCEL_ORDERs of them all. */
+static inline void mass_cancel_all(MeContext *context, MeMessage *msg) {
+  MeMessage each = *msg;
+  uint64_t cancelled = 0;
+  uint64_t spins = 0;
+
+  for (int64_t i = shard; i < context->n_securities; i += shards) {
+    each.security_id = i;
+    each.message.mass_cancel = msg->message.mass_cancel;
+    mass_cancel(context, &context->contexts[i], &each, 0);
+    cancelled += each.message.mass_cancel.cancelled;
+  }
+  if (shards == 1) {
+    msg->message.mass_cancel.cancelled = cancelled;
     sendmsg(context, msg);
+    return;
+  }
 
-    new_limit_buy(ctx->buy, &msg->message.order, context->buf_size, allocate);
+  flush(context);
+  /* A worker ahead of the others waits for them to finish the last one,
+   * unless they stopped (see stopping). */
+  while (__atomic_load_n(&context->sweeps, __ATOMIC_ACQUIRE) != sweep) {
+    if (stopping(context)) return;
+    relax(&spins);
   }
-}
+  sweep++;
+  __atomic_add_fetch(&context->swept, cancelled, __ATOMIC_RELAXED);
+  if (__atomic_add_fetch(&context->swept_by, 1, __ATOMIC_ACQ_REL) < shards)
+    return;
 
-static inline void swipe_market_sell(MeContext *context, MeSecurityContext *ctx,
-                                     MeMessage *msg,
-                                     void *(*allocate)(size_t)) {
-  int64_t new_aggressor_quantity = msg->message.order.quantity;
-  /* Propagate the new order message. */
+  msg->message.mass_cancel.cancelled = context->swept;
   sendmsg(context, msg);
+  context->swept = 0;
+  context->swept_by = 0;
+  __atomic_add_fetch(&context->sweeps, 1, __ATOMIC_RELEASE);
+}
 
-  /* Book swipe. */
-  while (ctx->buy->used > 0) {
-    int64_t new_matched_quantity = ctx->buy->orders[0].quantity;
-    new_aggressor_quantity -= new_matched_quantity;
-    new_matched_quantity -= msg->message.order.quantity;
-    trade(context, ctx, &msg->message.order, &ctx->buy->orders[0],
-          msg->security_id, ctx->buy->orders[0].price);
-    msg->message.order.quantity = new_aggressor_quantity;
-    ctx->buy->orders[0].quantity = new_matched_quantity;
-
-    if (new_matched_quantity <= 0) {
-      order_executed(context, &ctx->buy->orders[0], msg->security_id);
-      remove_first_buy(ctx->buy, context->buf_size);
-      if (new_aggressor_quantity <= 0) {
-        order_executed(context, &msg->message.order, msg->security_id);
-        return;
-      }
-      /* new_aggressor_quantity <= 0 */
+/* Inbound messages dequeued by this thread and not handled yet. */
+static MeFrame inbound;
+static int64_t inbound_next;
+#pragma omp threadprivate(inbound, inbound_next)
+
+/* Dequeues in batches of up to ME_FRAME_MESSAGES from the ring, or the POSIX
+ * queue until it's empty. A batch ends at a panic, leaving what follows it
+ * queued. Returns 0 if nothing came by the Unix time until (if not 0). */
+static inline int receive_from(MeContext *context, MeRing *ring,
+                               MeMessage *msg, time_t until) {
+  struct timespec deadline = {until, 0};
+  unsigned int p;
+
+  if (inbound_next == inbound.used) {
+    inbound_next = 0;
+    if (ring != NULL) {
+      inbound.used =
+          ring_pop_n(ring, inbound.messages, ME_FRAME_MESSAGES, until);
+      if (inbound.used == 0) return 0;
     } else {
-      order_executed(context, &msg->message.order, msg->security_id);
-      return;
+      if (until == 0) {
+        mq_receive(context->incoming, (char *)&inbound.messages[0],
+                   sizeof(MeMessage), &p);
+      } else if (mq_timedreceive(context->incoming,
+                                 (char *)&inbound.messages[0],
+                                 sizeof(MeMessage), &p, &deadline) == -1) {
+        inbound.used = 0;
+        return 0;
+      }
+      for (inbound.used = 1;
+           inbound.used < ME_FRAME_MESSAGES &&
+           inbound.messages[inbound.used - 1].msg_type != ME_MESSAGE_PANIC;
+           inbound.used++)
+        if (mq_timedreceive(context->incoming,
+                            (char *)&inbound.messages[inbound.used],
+                            sizeof(MeMessage), &p, &no_wait) == -1)
+          break;
     }
   }
 
-  if (new_aggressor_quantity > 0) {
-    msg->message.order.ord_type = ME_ORDER_LIMIT;
-    msg->message.order.price = ctx->market_price;
-    /* Propagate again as limit. */
-    sendmsg(context, msg);
+  *msg = inbound.messages[inbound_next++];
+  return 1;
+}
 
-    new_limit_sell(ctx->sell, &msg->message.order, context->buf_size, allocate);
-  }
+static inline int receive(MeContext *context, MeMessage *msg, time_t until) {
+  return receive_from(
+      context,
+      context->transport == ME_TRANSPORT_SHM ? &context->shm->incoming : NULL,
+      msg, until);
 }
 
-static inline void swipe_limit_buy(MeContext *context, MeSecurityContext *ctx,
-                                   MeMessage *msg, void *(*allocate)(size_t)) {
-  int64_t new_aggressor_quantity = msg->message.order.quantity;
-  /* Propagate the new order message. */
-  sendmsg(context, msg);
+/* Whether this thread expires the orders of its securities, and the Unix time
+ * it'll next do it. */
+static int expiring = 0;
+static time_t expiry_next = 0;
+#pragma omp threadprivate(expiring, expiry_next)
 
-  while (ctx->sell->used > 0 &&
-         msg->message.order.price >= ctx->sell->orders[0].price) {
-    int64_t new_matched_quantity = ctx->sell->orders[0].quantity;
-    new_aggressor_quantity -= new_matched_quantity;
-    new_matched_quantity -= msg->message.order.quantity;
-    trade(context, ctx, &msg->message.order, &ctx->sell->orders[0],
-          msg->security_id, ctx->sell->orders[0].price);
-    msg->message.order.quantity = new_aggressor_quantity;
-    ctx->sell->orders[0].quantity = new_matched_quantity;
-
-    if (new_matched_quantity <= 0) {
-      order_executed(context, &ctx->sell->orders[0], msg->security_id);
-      remove_first_sell(ctx->sell, context->buf_size);
-      if (new_aggressor_quantity <= 0) {
-        order_executed(context, &msg->message.order, msg->security_id);
-        return;
-      }
-      /* new_aggressor_quantity <= 0 */
+/* Once a second, between batches of inbound messages. */
+static inline void expire(MeContext *context) {
+  MeMessage msg;
+  time_t now;
+
+  if (!expiring || inbound_next < inbound.used) return;
+  if ((now = time(NULL)) < expiry_next) return;
+  expiry_next = now + 1;
+
+  msg.msg_type = ME_MESSAGE_EXPIRE;
+  msg.message.expire = now;
+  for (int64_t *link = &timed; *link != -1;) {
+    MeSecurityContext *ctx = &context->contexts[*link];
+
+    msg.security_id = *link;
+    expire_orders(context, ctx, &msg);
+    /* Locked, as other threads may be giving it timers. */
+    LOCK(context, ctx);
+    if (ctx->wheel.used > 0) {
+      link = &ctx->wheel.next;
     } else {
-      order_executed(context, &msg->message.order, msg->security_id);
-      return;
+      ctx->wheel.listed = 0;
+      *link = ctx->wheel.next;
     }
+    UNLOCK(context, ctx);
   }
-
-  /* Don't need to propagate again. */
-  new_limit_buy(ctx->buy, &msg->message.order, context->buf_size, allocate);
+  flush(context);
+  journal_flush(context);
 }
 
-static inline void swipe_limit_sell(MeContext *context, MeSecurityContext *ctx,
-                                    MeMessage *msg, void *(*allocate)(size_t)) {
-  int64_t new_aggressor_quantity = msg->message.order.quantity;
-  /* Propagate the new order message. */
-  sendmsg(context, msg);
+/* Forks a process that writes a snapshot of the books, which keep their state
+ * in it (copy on write) while the engine goes on matching. Every matching
+ * thread must be stopped between messages, since started. */
+static void checkpoint(MeContext *context, MeMessage *msg, uint64_t started) {
+  MeCheckpointStats *stats = &context->stats->checkpoints;
+  uint64_t messages;
+  pid_t pid;
+
+  if (context->checkpoint == NULL || context->replaying) return;
+  if (context->checkpointer > 0) {
+    if (waitpid(context->checkpointer, NULL, WNOHANG) == 0) {
+      stats->skipped++;
+      return;
+    }
+    context->checkpointer = 0;
+  }
 
-  while (ctx->buy->used > 0 &&
-         msg->message.order.price <= ctx->buy->orders[0].price) {
-    int64_t new_matched_quantity = ctx->buy->orders[0].quantity;
-    new_aggressor_quantity -= new_matched_quantity;
-    new_matched_quantity -= msg->message.order.quantity;
-    trade(context, ctx, &msg->message.order, &ctx->buy->orders[0],
-          msg->security_id, ctx->buy->orders[0].price);
-    msg->message.order.quantity = new_aggressor_quantity;
-    ctx->buy->orders[0].quantity = new_matched_quantity;
-
-    if (new_matched_quantity <= 0) {
-      order_executed(context, &ctx->buy->orders[0], msg->security_id);
-      remove_first_buy(ctx->buy, context->buf_size);
-      if (new_aggressor_quantity <= 0) {
-        order_executed(context, &msg->message.order, msg->security_id);
-        return;
-      }
-      /* new_aggressor_quantity <= 0 */
+  messages = applied(context);
+  if ((pid = fork()) == 0) {
+    uint64_t forked = ticks();
+    int r = me_snapshot_write(context, context->checkpoint);
+    if (r == 0) {
+      stats->write = ticks() - forked;
+      stats->messages = messages;
+      stats->written++;
     } else {
-      order_executed(context, &msg->message.order, msg->security_id);
-      return;
+      stats->failed++;
     }
+    _exit(r);
   }
 
-  /* Don't need to propagate again. */
-  new_limit_sell(ctx->sell, &msg->message.order, context->buf_size, allocate);
+  uint64_t pause = ticks() - started;
+  if (pid == -1) {
+    stats->failed++;
+    return;
+  }
+  context->checkpointer = pid;
+  stats->taken++;
+  stats->pause = pause;
+  if (pause > stats->max_pause) stats->max_pause = pause;
+
+  msg->message.checkpoint = messages;
+  sendmsg(context, msg);
 }
 
-static inline void new_order(MeContext *context, MeSecurityContext *ctx,
-                             MeMessage *msg) {
-  omp_set_lock(&ctx->lock);
-  if (msg->message.order.side == ME_SIDE_BUY) {
-    if (msg->message.order.ord_type == ME_ORDER_MARKET)
-      swipe_market_buy(context, ctx, msg, context->allocate);
-    else
-      swipe_limit_buy(context, ctx, msg, context->allocate);
-  } else {
-    if (msg->message.order.ord_type == ME_ORDER_MARKET)
-      swipe_market_sell(context, ctx, msg, context->allocate);
+/* Waits for the last checkpoint to be written. */
+static void checkpoint_wait(MeContext *context) {
+  if (context->checkpointer > 0) waitpid(context->checkpointer, NULL, 0);
+  context->checkpointer = 0;
+}
+
+/* Stops a worker until the dispatcher took a checkpoint (see
+ * me_run_sharded). */
+static inline void park(MeContext *context) {
+  uint64_t resumed = __atomic_load_n(&context->resumed, __ATOMIC_ACQUIRE);
+  uint64_t spins = 0;
+
+  /* Others may park again before this one sees it can go, so it waits for
+   * resumed to change rather than for parked to drop. */
+  __atomic_add_fetch(&context->parked, 1, __ATOMIC_RELEASE);
+  while (__atomic_load_n(&context->resumed, __ATOMIC_ACQUIRE) == resumed)
+    relax(&spins);
+}
+
+/* The other threads finish what they're matching and then wait for the locks
+ * of the securities they get next. */
+static void checkpoint_locked(MeContext *context, MeMessage *msg) {
+  uint64_t started = ticks();
+
+  for (int64_t i = 0; i < context->n_securities; i++)
+    omp_set_lock(&context->contexts[i].lock);
+  checkpoint(context, msg, started);
+  for (int64_t i = 0; i < context->n_securities; i++)
+    omp_unset_lock(&context->contexts[i].lock);
+}
+
+static inline void process(MeContext *context, MeMessage *msg) {
+  MeSecurityContext *ctx;
+
+  if (msg->msg_type == ME_MESSAGE_CHECKPOINT) {
+    if (context->sharded)
+      park(context);
     else
-      swipe_limit_sell(context, ctx, msg, context->allocate);
+      checkpoint_locked(context, msg);
+    return;
   }
-  omp_unset_lock(&ctx->lock);
-}
 
-static inline void remove_buy_order(MeBook *book, int64_t idx,
-                                    int64_t buf_size) {
-  while (idx < book->used) {
-    if (BUY_GREATER_THAN(book->orders[LEFT(idx)], book->orders[RIGHT(idx)])) {
-      book->orders[idx] = book->orders[LEFT(idx)];
-      idx = LEFT(idx);
-    } else {
-      book->orders[idx] = book->orders[RIGHT(idx)];
-      idx = RIGHT(idx);
-    }
+  if (stopping(context)) return;
+
+  if (msg->msg_type == ME_MESSAGE_MASS_CANCEL && msg->security_id == -1) {
+    mass_cancel_all(context, msg);
+    return;
   }
 
-  book->used--;
+  if (msg->security_id < 0 || msg->security_id >= context->n_securities)
+    return;
+  ctx = &context->contexts[msg->security_id];
+
+  switch (msg->msg_type) {
+    case ME_MESSAGE_SET_MARKET_PRICE:
+      set_market_price(context, ctx, msg);
+      break;
+    case ME_MESSAGE_NEW_ORDER:
+      new_order(context, ctx, msg);
+      break;
+    case ME_MESSAGE_CANCEL_ORDER:
+      cancel_order(context, ctx, msg);
+      break;
+    case ME_MESSAGE_AMEND_ORDER:
+      amend_order(context, ctx, msg);
+      break;
+    case ME_MESSAGE_MASS_CANCEL:
+      mass_cancel(context, ctx, msg, 1);
+      break;
+    case ME_MESSAGE_EXPIRE:
+      expire_orders(context, ctx, msg);
+      break;
+    case ME_MESSAGE_TRADE:
+    case ME_MESSAGE_ORDER_EXECUTED:
+    case ME_MESSAGE_PANIC:
+    case ME_MESSAGE_CHECKPOINT:
+    case ME_MESSAGE_DEPTH:
+      break;
+  }
+}
 
-  if (book->next != NULL && book->next->used > 0) {
-    // Garanteed to not allocate.
-    new_limit_buy(book, &book->next->orders[0], buf_size, NULL);
-    remove_first_buy(book->next, buf_size);
+static int journal_check(MeContext *context, size_t size) {
+  MeJournal *journal = &context->journal;
+  MeJournalHeader *header = journal->header;
+  int r;
+
+  if (size == 0) {
+    if ((r = journal_grow(journal, sizeof(MeJournalHeader)))) return r;
+    header->magic = ME_JOURNAL_MAGIC;
+    header->version = ME_JOURNAL_VERSION;
+    header->record_size = sizeof(MeJournalRecord);
+    header->n_securities = context->n_securities;
+    return 0;
   }
+
+  if (size < sizeof(MeJournalHeader) || header->magic != ME_JOURNAL_MAGIC ||
+      header->version != ME_JOURNAL_VERSION ||
+      header->record_size != sizeof(MeJournalRecord) ||
+      header->n_securities != context->n_securities)
+    return EINVAL;
+  return 0;
 }
 
-static inline void remove_sell_order(MeBook *book, int64_t idx,
-                                     int64_t buf_size) {
-  while (idx < book->used) {
-    if (SELL_GREATER_THAN(book->orders[LEFT(idx)], book->orders[RIGHT(idx)])) {
-      book->orders[idx] = book->orders[LEFT(idx)];
-      idx = LEFT(idx);
-    } else {
-      book->orders[idx] = book->orders[RIGHT(idx)];
-      idx = RIGHT(idx);
-    }
+int me_journal_open(MeContext *context, const char *path, int64_t sync_every) {
+  MeJournal *journal = &context->journal;
+  struct stat st;
+  MeMessage msg;
+  int r;
+
+  if ((journal->fd = open(path, O_RDWR | O_CREAT, 0644)) == -1) return errno;
+  if (fstat(journal->fd, &st) == -1) {
+    r = errno;
+    close(journal->fd);
+    return r;
+  }
+  journal->header =
+      mmap(NULL, ME_JOURNAL_RESERVE, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_NORESERVE, journal->fd, 0);
+  if (journal->header == MAP_FAILED) {
+    r = errno;
+    close(journal->fd);
+    return r;
+  }
+  journal->records = (MeJournalRecord *)(journal->header + 1);
+  journal->size = st.st_size;
+  journal->next = context->journaled;
+  journal->sync_every = sync_every;
+  journal->error = 0;
+  omp_init_lock(&journal->lock);
+
+  if ((r = journal_check(context, st.st_size))) {
+    journal_close(journal);
+    return r;
   }
 
-  book->used--;
+  /* Replays up to the first record that doesn't check. The threads write
+   * theirs at once, so the engine dying can tear any of the last ones, and
+   * those past the first torn one are dropped, zeroed so they aren't taken
+   * for the records written over them. A torn one already synced is
+   * corruption instead. The file is zeroed past the last record, and zeroes
+   * never check. Records before the snapshot the context was loaded from are
+   * already in it. */
+  uint64_t n = (journal->size - sizeof(MeJournalHeader)) /
+               sizeof(MeJournalRecord);
+  uint64_t i = context->journaled;
+  int dropped = 0;
+  context->replaying = 1;
+  for (; i < n; i++) {
+    MeJournalRecord *record = &journal->records[i];
+    if (!journal_valid(record, i)) break;
+    msg = record->msg;
+    process(context, &msg);
+    flush(context);
+    journal->next = i + 1;
+  }
+  context->replaying = 0;
 
-  if (book->next != NULL && book->next->used > 0) {
-    // Garanteed to not allocate.
-    new_limit_sell(book, &book->next->orders[0], buf_size, NULL);
-    remove_first_sell(book->next, buf_size);
+  if (i < journal->header->synced) {
+    journal_close(journal);
+    return EBADMSG;
+  }
+  for (i++; i < n; i++) {
+    MeJournalRecord *record = &journal->records[i];
+    if (!journal_valid(record, i)) continue;
+    memset(record, 0, sizeof(MeJournalRecord));
+    dropped = 1;
   }
+  if (dropped) msync(journal->header, journal->size, MS_SYNC);
+  context->journaling = 1;
+
+  return 0;
 }
 
-static inline void cancel_order(MeContext *context, MeSecurityContext *ctx,
-                                MeMessage *msg) {
-  MeOrderID id = msg->message.to_cancel;
+/* Histograms of the calling thread, NULL if there are too many threads. */
+static MeThreadStats *thread_stats;
+#pragma omp threadprivate(thread_stats)
 
-  omp_set_lock(&ctx->lock);
+static inline void attach_stats(MeContext *context) {
+  int id = omp_get_thread_num();
+  thread_stats = id < ME_STATS_THREADS ? &context->stats->threads[id] : NULL;
+}
 
-  for (MeBook *book = ctx->buy; book != NULL; book = book->next) {
-    for (int64_t i = 0; i < book->used; i++) {
-      if (book->orders[i].order_id == id) {
-        remove_buy_order(book, i, context->buf_size);
-        goto unset;
-      }
-    }
+/* Processes a message that was just dequeued and publishes its events. */
+static inline void handle(MeContext *context, MeMessage *msg) {
+  uint64_t dequeued = ticks();
+  int class = me_stats_class(msg->msg_type, msg->message.order.ord_type);
+
+  process(context, msg);
+  uint64_t matched = ticks();
+  flush(context);
+  uint64_t published = ticks();
+
+  /* Off the locks, and after publishing. */
+  journal_flush(context);
+
+  if (thread_stats == NULL) return;
+
+  uint64_t reset = __atomic_load_n(&context->stats->reset, __ATOMIC_RELAXED);
+  if (reset != thread_stats->reset) {
+    memset(thread_stats->histograms, 0, sizeof(thread_stats->histograms));
+    thread_stats->reset = reset;
+  }
+  stats_record(&thread_stats->histograms[class][ME_STATS_MATCH],
+               matched - dequeued);
+  stats_record(&thread_stats->histograms[class][ME_STATS_PUBLISH],
+               published - matched);
+}
+
+void *me_run(MeContext *context, void *paralell_job(void *), void *job_arg) {
+  void *r = NULL;
+  MeMessage msg;
+  int threads = context->threads > 0 ? context->threads : omp_get_max_threads();
+  int stopped = 0;
+
+  if (paralell_job != NULL) {
+#pragma omp task
+    { r = paralell_job(job_arg); }
   }
-  for (MeBook *book = ctx->sell; book != NULL; book = book->next) {
-    for (int64_t i = 0; i < book->used; i++) {
-      if (book->orders[i].order_id == id) {
-        remove_sell_order(book, i, context->buf_size);
-        goto unset;
+
+#pragma omp parallel private(msg) num_threads(threads)
+  {
+    attach_stats(context);
+    /* Each expires the securities it gave timers to, locking them. */
+    expiring = 1;
+    list_timed(context, omp_get_thread_num(), omp_get_num_threads());
+#pragma omp barrier
+    for (;;) {
+      expire(context);
+      if (receive(context, &msg, expiring ? expiry_next : 0)) {
+        handle(context, &msg);
+        if (msg.msg_type == ME_MESSAGE_PANIC) break;
       }
+      if (stopping(context)) break;
+    }
+    expiring = 0;
+    /* Only left if the journal failed, so they aren't matched then either. */
+    inbound_next = inbound.used = 0;
+
+    /* Send a panic to the next thread, leaving none behind for the next
+     * run once they all stopped. */
+    if (__atomic_add_fetch(&stopped, 1, __ATOMIC_RELAXED) <
+        omp_get_num_threads()) {
+      if (stopping(context))
+        wake(context);
+      else
+        me_stop(context);
     }
   }
+  checkpoint_wait(context);
 
-unset:
-  sendmsg(context, msg);
-  omp_unset_lock(&ctx->lock);
+  /* Inform those listening on outcoming that we're bailing out. */
+  msg.msg_type = ME_MESSAGE_PANIC;
+  sendmsg(context, &msg);
+  flush(context);
+  return r;
 }
 
-void *me_run(MeContext *context, void *paralell_job(void *), void *job_arg) {
+static void pin_thread(int cpu) {
+  cpu_set_t set;
+  long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+  if (n_cpus < 1) return;
+  CPU_ZERO(&set);
+  CPU_SET(cpu % n_cpus, &set);
+  /* Not being able to pin only costs performance. */
+  sched_setaffinity(0, sizeof(cpu_set_t), &set);
+}
+
+/* Moves the books of the securities a worker owns to its NUMA node, instead of
+ * the node of the thread that allocated the context. Pages shared with other
+ * securities are left where they are. As with pinning, failing is harmless. */
+static void place_books(MeContext *context, int worker, int workers) {
+  size_t page = context->memory & ME_MEMORY_HUGE_PAGES
+                    ? ME_HUGE_PAGE
+                    : (size_t)sysconf(_SC_PAGESIZE);
+  unsigned int cpu, node;
+  unsigned long nodes;
+
+  if (getcpu(&cpu, &node) != 0 || node >= 8 * sizeof(nodes)) return;
+  nodes = 1ul << node;
+
+  for (int64_t i = worker; i < context->n_securities; i += workers) {
+    size_t start = (size_t)context->contexts[i].book;
+    size_t end = i + 1 < context->n_securities
+                     ? (size_t)context->contexts[i + 1].book
+                     : (size_t)context + context->size;
+
+    start = (start + page - 1) & ~(page - 1);
+    end &= ~(page - 1);
+    if (end > start)
+      syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, &nodes,
+              8 * sizeof(nodes), MPOL_MF_MOVE);
+  }
+}
+
+void *me_run_sharded(MeContext *context, int n_workers,
+                     void *paralell_job(void *), void *job_arg) {
   void *r = NULL;
   MeMessage msg;
-  unsigned int p;
-  MeSecurityContext *ctx;
+
+  if (context->n_shards < n_workers) {
+    MeShards *shards =
+        context->allocate(sizeof(MeShards) + n_workers * sizeof(MeRing));
+    if (shards == NULL) {
+      int e = errno;
+      msg.msg_type = ME_MESSAGE_PANIC;
+      sendmsg(context, &msg);
+      flush(context);
+      errno = e;
+      return NULL;
+    }
+    shards->retired = context->shards;
+    context->shards = shards;
+    context->n_shards = n_workers;
+  }
 
   if (paralell_job != NULL) {
 #pragma omp task
     { r = paralell_job(job_arg); }
   }
 
-#pragma omp parallel private(msg, p, ctx)
+  for (int i = 0; i < n_workers; i++) ring_init(&context->shards->rings[i]);
+  context->sharded = 1;
+  context->swept = 0;
+  context->swept_by = 0;
+  context->sweeps = 0;
+
+  /* Thread 0 dispatches, the others match. */
+#pragma omp parallel num_threads(n_workers + 1) private(msg)
   {
-    do {
-      mq_receive(context->incoming, (char *)&msg, sizeof(MeMessage), &p);
-      if (msg.security_id < context->n_securities) {
-        ctx = &context->contexts[msg.security_id];
-        switch (msg.msg_type) {
-          case ME_MESSAGE_SET_MARKET_PRICE:
-            set_market_price(context, ctx, &msg);
-            break;
-          case ME_MESSAGE_NEW_ORDER:
-            new_order(context, ctx, &msg);
-            break;
-          case ME_MESSAGE_CANCEL_ORDER:
-            cancel_order(context, ctx, &msg);
-            break;
-          case ME_MESSAGE_TRADE:
-          case ME_MESSAGE_ORDER_EXECUTED:
-          case ME_MESSAGE_PANIC:
-            break;
+    int id = omp_get_thread_num();
+    /* OpenMP may give us fewer threads than asked for. */
+    int workers = omp_get_num_threads() - 1;
+
+    pin_thread(id);
+    attach_stats(context);
+    if (id > 0 && (context->memory & ME_MEMORY_NUMA))
+      place_books(context, id - 1, workers);
+    if (workers == 0)
+      list_timed(context, 0, 1);
+    else if (id > 0)
+      list_timed(context, id - 1, workers);
+    else
+      timed = -1;
+#pragma omp barrier
+
+    if (workers == 0) {
+      /* Nothing to shard, so match as me_run does. */
+      context->sharded = 0;
+      expiring = 1;
+      for (;;) {
+        expire(context);
+        if (receive(context, &msg, expiry_next)) {
+          handle(context, &msg);
+          if (msg.msg_type == ME_MESSAGE_PANIC) break;
         }
+        if (stopping(context)) break;
       }
-    } while (msg.msg_type != ME_MESSAGE_PANIC);
-
-    /* Send a panic to the next thread. */
-    mq_send(context->incoming, (char *)(&msg), sizeof(MeMessage), 1);
+      expiring = 0;
+    } else if (id == 0) {
+      do {
+        receive(context, &msg, 0);
+        /* A worker couldn't journal, so they all stop instead. */
+        if (stopping(context)) msg.msg_type = ME_MESSAGE_PANIC;
+        if (msg.msg_type == ME_MESSAGE_PANIC ||
+            (msg.msg_type == ME_MESSAGE_MASS_CANCEL &&
+             msg.security_id == -1)) {
+          for (int i = 0; i < workers; i++)
+            ring_push(&context->shards->rings[i], &msg);
+        } else if (msg.msg_type == ME_MESSAGE_CHECKPOINT) {
+          /* Every worker parks once it gets here in its ring. */
+          uint64_t started = ticks();
+          uint64_t spins = 0;
+          for (int i = 0; i < workers; i++)
+            ring_push(&context->shards->rings[i], &msg);
+          while (__atomic_load_n(&context->parked, __ATOMIC_ACQUIRE) !=
+                 workers)
+            relax(&spins);
+          checkpoint(context, &msg, started);
+          __atomic_store_n(&context->parked, 0, __ATOMIC_RELAXED);
+          __atomic_add_fetch(&context->resumed, 1, __ATOMIC_RELEASE);
+          flush(context);
+        } else if (msg.security_id >= 0 &&
+                   msg.security_id < context->n_securities) {
+          ring_push(&context->shards->rings[msg.security_id % workers], &msg);
+        }
+      } while (msg.msg_type != ME_MESSAGE_PANIC);
+    } else {
+      MeRing *ring = &context->shards->rings[id - 1];
+      shard = id - 1;
+      shards = workers;
+      sweep = 0;
+      expiring = 1;
+      for (;;) {
+        expire(context);
+        if (receive_from(context, ring, &msg, expiry_next)) {
+          handle(context, &msg);
+          if (msg.msg_type == ME_MESSAGE_PANIC) break;
+        }
+      }
+      /* The thread may match everything in the next run. */
+      shard = 0;
+      shards = 1;
+      expiring = 0;
+    }
+    /* As in me_run. */
+    inbound_next = inbound.used = 0;
   }
 
+  context->sharded = 0;
+  checkpoint_wait(context);
+
   /* Inform those listening on outcoming that we're bailing out. */
   msg.msg_type = ME_MESSAGE_PANIC;
   sendmsg(context, &msg);
+  flush(context);
   return r;
 }
 
+int me_stop(MeContext *context) {
+  MeMessage msg;
+
+  msg.msg_type = ME_MESSAGE_PANIC;
+  if (context->transport == ME_TRANSPORT_SHM) {
+    ring_push(&context->shm->incoming, &msg);
+    return 0;
+  }
+  return mq_send(context->incoming, (char *)&msg, sizeof(MeMessage), 1) == -1
+             ? errno
+             : 0;
+}
+
 int me_client_init_context(MeClientContext *context) {
+  context->transport = ME_TRANSPORT_SHM;
+  if (open_shm(&context->shm, 0) == 0) {
+    int r = broadcast_subscribe(&context->shm->outcoming, &context->subscriber);
+    if (r != 0) munmap(context->shm, sizeof(MeShm));
+    /* Of looking for dead subscribers. */
+    errno = 0;
+    return r;
+  }
+
+  /* Not finding the shared memory is not an error by itself. */
+  errno = 0;
+  context->transport = ME_TRANSPORT_MQUEUE;
+  context->frame.used = 0;
+  context->next = 0;
   if ((context->incoming = mq_open(me_in_queue_name, O_WRONLY)) == -1)
     return errno;
   if ((context->outcoming = mq_open(me_out_queue_name, O_RDONLY)) == -1)
@@ -570,19 +3270,87 @@ int me_client_init_context(MeClientContext *context) {
 }
 
 void me_client_close_context(MeClientContext *context) {
-  mq_close(context->incoming);
-  mq_close(context->outcoming);
+  if (context->transport == ME_TRANSPORT_SHM) {
+    __atomic_store_n(&context->subscriber->state, ME_SUBSCRIBER_FREE,
+                     __ATOMIC_RELEASE);
+    munmap(context->shm, sizeof(MeShm));
+  } else {
+    mq_close(context->incoming);
+    mq_close(context->outcoming);
+  }
 }
 
 int me_client_send_message(MeClientContext *context, MeMessage *message) {
+  if (context->transport == ME_TRANSPORT_SHM) {
+    ring_push(&context->shm->incoming, message);
+    return 0;
+  }
   mq_send(context->incoming, (char *)message, sizeof(MeMessage), 1);
   return errno;
 }
 
+int me_client_send_messages(MeClientContext *context, MeMessage *messages,
+                            int64_t n) {
+  if (context->transport == ME_TRANSPORT_SHM) {
+    for (int64_t i = 0; i < n; i += ME_FRAME_MESSAGES)
+      ring_push_n(&context->shm->incoming, &messages[i],
+                  n - i < ME_FRAME_MESSAGES ? n - i : ME_FRAME_MESSAGES);
+    return 0;
+  }
+  for (int64_t i = 0; i < n; i++)
+    if (mq_send(context->incoming, (char *)&messages[i], sizeof(MeMessage),
+                1) == -1)
+      return errno;
+  return 0;
+}
+
 int me_client_get_message(MeClientContext *context, MeMessage *message) {
+  return me_client_get_messages(context, message, 1) == 1 ? 0 : errno;
+}
+
+int64_t me_client_get_messages(MeClientContext *context, MeMessage *messages,
+                               int64_t max) {
   unsigned int _p;
-  mq_receive(context->outcoming, (char *)message, sizeof(MeMessage), &_p);
-  return errno;
+  int64_t n = 0;
+
+  if (max <= 0) return 0;
+
+  if (context->transport == ME_TRANSPORT_SHM) {
+    MeBroadcast *broadcast = &context->shm->outcoming;
+    uint64_t spins = 0;
+    int r;
+
+    while ((r = broadcast_try_read(broadcast, context->subscriber,
+                                   &messages[n])) == 0)
+      relax(&spins);
+    if (r < 0) {
+      errno = EPIPE;
+      return -1;
+    }
+    n++;
+    while (n < max &&
+           broadcast_try_read(broadcast, context->subscriber, &messages[n]) > 0)
+      n++;
+    return n;
+  }
+
+  if (context->next == context->frame.used) {
+    if (mq_receive(context->outcoming, (char *)&context->frame,
+                   sizeof(MeFrame), &_p) == -1)
+      return -1;
+    context->next = 0;
+  }
+  /* Then whole frames while they're already queued. */
+  for (;;) {
+    while (n < max && context->next < context->frame.used)
+      messages[n++] = context->frame.messages[context->next++];
+    if (n == max || mq_timedreceive(context->outcoming, (char *)&context->frame,
+                                    sizeof(MeFrame), &_p, &no_wait) == -1)
+      break;
+    context->next = 0;
+  }
+
+  return n;
 }
 
 #ifdef ME_BINARY
@@ -606,28 +3374,144 @@ static const char *help =
     "	enough cache, this option should be set to a big value to compensate "
     "the\n"
     "	lack of cache with huge memory buffers. Defaults to 1610612736.\n"
+    "-p --pool-size\n"
+    "	Memory allocated at startup for the securities that outgrow their\n"
+    "	share of the cache size. The engine only allocates more while\n"
+    "	matching if it runs out. Defaults to 268435456.\n"
+    "-m --memory\n"
+    "	Comma separated list of how to map the memory of the two options\n"
+    "	above, instead of allocating it with malloc. huge: on huge pages\n"
+    "	(reserved, or transparent ones if there are none). prefault: touch\n"
+    "	all of it at startup. lock: mlock it. numa: in sharded mode, move\n"
+    "	the books of each security to the node of its worker. Unset by\n"
+    "	default.\n"
     "-s --securities\n"
     "	Amount of securities to match. Can be very big. IDs are 0-<this "
     "size-1>.\n"
-    "	Defaults to 400.\n";
+    "	Defaults to 400.\n"
+    "-t --transport\n"
+    "	Either shm (lock-free rings in shared memory) or mq (POSIX message\n"
+    "	queues). Clients detect it automatically. Defaults to shm.\n"
+    "-C --conflate\n"
+    "	Also publish the latest state of each security (market price and\n"
+    "	top of the book) in shared memory, for consumers too slow to read\n"
+    "	every event (see me-ascii-logger -c).\n"
+    "-d --depth\n"
+    "	Publish DEPTH messages with the changes to this many levels from the\n"
+    "	top of each side of every security. Defaults to 0, publishing none.\n"
+    "-w --workers\n"
+    "	Sharded mode: each security is owned by one of this many workers,\n"
+    "	pinned to their own cores, which match without taking locks. A\n"
+    "	dispatcher thread routes the messages to them. Defaults to 0, in\n"
+    "	which all OpenMP threads share every security.\n"
+    "-T --threads\n"
+    "	OpenMP threads sharing every security when not sharded. Defaults to\n"
+    "	0, leaving it to OpenMP (OMP_NUM_THREADS or one per core).\n"
+    "-j --journal\n"
+    "	Path of a journal that every inbound message is written to before\n"
+    "	being matched. If it already exists, it's replayed first, rebuilding\n"
+    "	the books as they were when the engine stopped. The same security\n"
+    "	amount must be used. Disabled by default.\n"
+    "-J --journal-sync\n"
+    "	Sync the journal to disk every this many messages. Defaults to 0,\n"
+    "	which leaves it to the kernel (surviving engine but not system\n"
+    "	crashes).\n"
+    "-S --snapshot\n"
+    "	Path of a snapshot of the books. If it exists, the engine starts from\n"
+    "	it instead of empty books (ignoring the cache, pool, memory and\n"
+    "	securities options), and replays only the journal records written\n"
+    "	after it. It's written again when the engine stops, and by forked\n"
+    "	processes on CHECKPOINT messages while it runs. Disabled by default.\n";
+
+static int parse_memory(const char *flags) {
+  int memory = 0;
+
+  if (strstr(flags, "huge") != NULL) memory |= ME_MEMORY_HUGE_PAGES;
+  if (strstr(flags, "prefault") != NULL) memory |= ME_MEMORY_PREFAULT;
+  if (strstr(flags, "lock") != NULL) memory |= ME_MEMORY_LOCK;
+  if (strstr(flags, "numa") != NULL) memory |= ME_MEMORY_NUMA;
+  return memory;
+}
 
 int main(int argc, char *argv[]) {
   size_t l2_s = 1024 * 1024 * 1024 + 512 * 1024 * 1024;
+  size_t pool_s = 256 * 1024 * 1024;
   int64_t n_securities = 400;
+  MeTransport transport = ME_TRANSPORT_SHM;
+  int workers = 0;
+  int threads = 0;
+  int64_t depth = 0;
+  int conflated = 0;
+  char *journal = NULL;
+  int64_t journal_sync = 0;
+  char *snapshot = NULL;
+  int memory = 0;
+  struct timespec start, end;
+  MeContext *context;
 
   for (int i = 1; i < argc; i++) {
     if (sscanf(argv[i], "-c=%zu", &l2_s) == 1 ||
         sscanf(argv[i], "--cache-size=%zu", &l2_s) == 1 ||
+        sscanf(argv[i], "-p=%zu", &pool_s) == 1 ||
+        sscanf(argv[i], "--pool-size=%zu", &pool_s) == 1 ||
         sscanf(argv[i], "-s=%zd", &n_securities) == 1 ||
-        sscanf(argv[i], "--securities=%zd", &n_securities) == 1) {
+        sscanf(argv[i], "--securities=%zd", &n_securities) == 1 ||
+        sscanf(argv[i], "-w=%d", &workers) == 1 ||
+        sscanf(argv[i], "--workers=%d", &workers) == 1 ||
+        sscanf(argv[i], "-T=%d", &threads) == 1 ||
+        sscanf(argv[i], "--threads=%d", &threads) == 1 ||
+        sscanf(argv[i], "-d=%ld", &depth) == 1 ||
+        sscanf(argv[i], "--depth=%ld", &depth) == 1 ||
+        sscanf(argv[i], "-J=%ld", &journal_sync) == 1 ||
+        sscanf(argv[i], "--journal-sync=%ld", &journal_sync) == 1) {
       continue;
+    } else if (strncmp(argv[i], "-j=", 3) == 0) {
+      journal = argv[i] + 3;
+    } else if (strncmp(argv[i], "--journal=", 10) == 0) {
+      journal = argv[i] + 10;
+    } else if (strcmp(argv[i], "-C") == 0 ||
+               strcmp(argv[i], "--conflate") == 0) {
+      conflated = 1;
+    } else if (strncmp(argv[i], "-m=", 3) == 0) {
+      memory = parse_memory(argv[i] + 3);
+    } else if (strncmp(argv[i], "--memory=", 9) == 0) {
+      memory = parse_memory(argv[i] + 9);
+    } else if (strncmp(argv[i], "-S=", 3) == 0) {
+      snapshot = argv[i] + 3;
+    } else if (strncmp(argv[i], "--snapshot=", 11) == 0) {
+      snapshot = argv[i] + 11;
+    } else if (strcmp(argv[i], "-t=mq") == 0 ||
+               strcmp(argv[i], "--transport=mq") == 0) {
+      transport = ME_TRANSPORT_MQUEUE;
+    } else if (strcmp(argv[i], "-t=shm") == 0 ||
+               strcmp(argv[i], "--transport=shm") == 0) {
+      transport = ME_TRANSPORT_SHM;
     } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
       printf(help, argv[0]);
       return 0;
     }
   }
 
-  MeContext *context = me_alloc_context(l2_s, n_securities, malloc);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (snapshot != NULL && access(snapshot, F_OK) == 0) {
+    if ((context = me_snapshot_load(snapshot, transport, malloc)) == NULL) {
+      fprintf(stderr, "Loading snapshot %s failed: %s\n", snapshot,
+              strerror(errno));
+      return errno;
+    }
+    l2_s = context->size;
+    n_securities = context->n_securities;
+    printf("Loaded snapshot %s.\n", snapshot);
+  } else if (memory != 0) {
+    if ((context = me_map_context(l2_s, pool_s, n_securities, transport,
+                                  memory, malloc)) == NULL &&
+        errno != EDOM) {
+      fprintf(stderr, "Mapping the memory failed: %s\n", strerror(errno));
+      return errno;
+    }
+  } else {
+    context = me_alloc_context(l2_s, pool_s, n_securities, transport, malloc);
+  }
   if (errno != 0) {
     if (errno == 33) {
       fprintf(stderr,
@@ -638,9 +3522,43 @@ int main(int argc, char *argv[]) {
 
     return errno;
   }
-  printf("Booting engine with %zu of cache size and %zu securities.\n", l2_s,
-         n_securities);
-  me_run(context, NULL, NULL);
+  if (journal != NULL && (errno = me_journal_open(context, journal,
+                                                  journal_sync)) != 0) {
+    fprintf(stderr, "Opening journal %s failed: %s\n", journal,
+            strerror(errno));
+    return errno;
+  }
+  context->checkpoint = snapshot;
+  context->depth = depth;
+  context->threads = threads;
+  if (conflated && (errno = me_conflate(context)) != 0) {
+    fprintf(stderr, "Publishing the conflated state failed: %s\n",
+            strerror(errno));
+    return errno;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("Booting engine with %zu of cache size and %zu securities over %s.\n",
+         l2_s, n_securities,
+         transport == ME_TRANSPORT_SHM ? "shared memory" : "POSIX queues");
+  printf("Started in %.3f s.\n",
+         (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  if (journal != NULL)
+    printf("Journaling to %s from message %lu.\n", journal,
+           context->journal.next);
+  if (workers > 0) {
+    me_run_sharded(context, workers, NULL, NULL);
+    if (context->n_shards < workers)
+      fprintf(stderr, "Allocating the rings of the workers failed: %s\n",
+              strerror(errno));
+  } else {
+    me_run(context, NULL, NULL);
+  }
+  if (journal != NULL && context->journal.error != 0)
+    fprintf(stderr, "Journaling failed, so the engine stopped: %s\n",
+            strerror(context->journal.error));
+  if (snapshot != NULL && (errno = me_snapshot_write(context, snapshot)) != 0)
+    fprintf(stderr, "Writing snapshot %s failed: %s\n", snapshot,
+            strerror(errno));
   me_dealloc_context(context, free);
 
   printf("Engine bailing out.\n");
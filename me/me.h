@@ -4,18 +4,53 @@
 #include <mqueue.h>
 #include <omp.h>
 #include <stdint.h>
+#include <sys/types.h>
 
-static const char *me_in_queue_name = "/fintexmeincoming";
-static const char *me_out_queue_name = "/fintexmeoutcoming";
+/* Not every program that includes this header opens the transport. */
+#define ME_UNUSED __attribute__((unused))
+
+static const char *me_in_queue_name ME_UNUSED = "/fintexmeincoming";
+static const char *me_out_queue_name ME_UNUSED = "/fintexmeoutcoming";
+static const char *me_shm_name ME_UNUSED = "/fintexmeshm";
+static const char *me_conflated_name ME_UNUSED = "/fintexmeconflated";
+
+/* The shared memory rings are the default transport. The POSIX queues are kept
+ * as a fallback for systems where /dev/shm is not usable. */
+typedef enum {
+  ME_TRANSPORT_SHM,
+  ME_TRANSPORT_MQUEUE,
+} MeTransport;
 
 typedef enum {
   ME_SIDE_BUY,
   ME_SIDE_SELL,
 } MeSide;
 
+/* Market orders rest what isn't executed as limit orders at the market price.
+ * IOC (immediate or cancel) and FOK (fill or kill) orders never rest, and
+ * cross up to their price like limit orders, or at any price if it's 0. What
+ * an IOC can't execute is cancelled, and a FOK is cancelled without trading
+ * unless it can be executed entirely. Either way, the engine propagates a
+ * CANCEL_ORDER with their ID after the NEW_ORDER and any trades.
+ *
+ * STOP and STOP_LIMIT orders wait outside the book until the market price
+ * reaches their stop price (see MeStopOrder), at or above it for buys and at
+ * or below it for sells. Then they're entered as market or limit orders, and
+ * the engine propagates a NEW_ORDER of that type.
+ *
+ * ICEBERG orders are limit orders that only show part of their quantity (see
+ * MeIcebergOrder). Once it's executed, the engine shows the next part behind
+ * the orders at the price, as if entered with the timestamp of the aggressor,
+ * until none is left. The order is executed as a whole, and only the shown
+ * part counts for the depth and for FOK orders. */
 typedef enum {
   ME_ORDER_MARKET,
   ME_ORDER_LIMIT,
+  ME_ORDER_IOC,
+  ME_ORDER_FOK,
+  ME_ORDER_STOP,
+  ME_ORDER_STOP_LIMIT,
+  ME_ORDER_ICEBERG,
 } MeOrderType;
 
 typedef enum {
@@ -25,6 +60,11 @@ typedef enum {
   ME_MESSAGE_TRADE,
   ME_MESSAGE_ORDER_EXECUTED,
   ME_MESSAGE_PANIC,
+  ME_MESSAGE_CHECKPOINT,
+  ME_MESSAGE_DEPTH,
+  ME_MESSAGE_AMEND_ORDER,
+  ME_MESSAGE_MASS_CANCEL,
+  ME_MESSAGE_EXPIRE,
 } MeMessageType;
 
 /* We would usually say it has nanossecond precision but the client may actually
@@ -36,10 +76,19 @@ typedef uint64_t MeTimestamp;
  * should set it and guarantee they're unique. */
 typedef uint64_t MeOrderID;
 
+/* Tags the orders of a participant, so they can be cancelled together (see
+ * ME_MESSAGE_MASS_CANCEL). Set by the clients, and 0 if they don't care. */
+typedef uint32_t MeOwner;
+
 typedef struct {
   MeSide side;
+  /* Unix time, in seconds, from which a resting order is cancelled, or 0 for
+   * never. Where the padding would be. */
+  uint32_t expires;
   int64_t quantity;
   MeOrderType ord_type;
+  /* Where the padding would be. */
+  MeOwner owner;
   int64_t price;
   MeOrderID order_id;
   MeTimestamp timestamp;
@@ -50,6 +99,57 @@ typedef struct {
   MeOrderID matched_id;
 } MeTrade;
 
+/* The order of a NEW_ORDER of type STOP or STOP_LIMIT, whose price is the
+ * limit of the latter. */
+typedef struct {
+  MeOrder order;
+  int64_t stop_price;
+} MeStopOrder;
+
+/* The order of a NEW_ORDER of type ICEBERG, showing up to display of its
+ * quantity at a time. */
+typedef struct {
+  MeOrder order;
+  int64_t display;
+} MeIcebergOrder;
+
+/* Levels are numbered from the top of their side, 1 being the best price. An
+ * ADD shifts the levels from there down, and the one pushed past the
+ * published depth is dropped. A DELETE shifts them up, and is followed by an
+ * ADD of the level taking the last position, if there's one. */
+typedef enum {
+  ME_DEPTH_ADD,
+  ME_DEPTH_CHANGE,
+  ME_DEPTH_DELETE,
+} MeDepthAction;
+
+typedef struct {
+  MeDepthAction action;
+  MeSide side;
+  int64_t level;
+  int64_t price;
+  /* Resting at the price, 0 on DELETE. */
+  int64_t quantity;
+} MeDepth;
+
+/* What a MASS_CANCEL cancels. Without either side, both are. */
+typedef enum {
+  ME_MASS_CANCEL_BUY = 1,
+  ME_MASS_CANCEL_SELL = 2,
+  /* Only the orders of the owner. */
+  ME_MASS_CANCEL_OWNER = 4,
+  /* Also propagate a CANCEL_ORDER for every order cancelled. */
+  ME_MASS_CANCEL_ORDERS = 8,
+} MeMassCancelFlags;
+
+typedef struct {
+  /* MeMassCancelFlags. */
+  uint32_t flags;
+  MeOwner owner;
+  /* Set by the engine. */
+  uint64_t cancelled;
+} MeMassCancel;
+
 /* NEW, CANCEL and SET_MARKET_PRICE are received by the matching engine and
  * propagated. SET_MARKET_PRICE is also used by the engine to inform a change in
  * the market price. TRADE is only used by the engine to inform a trade event
@@ -65,7 +165,45 @@ typedef struct {
  * I.e., if an order to sell 200 is the aggressor in a trade with an order to
  * buy 300, the aggressor field will have the quantity set to 200, and the order
  * identified by the matched_id should have it's own quantity updated to 100
- * (300 - 200). */
+ * (300 - 200).
+ *
+ * CHECKPOINT asks the engine to write a snapshot of the books while it keeps
+ * matching (see me_snapshot_write). It ignores the security ID and is
+ * propagated once the image is taken, with the amount of inbound messages it
+ * reflects in the checkpoint field.
+ *
+ * DEPTH is only used by the engine to inform changes to the aggregated
+ * quantity of the top levels of a security (see MeContext.depth), after the
+ * events causing them.
+ *
+ * AMEND_ORDER changes the quantity and price of the resting order with the
+ * order_id in the order field, or only its quantity if the price is 0. The
+ * side, type and expiry are those of the order. A smaller quantity at the
+ * same price keeps its time priority. Otherwise the order loses it, taking the
+ * timestamp of the amend, and may trade as if it were new. It's propagated
+ * once, before any trade it causes, with the order as amended, or with
+ * quantity 0 if it wasn't resting. An amend to quantity 0 or less cancels the
+ * order. The quantity of an iceberg is all of it, and decreasing it takes from
+ * the part not shown first.
+ *
+ * MASS_CANCEL cancels the resting orders of a security selected by its flags,
+ * or of every security if the security ID is -1, going once through the
+ * levels. It's propagated with how many orders were cancelled, after their
+ * CANCEL_ORDERs if asked for. When sweeping every security, that's once
+ * they're all done, also by the workers of me_run_sharded. Each published
+ * level it changes gets a CHANGE, or a DELETE as if its orders were cancelled
+ * one at a time, before that.
+ *
+ * Orders are expired within a second of their time by the engine, which
+ * propagates a CANCEL_ORDER for each. EXPIRE is how it journals doing so, and
+ * expires the orders of a security due by the Unix time in its expire field.
+ * It's not propagated.
+ *
+ * Stop orders are triggered after the message that moved the market price
+ * there, one at a time from the nearest stop price, buys first, and the
+ * earliest of those at the same price. Each may move the price and trigger
+ * more. They can be cancelled (also by MASS_CANCEL) but not amended while
+ * waiting, and expire while waiting as well as once in the book. */
 typedef struct {
   MeMessageType msg_type;
   int64_t security_id;
@@ -73,36 +211,502 @@ typedef struct {
     MeOrder order;
     int64_t set_market_price;
     MeTrade trade;
+    MeStopOrder stop;
+    MeIcebergOrder iceberg;
     MeOrderID to_cancel;
+    uint64_t checkpoint;
+    MeDepth depth;
+    MeMassCancel mass_cancel;
+    uint64_t expire;
   } message;
 } MeMessage;
 
-#define ME_MINIMUM_MEMORY(n_secs) \
-  (sizeof(MeContext) + n_secs * (sizeof(MeSecurityContext) + sizeof(MeOrder)))
+/* Every event the engine produces while handling an inbound message is
+ * collected in a frame, which is published with a single write. With the
+ * POSIX queues each outbound queue message is a frame, and with the shared
+ * memory rings the whole frame is reserved at once. A message producing more
+ * than ME_FRAME_MESSAGES events is split in several frames. */
+#define ME_FRAME_MESSAGES 64
+
+typedef struct {
+  int64_t used;
+  MeMessage messages[ME_FRAME_MESSAGES];
+} MeFrame;
+
+/* Shared memory transport. Each ring is a bounded lock-free MPMC queue: every
+ * slot carries a sequence number telling whether it's ready to be written
+ * (seq == position) or read (seq == position + 1). Clients and engine threads
+ * only touch the shared memory, so no syscalls are issued unless a ring is
+ * empty (or full) for long enough to be worth yielding the CPU. */
+
+#define ME_CACHE_LINE 64
+/* Must be a power of two. */
+#define ME_RING_SLOTS (1 << 16)
+
+typedef struct {
+  uint64_t seq;
+  MeMessage msg;
+} MeRingSlot;
+
+typedef struct {
+  /* Producers and consumers spin on their own cache lines. */
+  uint64_t tail;
+  char _pad0[ME_CACHE_LINE - sizeof(uint64_t)];
+  uint64_t head;
+  char _pad1[ME_CACHE_LINE - sizeof(uint64_t)];
+  MeRingSlot slots[ME_RING_SLOTS];
+} MeRing;
+
+/* Engine events are broadcast: every subscriber reads all of them from the
+ * same slots through its own cursor, and none is consumed. A slot is written
+ * for position pos by first setting its seq to pos, then the message and then
+ * seq to pos + 1, so readers copy it while seq == cursor + 1 before and after
+ * copying, and know they were lapped if it's past that. The engine only
+ * reuses slots every active subscriber is done with. Subscribers keeping it
+ * waiting for more than ME_SUBSCRIBER_PATIENCE_MS, or whose process died, are
+ * evicted: the engine stops waiting for them and they fail with EPIPE. */
+
+#define ME_SUBSCRIBERS 64
+#define ME_SUBSCRIBER_PATIENCE_MS 50
+
+typedef enum {
+  ME_SUBSCRIBER_FREE,
+  ME_SUBSCRIBER_JOINING,
+  ME_SUBSCRIBER_ACTIVE,
+  ME_SUBSCRIBER_EVICTED,
+} MeSubscriberState;
+
+typedef struct {
+  /* Next position it reads, only written by the subscriber. */
+  uint64_t cursor;
+  uint64_t state;
+  pid_t pid;
+  char _pad[ME_CACHE_LINE - 2 * sizeof(uint64_t) - sizeof(pid_t)];
+} MeSubscriber;
+
+typedef struct {
+  uint64_t tail;
+  /* No active cursor was behind this when it was last checked, so producers
+   * can write up to gate + ME_RING_SLOTS without looking at them. */
+  uint64_t gate;
+  char _pad0[ME_CACHE_LINE - 2 * sizeof(uint64_t)];
+  MeSubscriber subscribers[ME_SUBSCRIBERS];
+  MeRingSlot slots[ME_RING_SLOTS];
+} MeBroadcast;
+
+typedef struct {
+  /* Clients to engine. */
+  MeRing incoming;
+  /* Engine to clients. */
+  MeBroadcast outcoming;
+} MeShm;
+
+/* Latency statistics. Every engine thread keeps HDR-style histograms (each
+ * power of two split in 2^ME_STATS_SUB_BITS buckets) of the time from
+ * dequeuing a message to having it matched, and from there to having its
+ * events published. Values are in ticks of the time stamp counter, and
+ * MeStats.ticks_per_ns converts them. They live in a shared memory page, so
+ * operators can read them while the engine runs (see me-stats), and are
+ * cleared by bumping MeStats.reset. Each thread clears its own histograms, so
+ * they're never written by more than one thread. */
+
+#define ME_STATS_THREADS 64
+#define ME_STATS_SUB_BITS 3
+#define ME_STATS_BUCKETS (64 << ME_STATS_SUB_BITS)
+/* New orders are split by order type, other messages by message type. */
+#define ME_STATS_MESSAGE_TYPES 16
+#define ME_STATS_ORDER_TYPES 8
+#define ME_STATS_CLASSES (ME_STATS_MESSAGE_TYPES + ME_STATS_ORDER_TYPES)
+
+typedef enum {
+  ME_STATS_MATCH,
+  ME_STATS_PUBLISH,
+  ME_STATS_PHASES,
+} MeStatsPhase;
+
+typedef struct {
+  uint64_t count;
+  uint64_t max;
+  uint64_t buckets[ME_STATS_BUCKETS];
+} MeHistogram;
+
+typedef struct {
+  /* Last MeStats.reset this thread acted on. */
+  uint64_t reset;
+  MeHistogram histograms[ME_STATS_CLASSES][ME_STATS_PHASES];
+} MeThreadStats;
+
+/* Usage of the overflow pool (see MePool), in bytes unless noted. */
+#define ME_POOL_CLASSES 64
+
+typedef struct {
+  /* Total of the arenas and how much of it was carved into blocks. */
+  uint64_t size;
+  uint64_t carved;
+  /* Arenas allocated while matching because the pool ran out, and times
+   * that failed, cancelling the order that needed the memory. */
+  uint64_t extensions;
+  uint64_t failures;
+  /* Blocks of each class (2^class bytes) handed out, now and at most. */
+  uint64_t in_use[ME_POOL_CLASSES];
+  uint64_t high_water[ME_POOL_CLASSES];
+} MePoolStats;
+
+/* Checkpoints (see ME_MESSAGE_CHECKPOINT). Durations are in ticks. */
+typedef struct {
+  /* Processes forked to write one, and those that wrote it or failed. */
+  uint64_t taken;
+  uint64_t written;
+  uint64_t failed;
+  /* Not taken because the last one was still being written. */
+  uint64_t skipped;
+  /* Matching stopped while the threads were quiesced and the engine forked. */
+  uint64_t pause;
+  uint64_t max_pause;
+  /* Of the last one written. */
+  uint64_t write;
+  uint64_t messages;
+} MeCheckpointStats;
+
+typedef struct {
+  double ticks_per_ns;
+  uint64_t reset;
+  MeThreadStats threads[ME_STATS_THREADS];
+  /* Not cleared by resets. */
+  MePoolStats pool;
+  MeCheckpointStats checkpoints;
+  /* Subscribers evicted for falling behind (see MeBroadcast). */
+  uint64_t evictions;
+} MeStats;
+
+/* Conflated market data. Instead of every event, slow consumers may read the
+ * latest state of each security from a shared memory page, which the engine
+ * overwrites after every message changing it and never waits for. Each slot
+ * is a seqlock: its seq is odd while being written, so readers copy it until
+ * they see the same even seq before and after (see me_conflated_read). */
+typedef struct {
+  uint64_t seq;
+  /* Times the engine wrote it. */
+  uint64_t updates;
+  int64_t market_price;
+  /* Best prices and the quantity resting at them, 0 if a side is empty. */
+  int64_t bid;
+  int64_t bid_quantity;
+  int64_t ask;
+  int64_t ask_quantity;
+  char _pad[ME_CACHE_LINE - 7 * sizeof(int64_t)];
+} MeConflated;
+
+typedef struct {
+  int64_t n_securities;
+  char _pad[ME_CACHE_LINE - sizeof(int64_t)];
+  MeConflated securities[];
+} MeConflatedPage;
+
+/* Enough for a single order (and level) per side of each security, plus the
+ * padding to align each of them to a cache line. */
+#define ME_MINIMUM_MEMORY(n_secs)                                         \
+  (sizeof(MeContext) + ME_CACHE_LINE +                                    \
+   n_secs * (sizeof(MeSecurityContext) + sizeof(MeBook) + ME_CACHE_LINE + \
+             2 * (sizeof(MeOrderNode) + sizeof(MeLevel) +                 \
+                  sizeof(int64_t) + 2 * sizeof(MeIndexEntry))))
 
 /* "Server" (engine) side. */
 
+/* Each side of a security is a ladder of price levels, and each level holds a
+ * FIFO of the orders resting at that price (sorted by timestamp). */
+
+/* Exactly a cache line, and books keep them aligned to one. */
+typedef struct MeOrderNode {
+  MeOrder order;
+  struct MeOrderNode *next;
+  struct MeOrderNode *prev;
+} MeOrderNode;
+
+typedef struct {
+  /* Sum of the quantities resting at this price. */
+  int64_t quantity;
+  MeOrderNode *head;
+  MeOrderNode *tail;
+} MeLevel;
+
+/* Sorted from the worst to the best price, so the top of the book is
+ * levels[used - 1]. The price of each level is kept apart, in prices[], so
+ * searching the ladder reads eight of them per cache line and nothing else. */
+typedef struct {
+  int64_t used;
+  int64_t size;
+  int64_t *prices;
+  MeLevel *levels;
+} MeLadder;
+
+/* Storage for the order nodes. The first book of each security is carved from
+ * the context. Overflow books come from the pool while it's full, and go back
+ * to it once all of their orders are gone. */
 typedef struct MeBook {
-  /* An int64_t for convenience. Signed indexes are such a great idea. */
+  /* Int64_t's for convenience. Signed indexes are such a great idea. Nodes
+   * handed out at least once, nodes in use and the capacity. */
   int64_t used;
+  int64_t live;
+  int64_t size;
+  /* Nodes given back by executed and cancelled orders. */
+  MeOrderNode *free;
+  /* Overflow books with room for more nodes. */
   struct MeBook *next;
-  /* Size is MeContext.buf_size. In indexes, not bytes. */
-  MeOrder orders[];
+  struct MeBook *prev;
+  char _pad[ME_CACHE_LINE - 3 * sizeof(int64_t) - 3 * sizeof(void *)];
+  MeOrderNode orders[];
 } MeBook;
 
+/* Open addressing (linear probing) hash from order IDs to the resting orders,
+ * so cancelling doesn't need to search the ladders. */
+typedef struct {
+  MeOrderID order_id;
+  /* NULL if the entry is empty. */
+  MeOrderNode *node;
+} MeIndexEntry;
+
+typedef struct {
+  int64_t used;
+  /* Always a power of two. */
+  int64_t size;
+  /* 64 - log2(size). */
+  int shift;
+  MeIndexEntry *entries;
+} MeIndex;
+
+/* What resting icebergs don't show, found by the ID of the order like the
+ * index, and by the node of the part shown among the entries with that ID.
+ * Carved from the pool once there's one. */
+typedef struct {
+  /* NULL if the entry is empty. */
+  MeOrderNode *node;
+  int64_t display;
+  int64_t hidden;
+} MeReserve;
+
+typedef struct {
+  int64_t used;
+  int64_t size;
+  int shift;
+  MeReserve *entries;
+} MeReserves;
+
+/* Stop orders waiting for the market price, sorted from the furthest to the
+ * nearest stop price, so the next to trigger is stops[used - 1]. Carved from
+ * the pool once there's one. */
+typedef struct {
+  int64_t used;
+  int64_t size;
+  MeStopOrder *stops;
+} MeTriggers;
+
+/* Waiting stops found by their ID like the index, with what's needed to find
+ * them among the triggers: the side and the stop price, which sorts them.
+ * Carved from the pool once there's one. */
+typedef struct {
+  MeOrderID order_id;
+  int64_t stop_price;
+  MeSide side;
+  /* Of the order, so it's cancelled while waiting too. */
+  uint32_t expires;
+  /* 0 if the entry is empty. */
+  int used;
+} MeStopEntry;
+
+typedef struct {
+  int64_t used;
+  int64_t size;
+  int shift;
+  MeStopEntry *entries;
+} MeStopIndex;
+
+/* Good-till-time orders are tracked by a hierarchical timing wheel per
+ * security, with ME_WHEEL_LEVELS of ME_WHEEL_SLOTS each, a slot of a level
+ * spanning the whole level below. The orders are put in the level their time
+ * left fits in, and move down as it passes, so expiring them costs as many
+ * steps as there are orders due. Timers stay when their orders leave the
+ * book, to be dropped once due or moving down. Each thread expiring orders
+ * keeps a list of the securities with timers it looks at, so the others
+ * cost nothing. */
+#define ME_WHEEL_BITS 6
+#define ME_WHEEL_SLOTS (1 << ME_WHEEL_BITS)
+#define ME_WHEEL_LEVELS 4
+
+typedef struct MeTimer {
+  struct MeTimer *next;
+  MeOrderID order_id;
+} MeTimer;
+
+typedef struct {
+  /* Unix time, in seconds, up to which the orders were expired. */
+  uint64_t now;
+  /* Timers in the slots, including those of orders gone. */
+  int64_t used;
+  /* Set while the security is in the list of a thread expiring orders,
+   * where the security with ID next follows it. */
+  int listed;
+  int64_t next;
+  MeTimer *free;
+  MeTimer *slots[ME_WHEEL_LEVELS][ME_WHEEL_SLOTS];
+} MeWheel;
+
 typedef struct {
-  MeBook *buy;
-  MeBook *sell;
+  MeLadder buy;
+  MeLadder sell;
+  MeIndex index;
+  MeBook *book;
+  MeBook *overflow;
+  MeWheel wheel;
+  MeTriggers buy_stops;
+  MeTriggers sell_stops;
+  MeStopIndex stops;
+  MeReserves reserves;
   int64_t market_price;
+  /* Inbound messages acted on, which stamp the snapshots. */
+  uint64_t applied;
   omp_lock_t lock;
 } MeSecurityContext;
 
+/* Books, ladders and indexes that outgrow the space carved for them in the
+ * context are taken from a pool allocated at startup, so matching doesn't call
+ * the allocator. Blocks are powers of two aligned to their size, and each size
+ * class has its own free list. If the pool runs out it's extended by another
+ * arena, which is counted in MePoolStats.extensions. Orders are only entered
+ * once what they need was taken from it, and cancelled if that fails. */
+typedef struct MeArena {
+  struct MeArena *next;
+  /* Bytes after the header. */
+  size_t size;
+  /* Part of a mapping (see MeContext.mapping), so it isn't deallocated. */
+  int mapped;
+} MeArena;
+
+typedef struct {
+  MeArena *arenas;
+  /* Part of the last arena that wasn't carved yet. */
+  size_t next;
+  size_t end;
+  size_t arena_s;
+  void *free[ME_POOL_CLASSES];
+  MePoolStats *stats;
+  omp_lock_t lock;
+} MePool;
+
+/* Write-ahead journal. Every inbound message the engine acts on is appended to
+ * a memory mapped file, with a sequence number and a checksum, before being
+ * matched. Records have a fixed size, and threads write theirs at once, so the
+ * last few can be torn if the engine dies. Starting with the same journal
+ * replays it up to the first torn one, rebuilding the books without
+ * publishing anything. */
+
+#define ME_JOURNAL_MAGIC 0x4c4e524a454d5846ull /* "FXMEJRNL" */
+#define ME_JOURNAL_VERSION 4
+/* The file is mapped this big up front (not backed until written), so it's
+ * never remapped while the threads write. The engine stops once it's full. */
+#define ME_JOURNAL_RESERVE ((size_t)1 << 40)
+/* How much the file grows at a time. */
+#define ME_JOURNAL_CHUNK ((size_t)64 * 1024 * 1024)
+
+typedef struct {
+  uint64_t magic;
+  uint64_t version;
+  uint64_t record_size;
+  int64_t n_securities;
+  /* Records known to be whole on disk, so any torn among them is corruption.
+   * Stored after each sync. */
+  uint64_t synced;
+} MeJournalHeader;
+
+typedef struct {
+  uint64_t seq;
+  /* Of the sequence number and the message, see me_journal_checksum. */
+  uint64_t checksum;
+  MeMessage msg;
+} MeJournalRecord;
+
+typedef struct {
+  int fd;
+  MeJournalHeader *header;
+  MeJournalRecord *records;
+  /* Bytes of the file, only grown under lock. */
+  size_t size;
+  /* Next sequence number to hand out, taken without locking. */
+  uint64_t next;
+  /* Records are synced (msync) every this many, 0 leaves it to the kernel.
+   * The thread completing a batch syncs it after publishing what it matched,
+   * up to the first record still being written. */
+  int64_t sync_every;
+  /* Of the first message that couldn't be recorded, 0 if none. */
+  int error;
+  /* Taken to grow the file. */
+  omp_lock_t lock;
+} MeJournal;
+
+/* Inbound rings of the workers of me_run_sharded, kept for the next runs. A
+ * run with more workers replaces them, and keeps them linked until
+ * me_dealloc_context, the only one given a deallocator. */
+typedef struct MeShards {
+  struct MeShards *retired;
+  char _pad[ME_CACHE_LINE - sizeof(void *)];
+  MeRing rings[];
+} MeShards;
+
 typedef struct {
   int64_t n_securities;
   int64_t buf_size;
+  /* Bytes carved at startup, from the context itself. */
+  size_t size;
+  /* Nodes of an overflow book, and its size in bytes (a power of two). */
+  int64_t book_size;
+  size_t book_block;
+  MePool pool;
+  /* Set once me_journal_open replayed the journal. */
+  int journaling;
+  MeJournal journal;
+  /* Set while replaying, so nothing is published. */
+  int replaying;
+  /* Journal records already reflected in the books, as they were restored
+   * from a snapshot taken after them. */
+  uint64_t journaled;
+  /* The snapshot this context was loaded from or, with me_map_context, the
+   * mapping holding it. */
+  void *mapping;
+  size_t mapping_s;
+  /* MeMemory flags it was mapped with. */
+  int memory;
+  /* Levels of each side whose changes are published as DEPTH messages, 0
+   * publishes none. */
+  int64_t depth;
+  /* Threads of me_run, 0 leaves it to OpenMP. */
+  int threads;
+  /* Set by me_conflate. */
+  MeConflatedPage *conflated;
+  /* Where CHECKPOINT messages write snapshots, NULL ignores them. */
+  const char *checkpoint;
+  /* Process writing the last one, 0 once it's reaped. */
+  pid_t checkpointer;
   MeSecurityContext *contexts;
+  MeTransport transport;
+  /* Only valid with ME_TRANSPORT_MQUEUE. */
   mqd_t incoming;
   mqd_t outcoming;
+  /* Only valid with ME_TRANSPORT_SHM. */
+  MeShm *shm;
+  MeStats *stats;
+  /* Set while running me_run_sharded. One inbound ring per worker. */
+  int sharded;
+  MeShards *shards;
+  int n_shards;
+  /* Workers stopped for a checkpoint, and how many times they were let go. */
+  int parked;
+  uint64_t resumed;
+  /* Of the workers sweeping every security for a MASS_CANCEL: how many
+   * orders they cancelled, how many are done, and how many sweeps were
+   * published (see me_run_sharded). */
+  uint64_t swept;
+  int swept_by;
+  uint64_t sweeps;
   void *(*allocate)(size_t);
 } MeContext;
 
@@ -110,7 +714,8 @@ typedef struct {
 /* Propagates the allocator errno if it returns NULL. If l2_s is less than the
  * minimum amount needed by the engine, returns NULL and sets errno to EDOM.
  * Also sets EDOM if n_securities == 0. Other errors may be propagated (mq_open,
- * etc). In this cases, the memory IS NOT FREE'D AND IT'S POINTER IS RETURNED.
+ * shm_open, mmap, etc). In this cases, the memory IS NOT FREE'D AND IT'S
+ * POINTER IS RETURNED.
  *
  * Of course, this mean the caller SHOULD ALWAYS check the errno value and
  * operate accordingly.
@@ -118,9 +723,14 @@ typedef struct {
  * This also means that if the actual L2 cache size is less than the minimum
  * required to operate the engine properly, the caller should make something up.
  *
+ * pool_s bytes are allocated up front for the books that don't fit in l2_s
+ * (see MePool). It may be 0, leaving the pool to be allocated on demand.
+ *
  * Example:
  * 
- * MeContext *context = me_alloc_context(1024*1024*1024 + 512*1024*1024, 400, malloc);
+ * MeContext *context = me_alloc_context(1024*1024*1024 + 512*1024*1024,
+ *                                       256*1024*1024, 400,
+ *                                       ME_TRANSPORT_SHM, malloc);
  * if (context == NULL) {
  *   printf("buy more ram\n");
  *   exit(1);
@@ -132,21 +742,156 @@ typedef struct {
  * }
  */
 /* clang-format on */
-MeContext *me_alloc_context(size_t l2_s, int64_t n_secs,
-                            void *allocate(size_t));
+MeContext *me_alloc_context(size_t l2_s, size_t pool_s, int64_t n_secs,
+                            MeTransport transport, void *allocate(size_t));
+
+/* How me_map_context maps the context, and the first arena of the pool with
+ * it. Huge pages save TLB misses when walking the books, and fall back to
+ * transparent ones if none were reserved. Prefaulting and locking (mlock)
+ * keep page faults out of matching. With ME_MEMORY_NUMA, each worker of
+ * me_run_sharded moves the books of its securities to its own node. */
+typedef enum {
+  ME_MEMORY_HUGE_PAGES = 1 << 0,
+  ME_MEMORY_PREFAULT = 1 << 1,
+  ME_MEMORY_LOCK = 1 << 2,
+  ME_MEMORY_NUMA = 1 << 3,
+} MeMemory;
+
+#define ME_HUGE_PAGE ((size_t)2 * 1024 * 1024)
+
+/* Like me_alloc_context, but the memory is mapped by the engine according to
+ * the MeMemory flags in memory. allocate is still used for what's allocated
+ * later. On errors nothing is left mapped, NULL is returned and errno set
+ * (locking usually fails because of RLIMIT_MEMLOCK). */
+MeContext *me_map_context(size_t l2_s, size_t pool_s, int64_t n_secs,
+                          MeTransport transport, int memory,
+                          void *allocate(size_t));
 void me_dealloc_context(MeContext *context, void deallocate(void *));
+/* Opens the journal at path, creating it if needed, and replays it into the
+ * context, which must be fresh. From then on every inbound message is
+ * recorded before being matched, and the books can be rebuilt by opening the
+ * same journal after a crash. Returns 0 or an errno value (EINVAL if the file
+ * isn't a journal of as many securities, EBADMSG if a record that was synced
+ * is torn, leaving the context half replayed). me_dealloc_context closes it.
+ *
+ * If a message can't be recorded (the file can't grow), it isn't matched and
+ * the engine stops as with me_stop, matching nothing else. The error is left
+ * in MeJournal.error. */
+int me_journal_open(MeContext *context, const char *path, int64_t sync_every);
+
+/* Snapshots. The context region and the pool arenas are written to a file as
+ * they are, skipping the pages that are all zeroes. Loading it maps the file
+ * privately and relocates the pointers in place, which is a single pass over
+ * the books that doesn't re-insert any order, so the engine starts matching
+ * right away. Journal records written before the snapshot aren't replayed
+ * again. */
+
+#define ME_SNAPSHOT_MAGIC 0x5453504e534d5846ull /* "FXMSNPST" */
+#define ME_SNAPSHOT_VERSION 10
+/* The context region plus the pool arenas. */
+#define ME_SNAPSHOT_SEGMENTS 64
+
+typedef struct {
+  /* Address it had when written, its size and where it is in the file. */
+  uint64_t base;
+  uint64_t size;
+  uint64_t offset;
+} MeSnapshotSegment;
+
+typedef struct {
+  uint64_t magic;
+  uint64_t version;
+  int64_t n_securities;
+  uint64_t journaled;
+  /* Inbound messages reflected in the books. */
+  uint64_t messages;
+  MePoolStats pool;
+  /* Segments keep their address modulo this (MeContext.book_block, or a page
+   * if it's smaller), as overflow books are found by masking addresses. */
+  uint64_t alignment;
+  uint64_t n_segments;
+  MeSnapshotSegment segments[ME_SNAPSHOT_SEGMENTS];
+} MeSnapshotHeader;
+
+/* Writes the books of a context that isn't matching to path, atomically
+ * replacing it. While it's matching, send a CHECKPOINT message instead.
+ * Returns 0 or an errno value (E2BIG if the pool has too many arenas). */
+int me_snapshot_write(MeContext *context, const char *path);
+/* Like me_alloc_context, but the books are restored from the snapshot at path.
+ * Returns NULL and sets errno if it can't be read (EINVAL if it isn't a
+ * snapshot of this engine version). */
+MeContext *me_snapshot_load(const char *path, MeTransport transport,
+                            void *allocate(size_t));
+/* Publishes the latest state of every security in a shared memory page from
+ * then on (see MeConflated). Returns 0 or an errno value. me_dealloc_context
+ * removes it. */
+int me_conflate(MeContext *context);
 void *me_run(MeContext *context, void *paralell_job(void *), void *job_arg);
+/* Like me_run, but each security is owned by exactly one of n_workers pinned
+ * threads, so matching doesn't take locks and messages to the same security
+ * are processed in arrival order. Uses one more thread to dispatch them. If
+ * their rings can't be allocated, it only publishes the PANIC and returns
+ * NULL, setting errno. */
+void *me_run_sharded(MeContext *context, int n_workers,
+                     void *paralell_job(void *), void *job_arg);
+/* Makes a running engine return once it's done with the messages already
+ * sent to it, as a PANIC message would. Returns 0 or an errno value. */
+int me_stop(MeContext *context);
 
 /* "Client" side. */
 
 typedef struct {
+  MeTransport transport;
   mqd_t incoming;
   mqd_t outcoming;
+  MeShm *shm;
+  /* Its entry in MeShm.outcoming, which receives everything published after
+   * me_client_init_context. */
+  MeSubscriber *subscriber;
+  /* Last frame received from the POSIX queue and how much of it was read. */
+  MeFrame frame;
+  int64_t next;
 } MeClientContext;
 
+/* Uses the shared memory transport if the engine created it, falling back to
+ * the POSIX queues otherwise. Every shared memory client gets all the events,
+ * while POSIX queue clients split them. Returns EUSERS if there are already
+ * ME_SUBSCRIBERS clients. Clients must be closed to stop being waited on. */
 int me_client_init_context(MeClientContext *context);
 void me_client_close_context(MeClientContext *context);
 int me_client_send_message(MeClientContext *context, MeMessage *message);
+/* Sends n messages in order, reserving up to ME_FRAME_MESSAGES ring slots at
+ * once. Returns 0 or an errno value. */
+int me_client_send_messages(MeClientContext *context, MeMessage *messages,
+                            int64_t n);
 int me_client_get_message(MeClientContext *context, MeMessage *message);
+/* Blocks until there's at least one message and then reads up to max of them
+ * without blocking again. Returns how many were read, or -1 setting errno
+ * (EPIPE once evicted, after which the context can only be closed). */
+int64_t me_client_get_messages(MeClientContext *context, MeMessage *messages,
+                               int64_t max);
+
+/* Maps the conflated state published by a running engine (see me_conflate).
+ * Returns 0 or an errno value (ENOENT if it doesn't publish it). */
+int me_conflated_open(MeConflatedPage **page);
+void me_conflated_close(MeConflatedPage *page);
+/* Copies a consistent state of a security, retrying while it's written. */
+void me_conflated_read(MeConflatedPage *page, int64_t security_id,
+                       MeConflated *state);
+
+/* Of record->seq and record->msg. */
+uint64_t me_journal_checksum(MeJournalRecord *record);
+
+/* Maps the statistics of a running engine. */
+int me_stats_open(MeStats **stats);
+void me_stats_close(MeStats *stats);
+/* Index of the class of a message in MeThreadStats.histograms. */
+int me_stats_class(MeMessageType msg_type, MeOrderType ord_type);
+/* Smallest value counted in a bucket. */
+uint64_t me_stats_bucket_value(int64_t bucket);
+/* Adds the histogram from to into. */
+void me_stats_merge(MeHistogram *into, MeHistogram *from);
+/* Value (in ticks) under which the given fraction of the samples are. */
+uint64_t me_stats_percentile(MeHistogram *histogram, double fraction);
 
 #endif /* __ME_HEADER */
@@ -8,12 +8,30 @@ import melow # type: ignore
 # Don't change this.
 ORDER_TYPE_LIMIT = melow.ME_ORDER_LIMIT
 ORDER_TYPE_MARKET = melow.ME_ORDER_MARKET
+ORDER_TYPE_IOC = melow.ME_ORDER_IOC
+ORDER_TYPE_FOK = melow.ME_ORDER_FOK
+ORDER_TYPE_STOP = melow.ME_ORDER_STOP
+ORDER_TYPE_STOP_LIMIT = melow.ME_ORDER_STOP_LIMIT
+ORDER_TYPE_ICEBERG = melow.ME_ORDER_ICEBERG
 SIDE_BUY = melow.ME_SIDE_BUY
 SIDE_SELL = melow.ME_SIDE_SELL
+TRANSPORT_SHM = melow.ME_TRANSPORT_SHM
+TRANSPORT_MQUEUE = melow.ME_TRANSPORT_MQUEUE
+MEMORY_HUGE_PAGES = melow.ME_MEMORY_HUGE_PAGES
+MEMORY_PREFAULT = melow.ME_MEMORY_PREFAULT
+MEMORY_LOCK = melow.ME_MEMORY_LOCK
+MEMORY_NUMA = melow.ME_MEMORY_NUMA
+DEPTH_ADD = melow.ME_DEPTH_ADD
+DEPTH_CHANGE = melow.ME_DEPTH_CHANGE
+DEPTH_DELETE = melow.ME_DEPTH_DELETE
+MASS_CANCEL_BUY = melow.ME_MASS_CANCEL_BUY
+MASS_CANCEL_SELL = melow.ME_MASS_CANCEL_SELL
+MASS_CANCEL_OWNER = melow.ME_MASS_CANCEL_OWNER
+MASS_CANCEL_ORDERS = melow.ME_MASS_CANCEL_ORDERS
 
 
 class Order:
-    def __init__(self, security_id: int, side: int, price: int, quantity: int, timestamp: int, type=ORDER_TYPE_LIMIT, id=0):
+    def __init__(self, security_id: int, side: int, price: int, quantity: int, timestamp: int, type=ORDER_TYPE_LIMIT, id=0, owner=0, expires=0, stop=0, display=0):
         self.security_id = security_id
         self.side = side
         self.price = price
@@ -21,6 +39,10 @@ class Order:
         self.timestamp = timestamp
         self.type = type
         self.order_id = id
+        self.owner = owner
+        self.expires = expires
+        self.stop = stop
+        self.display = display
 
 
     def getSecurityID(self) -> int:
@@ -43,6 +65,22 @@ class Order:
         return self.timestamp
 
 
+    def getOwner(self) -> int:
+        return self.owner
+
+
+    def getExpires(self) -> int:
+        return self.expires
+
+
+    def getStop(self) -> int:
+        return self.stop
+
+
+    def getDisplay(self) -> int:
+        return self.display
+
+
     def isGreaterThan(self, other) -> bool:
         """This function throws if the orders have different security ID or different sides."""
         if self.side != other.side or self.security_id != other.security_id:
@@ -62,6 +100,14 @@ class Order:
         return self.type == ORDER_TYPE_MARKET
 
 
+    def isStop(self) -> bool:
+        return self.type == ORDER_TYPE_STOP or self.type == ORDER_TYPE_STOP_LIMIT
+
+
+    def isIceberg(self) -> bool:
+        return self.type == ORDER_TYPE_ICEBERG
+
+
     def isBuy(self) -> bool:
         return self.side == SIDE_BUY
 
@@ -83,15 +129,23 @@ class Message:
             case melow.ME_MESSAGE_PANIC:
                 return MessagePanic()
             case melow.ME_MESSAGE_NEW_ORDER:
-                return MessageNewOrder(Order(security_id=ot[0], side=ot[1], quantity=ot[2], type=ot[3], price=ot[4], id=ot[5], timestamp=ot[6]))
+                return MessageNewOrder(Order(security_id=ot[0], side=ot[1], quantity=ot[2], type=ot[3], price=ot[4], id=ot[5], timestamp=ot[6], owner=ot[7], expires=ot[8], stop=0 if ot[3] == ORDER_TYPE_ICEBERG else ot[9], display=ot[9] if ot[3] == ORDER_TYPE_ICEBERG else 0))
             case melow.ME_MESSAGE_ORDER_EXECUTED:
-                return MessageOrderExecuted(Order(security_id=ot[0], side=ot[1], quantity=ot[2], type=ot[3], price=ot[4], id=ot[5], timestamp=ot[6]))
+                return MessageOrderExecuted(Order(security_id=ot[0], side=ot[1], quantity=ot[2], type=ot[3], price=ot[4], id=ot[5], timestamp=ot[6], owner=ot[7], expires=ot[8]))
             case melow.ME_MESSAGE_CANCEL_ORDER:
                 return MessageCancelOrder(ot[0], ot[1])
             case melow.ME_MESSAGE_TRADE:
-                return MessageTrade(Order(security_id=ot[0], side=ot[1], quantity=ot[2], type=ot[3], price=ot[4], id=ot[5], timestamp=ot[6]), ot[7])
+                return MessageTrade(Order(security_id=ot[0], side=ot[1], quantity=ot[2], type=ot[3], price=ot[4], id=ot[5], timestamp=ot[6], owner=ot[8], expires=ot[9]), ot[7])
             case melow.ME_MESSAGE_SET_MARKET_PRICE:
                 return MessageSetMarketPrice(ot[0], ot[1])
+            case melow.ME_MESSAGE_CHECKPOINT:
+                return MessageCheckpoint(ot[0])
+            case melow.ME_MESSAGE_DEPTH:
+                return MessageDepth(ot[0], ot[1], ot[2], ot[3], ot[4], ot[5])
+            case melow.ME_MESSAGE_MASS_CANCEL:
+                return MessageMassCancel(ot[0], ot[1], ot[2], ot[3])
+            case melow.ME_MESSAGE_AMEND_ORDER:
+                return MessageAmendOrder(Order(security_id=ot[0], side=ot[1], quantity=ot[2], type=ot[3], price=ot[4], id=ot[5], timestamp=ot[6], owner=ot[7], expires=ot[8]))
 
 
 class MessagePanic(Message):
@@ -103,9 +157,38 @@ class MessagePanic(Message):
         pass
 
 
+class MessageCheckpoint(Message):
+    """Asks the engine to write its snapshot while it keeps matching. The
+    engine sends it back with the amount of inbound messages it reflects."""
+    def toTuple(self):
+        return (melow.ME_MESSAGE_CHECKPOINT, ())
+
+
+    def __init__(self, messages=0):
+        self.messages = messages
+
+
+class MessageDepth(Message):
+    """A change to one of the top levels of a security. Levels count from 1,
+    the best price. ADD shifts the levels below down (dropping the one pushed
+    out of the published depth), DELETE shifts them up and is followed by an
+    ADD of the level taking the last position."""
+    def toTuple(self):
+        return (melow.ME_MESSAGE_DEPTH, (self.security_id, self.action, self.side, self.level, self.price, self.quantity))
+
+
+    def __init__(self, security_id, action, side, level, price, quantity):
+        self.security_id = security_id
+        self.action = action
+        self.side = side
+        self.level = level
+        self.price = price
+        self.quantity = quantity
+
+
 class MessageNewOrder(Message):
     def toTuple(self):
-        return (melow.ME_MESSAGE_NEW_ORDER, (self.order.security_id, self.order.side, self.order.quantity, self.order.type, self.order.price, self.order.order_id, self.order.timestamp))
+        return (melow.ME_MESSAGE_NEW_ORDER, (self.order.security_id, self.order.side, self.order.quantity, self.order.type, self.order.price, self.order.order_id, self.order.timestamp, self.order.owner, self.order.expires, self.order.display if self.order.isIceberg() else self.order.stop))
 
 
     def __init__(self, order):
@@ -114,7 +197,7 @@ class MessageNewOrder(Message):
 
 class MessageOrderExecuted(Message):
     def toTuple(self):
-        return (melow.ME_MESSAGE_ORDER_EXECUTED, (self.order.security_id, self.order.side, self.order.quantity, self.order.type, self.order.price, self.order.order_id, self.order.timestamp))
+        return (melow.ME_MESSAGE_ORDER_EXECUTED, (self.order.security_id, self.order.side, self.order.quantity, self.order.type, self.order.price, self.order.order_id, self.order.timestamp, self.order.owner, self.order.expires))
 
 
     def __init__(self, order):
@@ -123,7 +206,7 @@ class MessageOrderExecuted(Message):
 
 class MessageTrade(Message):
     def toTuple(self):
-        return (melow.ME_MESSAGE_ORDER_EXECUTED, (self.order.security_id, self.order.side, self.order.quantity, self.order.type, self.order.price, self.order.order_id, self.order.timestamp, self.matched_id))
+        return (melow.ME_MESSAGE_TRADE, (self.order.security_id, self.order.side, self.order.quantity, self.order.type, self.order.price, self.order.order_id, self.order.timestamp, self.matched_id, self.order.owner, self.order.expires))
 
 
     def __init__(self, order, matched_id):
@@ -141,6 +224,34 @@ class MessageCancelOrder(Message):
         self.security_id = security_id
 
 
+class MessageAmendOrder(Message):
+    """Changes the quantity and price (kept if 0) of the resting order with
+    the same ID. Only a smaller quantity at the same price keeps its place in
+    the queue. The engine sends it back with the order as amended, quantity 0
+    if it wasn't resting."""
+    def toTuple(self):
+        return (melow.ME_MESSAGE_AMEND_ORDER, (self.order.security_id, self.order.side, self.order.quantity, self.order.type, self.order.price, self.order.order_id, self.order.timestamp, self.order.owner, self.order.expires))
+
+
+    def __init__(self, order):
+        self.order = order
+
+
+class MessageMassCancel(Message):
+    """Cancels the orders of a security, or of every security with ID -1,
+    selected by the MASS_CANCEL_* flags. The engine sends it back with how
+    many orders it cancelled."""
+    def toTuple(self):
+        return (melow.ME_MESSAGE_MASS_CANCEL, (self.security_id, self.flags, self.owner))
+
+
+    def __init__(self, security_id, flags=0, owner=0, cancelled=0):
+        self.security_id = security_id
+        self.flags = flags
+        self.owner = owner
+        self.cancelled = cancelled
+
+
 class MessageSetMarketPrice(Message):
     def toTuple(self):
         return (melow.ME_MESSAGE_SET_MARKET_PRICE, (self.security_id, self.price))
@@ -151,14 +262,74 @@ class MessageSetMarketPrice(Message):
         self.price = price
 
 
+class SecurityState:
+    """Best prices are 0 (with 0 quantity) while a side is empty. updates
+    changes every time the engine writes the state."""
+    def __init__(self, updates, market_price, bid, bid_quantity, ask, ask_quantity):
+        self.updates = updates
+        self.market_price = market_price
+        self.bid = bid
+        self.bid_quantity = bid_quantity
+        self.ask = ask
+        self.ask_quantity = ask_quantity
+
+
 class Engine:
-    def __init__(self, cache=melow.ME_DEFAULT_CACHE_SIZE, secs=melow.ME_DEFAULT_SECURITIES_NUMBER):
+    def __init__(self, cache=melow.ME_DEFAULT_CACHE_SIZE, secs=melow.ME_DEFAULT_SECURITIES_NUMBER, transport=TRANSPORT_SHM, pool=melow.ME_DEFAULT_POOL_SIZE, journal=None, journal_sync=0, snapshot=None, memory=0, depth=0, conflate=False):
+        """If journal is a path, the engine replays it and then records every
+        inbound message to it, so a restarted engine has the same books. If
+        snapshot is the path of an existing snapshot, the books start from it
+        (and only the journal written after it is replayed). MessageCheckpoint
+        writes it while the engine runs. memory is a combination of the
+        MEMORY_* flags, mapping the books instead of allocating them. With
+        depth > 0, changes to that many levels of each side are published as
+        MessageDepth. With conflate, the latest state of every security is
+        published for Client.getState."""
         self.secs = secs
-        self.context = melow.Context(cache, secs)
+        self.context = melow.Context(cache, secs, transport, pool, snapshot, memory, depth)
+        if conflate:
+            self.context.conflate()
+        if journal is not None:
+            self.context.openJournal(journal, sync_every=journal_sync)
+
+
+    def run(self, workers=0, threads=0) -> None:
+        """Blocks until the engine is stopped, but other Python threads keep
+        running. With workers > 0 every security is owned by a single pinned
+        worker, otherwise threads (0 for OpenMP's default) share them."""
+        self.context.run(workers=workers, threads=threads)
+
+
+    def start(self, workers=0, threads=0) -> None:
+        """Like run, but the engine runs on its own threads and this returns
+        right away, so the same process can drive it with a Client."""
+        self.context.start(workers=workers, threads=threads)
 
 
-    def run(self) -> None:
-        self.context.run()
+    def stop(self) -> None:
+        """Stops the started engine once it handled the messages already sent
+        to it, and waits for it."""
+        self.context.stop()
+
+
+    def join(self) -> None:
+        """Waits for the started engine to be stopped by a PANIC message."""
+        self.context.join()
+
+
+    def writeSnapshot(self, path) -> None:
+        """Only while not running."""
+        self.context.writeSnapshot(path)
+
+
+def eventDtype():
+    """NumPy structured dtype of the events written by Client.drain. As in
+    MeMessage, the fields of different message types overlap."""
+    import numpy
+    names, formats, offsets = zip(*melow.ME_MESSAGE_FIELDS)
+    return numpy.dtype({"names": list(names), "formats": list(formats),
+                        "offsets": list(offsets),
+                        "itemsize": melow.ME_MESSAGE_SIZE})
 
 
 class Client:
@@ -170,5 +341,33 @@ class Client:
         self.context.sendMessage(*message.toTuple())
 
 
+    def sendBatch(self, messages: list[Message]) -> None:
+        """Sends them in order, with far less overhead per message than
+        send. Packed messages can be sent with context.sendMessages."""
+        self.context.sendMessages([m.toTuple() for m in messages])
+
+
     def get(self) -> Message:
         return Message.fromTuple(self.context.getMessage())
+
+
+    def getBatch(self, max=melow.ME_FRAME_MESSAGES) -> list[Message]:
+        """Waits for at least one message and returns all that are available."""
+        return [Message.fromTuple(t) for t in self.context.getMessages(max)]
+
+
+    def drain(self, events) -> int:
+        """Waits for events and writes all that are available and fit in
+        events, without creating Python objects nor holding the GIL. events is
+        a writable buffer of packed messages, such as
+        bytearray(n * melow.ME_MESSAGE_SIZE) or numpy.empty(n, eventDtype()).
+        Returns how many were written."""
+        if hasattr(events, "dtype"):
+            events = events.view("u1")
+        return self.context.drain(events)
+
+
+    def getState(self, security_id) -> SecurityState:
+        """Latest state of a security, without reading every message. Needs
+        an engine publishing it (Engine(conflate=True) or me -C)."""
+        return SecurityState(*self.context.getState(security_id))
@@ -1,6 +1,11 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <pthread.h>
+#include <pythread.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "../me.h"
 
@@ -15,15 +20,81 @@
 static PyObject *meErrorPosixQueue;
 static PyObject *meErrorOpenPosixQueue;
 
+/*
+ * Packed messages.
+ */
+
+/* Name, NumPy type and offset of every field of a MeMessage. Fields of
+ * different message types overlap, as they share the union. Trades use the
+ * order fields for their aggressor. */
+static const struct {
+  const char *name;
+  const char *format;
+  size_t offset;
+} message_fields[] = {
+    {"msg_type", "i4", offsetof(MeMessage, msg_type)},
+    {"security_id", "i8", offsetof(MeMessage, security_id)},
+    {"side", "i4", offsetof(MeMessage, message.order.side)},
+    {"quantity", "i8", offsetof(MeMessage, message.order.quantity)},
+    {"ord_type", "i4", offsetof(MeMessage, message.order.ord_type)},
+    {"price", "i8", offsetof(MeMessage, message.order.price)},
+    {"order_id", "u8", offsetof(MeMessage, message.order.order_id)},
+    {"timestamp", "u8", offsetof(MeMessage, message.order.timestamp)},
+    {"owner", "u4", offsetof(MeMessage, message.order.owner)},
+    {"expires", "u4", offsetof(MeMessage, message.order.expires)},
+    {"matched_id", "u8", offsetof(MeMessage, message.trade.matched_id)},
+    {"stop_price", "i8", offsetof(MeMessage, message.stop.stop_price)},
+    {"display", "i8", offsetof(MeMessage, message.iceberg.display)},
+    {"set_market_price", "i8", offsetof(MeMessage, message.set_market_price)},
+    {"to_cancel", "u8", offsetof(MeMessage, message.to_cancel)},
+    {"checkpoint", "u8", offsetof(MeMessage, message.checkpoint)},
+    {"depth_action", "i4", offsetof(MeMessage, message.depth.action)},
+    {"depth_side", "i4", offsetof(MeMessage, message.depth.side)},
+    {"depth_level", "i8", offsetof(MeMessage, message.depth.level)},
+    {"depth_price", "i8", offsetof(MeMessage, message.depth.price)},
+    {"depth_quantity", "i8", offsetof(MeMessage, message.depth.quantity)},
+    {"mass_flags", "u4", offsetof(MeMessage, message.mass_cancel.flags)},
+    {"mass_owner", "u4", offsetof(MeMessage, message.mass_cancel.owner)},
+    {"mass_cancelled", "u8",
+     offsetof(MeMessage, message.mass_cancel.cancelled)},
+};
+
+/* Tuple of (name, format, offset) tuples. */
+static PyObject *message_fields_tuple(void) {
+  Py_ssize_t n = sizeof(message_fields) / sizeof(message_fields[0]);
+  PyObject *fields = PyTuple_New(n);
+  PyObject *field;
+
+  if (fields == NULL) return NULL;
+  for (Py_ssize_t i = 0; i < n; i++) {
+    field = Py_BuildValue("(ssn)", message_fields[i].name,
+                          message_fields[i].format,
+                          (Py_ssize_t)message_fields[i].offset);
+    if (field == NULL) {
+      Py_DECREF(fields);
+      return NULL;
+    }
+    PyTuple_SET_ITEM(fields, i, field);
+  }
+  return fields;
+}
+
 /*
  * Client context type.
  */
 
 typedef struct {
   PyObject_HEAD MeClientContext context;
+  /* Mapped by the first getState. */
+  MeConflatedPage *conflated;
+  /* Held while reading without the GIL, as the context has a single cursor. */
+  PyThread_type_lock lock;
 } MePyClientContext;
 
 static void mePyClientContext_dealloc(MePyClientContext *self) {
+  if (self->lock != NULL) PyThread_free_lock(self->lock);
+  if (self->conflated != NULL) me_conflated_close(self->conflated);
+  me_client_close_context(&self->context);
   Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
@@ -36,37 +107,51 @@ static PyObject *mePyClientContext_new(PyTypeObject *type, PyObject *args,
   MePyClientContext *self;
   self = (MePyClientContext *)type->tp_alloc(type, 0);
   if (self == NULL) return NULL;
+  /* Not through dealloc, as the context isn't open. */
+  if ((self->lock = PyThread_allocate_lock()) == NULL) {
+    type->tp_free((PyObject *)self);
+    return PyErr_NoMemory();
+  }
   if (me_client_init_context(&self->context)) {
     PyErr_SetString(meErrorOpenPosixQueue,
-                    "Couldn't open POSIX queues. Is the engine running?");
+                    "Couldn't open shared memory or POSIX queues. Is the "
+                    "engine running?");
+    PyThread_free_lock(self->lock);
+    type->tp_free((PyObject *)self);
     return NULL;
   }
   return (PyObject *)self;
 }
 
-static PyObject *mePyClientContext_sendmsg(MePyClientContext *self,
-                                           PyObject *args) {
+/* Fills message from a (type, payload) tuple. Returns -1 with an exception
+ * set if it can't be parsed. */
+static int tuple_to_message(PyObject *args, MeMessage *message) {
   MeMessage to_send;
-  PyObject *item;
   int dumb_bool;
 
+  if (!PyTuple_Check(args)) {
+    PyErr_SetString(PyExc_TypeError, "Messages are (type, payload) tuples.");
+    return -1;
+  }
+
   /* Parse first argument of the tuple to get message type. Uses dumb_bool to
    * just ignore the value of the tuple passed as the second argument. */
   if (!PyArg_ParseTuple(args, "Ip", &to_send.msg_type, &dumb_bool)) {
     PyErr_SetString(PyExc_TypeError, "Unknown message type.");
-    return NULL;
+    return -1;
   }
 
   /* Parse the entire tuple. */
   switch (to_send.msg_type) {
     case ME_MESSAGE_PANIC:
+    case ME_MESSAGE_CHECKPOINT:
       break;
     case ME_MESSAGE_CANCEL_ORDER:
       if (!PyArg_ParseTuple(args, "I(lL)", &to_send.msg_type,
                             &to_send.security_id, &to_send.message.to_cancel)) {
         PyErr_SetString(PyExc_AttributeError,
                         "Cannot parse arguments as cancel message.");
-        return NULL;
+        return -1;
       }
       break;
     case ME_MESSAGE_SET_MARKET_PRICE:
@@ -75,11 +160,22 @@ static PyObject *mePyClientContext_sendmsg(MePyClientContext *self,
                             &to_send.message.set_market_price)) {
         PyErr_SetString(PyExc_TypeError,
                         "Cannot parse arguments as set market price message.");
-        return NULL;
+        return -1;
       }
       break;
+    case ME_MESSAGE_MASS_CANCEL:
+      if (!PyArg_ParseTuple(args, "I(lII)", &to_send.msg_type,
+                            &to_send.security_id,
+                            &to_send.message.mass_cancel.flags,
+                            &to_send.message.mass_cancel.owner)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "Cannot parse arguments as mass cancel message.");
+        return -1;
+      }
+      to_send.message.mass_cancel.cancelled = 0;
+      break;
     case ME_MESSAGE_TRADE:
-      if (!PyArg_ParseTuple(args, "I(lIlIlLLL)", &to_send.msg_type,
+      if (!PyArg_ParseTuple(args, "I(lIlIlLLLII)", &to_send.msg_type,
                             &to_send.security_id,
                             &to_send.message.trade.aggressor.side,
                             &to_send.message.trade.aggressor.quantity,
@@ -87,30 +183,57 @@ static PyObject *mePyClientContext_sendmsg(MePyClientContext *self,
                             &to_send.message.trade.aggressor.price,
                             &to_send.message.trade.aggressor.order_id,
                             &to_send.message.trade.aggressor.timestamp,
-                            &to_send.message.trade.matched_id)) {
+                            &to_send.message.trade.matched_id,
+                            &to_send.message.trade.aggressor.owner,
+                            &to_send.message.trade.aggressor.expires)) {
         PyErr_SetString(PyExc_AttributeError,
                         "Cannot parse Arguments as trade message.");
-        return NULL;
+        return -1;
       }
       break;
     case ME_MESSAGE_NEW_ORDER:
+      if (!PyArg_ParseTuple(
+              args, "I(lIlIlLLIIl)", &to_send.msg_type, &to_send.security_id,
+              &to_send.message.order.side, &to_send.message.order.quantity,
+              &to_send.message.order.ord_type, &to_send.message.order.price,
+              &to_send.message.order.order_id,
+              &to_send.message.order.timestamp,
+              &to_send.message.order.owner, &to_send.message.order.expires,
+              &to_send.message.stop.stop_price)) {
+        PyErr_SetString(PyExc_AttributeError,
+                        "Cannot parse Arguments as order message.");
+        return -1;
+      }
+      break;
     case ME_MESSAGE_ORDER_EXECUTED:
+    case ME_MESSAGE_AMEND_ORDER:
       if (!PyArg_ParseTuple(
-              args, "I(lIlIlLL)", &to_send.msg_type, &to_send.security_id,
+              args, "I(lIlIlLLII)", &to_send.msg_type, &to_send.security_id,
               &to_send.message.order.side, &to_send.message.order.quantity,
               &to_send.message.order.ord_type, &to_send.message.order.price,
               &to_send.message.order.order_id,
-              &to_send.message.order.timestamp)) {
+              &to_send.message.order.timestamp,
+              &to_send.message.order.owner,
+              &to_send.message.order.expires)) {
         PyErr_SetString(PyExc_AttributeError,
                         "Cannot parse Arguments as order message.");
-        return NULL;
+        return -1;
       }
       break;
     default:
       PyErr_SetString(PyExc_AttributeError, "Unknown message type.");
-      return NULL;
+      return -1;
   }
 
+  *message = to_send;
+  return 0;
+}
+
+static PyObject *mePyClientContext_sendmsg(MePyClientContext *self,
+                                           PyObject *args) {
+  MeMessage to_send;
+
+  if (tuple_to_message(args, &to_send) != 0) return NULL;
   if (me_client_send_message(&self->context, &to_send)) {
     PyErr_SetString(meErrorPosixQueue,
                     "Writing to POSIX message queue failed.");
@@ -121,62 +244,245 @@ static PyObject *mePyClientContext_sendmsg(MePyClientContext *self,
   return Py_None;
 }
 
-static PyObject *mePyClientContext_getmsg(MePyClientContext *self,
-                                          PyObject *Py_UNUSED(ignored)) {
-  MeMessage msg;
-  PyObject *tuple;
+static PyObject *mePyClientContext_sendmsgs(MePyClientContext *self,
+                                            PyObject *args) {
+  PyObject *messages;
+  PyObject *sequence;
+  MeMessage *to_send;
+  Py_buffer buffer;
+  Py_ssize_t n;
+  int r;
 
-  if (me_client_get_message(&self->context, &msg)) {
+  if (!PyArg_ParseTuple(args, "O", &messages)) return NULL;
+
+  /* Already packed, so it's sent as it is. */
+  if (PyObject_CheckBuffer(messages)) {
+    if (PyObject_GetBuffer(messages, &buffer, PyBUF_C_CONTIGUOUS) != 0)
+      return NULL;
+    if (buffer.len % sizeof(MeMessage) != 0) {
+      PyBuffer_Release(&buffer);
+      PyErr_SetString(PyExc_ValueError,
+                      "Buffer size is not a multiple of ME_MESSAGE_SIZE.");
+      return NULL;
+    }
+    Py_BEGIN_ALLOW_THREADS;
+    r = me_client_send_messages(&self->context, buffer.buf,
+                                buffer.len / sizeof(MeMessage));
+    Py_END_ALLOW_THREADS;
+    PyBuffer_Release(&buffer);
+  } else {
+    sequence = PySequence_Fast(messages, "Expected a list of messages.");
+    if (sequence == NULL) return NULL;
+    n = PySequence_Fast_GET_SIZE(sequence);
+    if ((to_send = PyMem_Malloc((n > 0 ? n : 1) * sizeof(MeMessage))) == NULL) {
+      Py_DECREF(sequence);
+      return PyErr_NoMemory();
+    }
+    for (Py_ssize_t i = 0; i < n; i++) {
+      if (tuple_to_message(PySequence_Fast_GET_ITEM(sequence, i),
+                           &to_send[i]) != 0) {
+        PyMem_Free(to_send);
+        Py_DECREF(sequence);
+        return NULL;
+      }
+    }
+    Py_DECREF(sequence);
+    Py_BEGIN_ALLOW_THREADS;
+    r = me_client_send_messages(&self->context, to_send, n);
+    Py_END_ALLOW_THREADS;
+    PyMem_Free(to_send);
+  }
+
+  if (r != 0) {
     PyErr_SetString(meErrorPosixQueue,
-                    "Reading from POSIX message queue failed.");
+                    "Writing to POSIX message queue failed.");
     return NULL;
   }
 
-  switch (msg.msg_type) {
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyObject *message_to_tuple(MeMessage *msg) {
+  switch (msg->msg_type) {
     case ME_MESSAGE_PANIC:
-      tuple =
-          Py_BuildValue("(I())", msg.msg_type, msg.security_id, msg.msg_type);
-      break;
-    case ME_MESSAGE_ORDER_EXECUTED:
+      return Py_BuildValue("(I())", msg->msg_type, msg->security_id,
+                           msg->msg_type);
     case ME_MESSAGE_NEW_ORDER:
-      tuple = Py_BuildValue("(I(lIlIlLL))", msg.msg_type, msg.security_id,
-                            msg.message.order.side, msg.message.order.quantity,
-                            msg.message.order.ord_type, msg.message.order.price,
-                            msg.message.order.order_id,
-                            msg.message.order.timestamp);
-      break;
+      return Py_BuildValue(
+          "(I(lIlIlLLIIl))", msg->msg_type, msg->security_id,
+          msg->message.order.side, msg->message.order.quantity,
+          msg->message.order.ord_type, msg->message.order.price,
+          msg->message.order.order_id, msg->message.order.timestamp,
+          msg->message.order.owner, msg->message.order.expires,
+          msg->message.stop.stop_price);
+    case ME_MESSAGE_ORDER_EXECUTED:
+    case ME_MESSAGE_AMEND_ORDER:
+      return Py_BuildValue(
+          "(I(lIlIlLLII))", msg->msg_type, msg->security_id,
+          msg->message.order.side, msg->message.order.quantity,
+          msg->message.order.ord_type, msg->message.order.price,
+          msg->message.order.order_id, msg->message.order.timestamp,
+          msg->message.order.owner, msg->message.order.expires);
     case ME_MESSAGE_TRADE:
-      tuple = Py_BuildValue("(I(lIlIlLLL))", msg.msg_type, msg.security_id,
-                            msg.message.trade.aggressor.side,
-                            msg.message.trade.aggressor.quantity,
-                            msg.message.trade.aggressor.ord_type,
-                            msg.message.trade.aggressor.price,
-                            msg.message.trade.aggressor.order_id,
-                            msg.message.trade.aggressor.timestamp,
-                            msg.message.trade.matched_id);
-      break;
+      return Py_BuildValue("(I(lIlIlLLLII))", msg->msg_type, msg->security_id,
+                           msg->message.trade.aggressor.side,
+                           msg->message.trade.aggressor.quantity,
+                           msg->message.trade.aggressor.ord_type,
+                           msg->message.trade.aggressor.price,
+                           msg->message.trade.aggressor.order_id,
+                           msg->message.trade.aggressor.timestamp,
+                           msg->message.trade.matched_id,
+                           msg->message.trade.aggressor.owner,
+                           msg->message.trade.aggressor.expires);
     case ME_MESSAGE_CANCEL_ORDER:
-      tuple = Py_BuildValue("I(lL)", msg.msg_type, msg.security_id,
-                            msg.message.to_cancel);
-      break;
+      return Py_BuildValue("I(lL)", msg->msg_type, msg->security_id,
+                           msg->message.to_cancel);
     case ME_MESSAGE_SET_MARKET_PRICE:
-      tuple = Py_BuildValue("I(ll)", msg.msg_type, msg.security_id,
-                            msg.message.set_market_price);
-      break;
+      return Py_BuildValue("I(ll)", msg->msg_type, msg->security_id,
+                           msg->message.set_market_price);
+    case ME_MESSAGE_DEPTH:
+      return Py_BuildValue("I(lIIlll)", msg->msg_type, msg->security_id,
+                           msg->message.depth.action, msg->message.depth.side,
+                           msg->message.depth.level, msg->message.depth.price,
+                           msg->message.depth.quantity);
+    case ME_MESSAGE_MASS_CANCEL:
+      return Py_BuildValue(
+          "I(lIIK)", msg->msg_type, msg->security_id,
+          msg->message.mass_cancel.flags, msg->message.mass_cancel.owner,
+          (unsigned long long)msg->message.mass_cancel.cancelled);
+    case ME_MESSAGE_CHECKPOINT:
+      return Py_BuildValue("I(K)", msg->msg_type,
+                           (unsigned long long)msg->message.checkpoint);
     default:
       PyErr_SetString(PyExc_ValueError,
                       "Received unknown message type from the engine.");
       return NULL;
   }
+}
 
-  return tuple;
+static PyObject *receive_error(void) {
+  if (errno == EPIPE)
+    PyErr_SetString(meErrorPosixQueue,
+                    "Evicted by the engine for falling behind.");
+  else
+    PyErr_SetString(meErrorPosixQueue,
+                    "Reading from POSIX message queue failed.");
+  return NULL;
+}
+
+/* me_client_get_messages without holding the GIL. */
+static int64_t receive_messages(MePyClientContext *self, MeMessage *messages,
+                                int64_t max) {
+  int64_t n;
+  int error;
+
+  Py_BEGIN_ALLOW_THREADS;
+  PyThread_acquire_lock(self->lock, WAIT_LOCK);
+  n = me_client_get_messages(&self->context, messages, max);
+  error = errno;
+  PyThread_release_lock(self->lock);
+  Py_END_ALLOW_THREADS;
+
+  errno = error;
+  return n;
+}
+
+static PyObject *mePyClientContext_getmsg(MePyClientContext *self,
+                                          PyObject *Py_UNUSED(ignored)) {
+  MeMessage msg;
+
+  if (receive_messages(self, &msg, 1) != 1) return receive_error();
+
+  return message_to_tuple(&msg);
+}
+
+static PyObject *mePyClientContext_getmsgs(MePyClientContext *self,
+                                           PyObject *args) {
+  MeMessage msgs[ME_FRAME_MESSAGES];
+  Py_ssize_t max = ME_FRAME_MESSAGES;
+  int64_t n;
+  PyObject *list;
+  PyObject *tuple;
+
+  if (!PyArg_ParseTuple(args, "|n", &max)) return NULL;
+  if (max > ME_FRAME_MESSAGES) max = ME_FRAME_MESSAGES;
+
+  if ((n = receive_messages(self, msgs, max)) < 0) return receive_error();
+
+  if ((list = PyList_New(n)) == NULL) return NULL;
+  for (int64_t i = 0; i < n; i++) {
+    if ((tuple = message_to_tuple(&msgs[i])) == NULL) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, i, tuple);
+  }
+
+  return list;
+}
+
+static PyObject *mePyClientContext_drain(MePyClientContext *self,
+                                         PyObject *args) {
+  Py_buffer buffer;
+  int64_t n;
+
+  if (!PyArg_ParseTuple(args, "w*", &buffer)) return NULL;
+  if (buffer.len % sizeof(MeMessage) != 0) {
+    PyBuffer_Release(&buffer);
+    PyErr_SetString(PyExc_ValueError,
+                    "Buffer size is not a multiple of ME_MESSAGE_SIZE.");
+    return NULL;
+  }
+
+  n = receive_messages(self, buffer.buf, buffer.len / sizeof(MeMessage));
+  PyBuffer_Release(&buffer);
+  if (n < 0) return receive_error();
+
+  return PyLong_FromLongLong(n);
+}
+
+static PyObject *mePyClientContext_getstate(MePyClientContext *self,
+                                            PyObject *args) {
+  int64_t security_id;
+  MeConflated state;
+
+  if (!PyArg_ParseTuple(args, "L", &security_id)) return NULL;
+  if (self->conflated == NULL &&
+      (errno = me_conflated_open(&self->conflated)) != 0) {
+    self->conflated = NULL;
+    return PyErr_SetFromErrno(PyExc_OSError);
+  }
+  if (security_id < 0 || security_id >= self->conflated->n_securities) {
+    PyErr_SetString(PyExc_IndexError, "Unknown security.");
+    return NULL;
+  }
+
+  me_conflated_read(self->conflated, security_id, &state);
+  return Py_BuildValue("(KLLLLL)", (unsigned long long)state.updates,
+                       (long long)state.market_price, (long long)state.bid,
+                       (long long)state.bid_quantity, (long long)state.ask,
+                       (long long)state.ask_quantity);
 }
 
 static PyMethodDef mePyClientContextMethods[] = {
     {"sendMessage", (PyCFunction)mePyClientContext_sendmsg, METH_VARARGS,
      "Sends a message to the engine."},
+    {"sendMessages", (PyCFunction)mePyClientContext_sendmsgs, METH_VARARGS,
+     "Sends a list of (type, payload) tuples, or a buffer of packed "
+     "messages of ME_MESSAGE_SIZE bytes each, in order."},
     {"getMessage", (PyCFunction)mePyClientContext_getmsg, METH_NOARGS,
      "Gets a message from the engine."},
+    {"getMessages", (PyCFunction)mePyClientContext_getmsgs, METH_VARARGS,
+     "Waits for messages from the engine and returns a list with all of them "
+     "that are available (up to max, at most ME_FRAME_MESSAGES)."},
+    {"drain", (PyCFunction)mePyClientContext_drain, METH_VARARGS,
+     "Waits for messages from the engine and writes all that are available "
+     "and fit to a writable buffer, packed as ME_MESSAGE_FIELDS describes, "
+     "without holding the GIL. Returns how many were written."},
+    {"getState", (PyCFunction)mePyClientContext_getstate, METH_VARARGS,
+     "Returns the latest (updates, market price, bid, bid quantity, ask, ask "
+     "quantity) of a security, if the engine publishes them."},
     {NULL} /* Sentinel */
 };
 
@@ -197,10 +503,21 @@ static PyTypeObject mePyClientContextType = {
 
 typedef struct {
   PyObject_HEAD MeContext *context;
+  /* Where checkpoints are written, owned by us. */
+  char *snapshot;
+  /* Running the engine since start, until joined. */
+  pthread_t thread;
+  int running;
+  int workers;
 } MePyContext;
 
 static void mePyContext_dealloc(MePyContext *self) {
+  if (self->running) {
+    me_stop(self->context);
+    pthread_join(self->thread, NULL);
+  }
   me_dealloc_context(self->context, free);
+  free(self->snapshot);
   Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
@@ -212,28 +529,203 @@ static PyObject *mePyContext_new(PyTypeObject *type, PyObject *args,
 
   size_t l2size;
   size_t securities;
-
-  static char *kwlist[] = {"l2size", "securities", NULL};
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "ll", kwlist, &l2size,
-                                   &securities))
+  MeTransport transport = ME_TRANSPORT_SHM;
+  size_t pool = 268435456;
+  const char *snapshot = NULL;
+  int memory = 0;
+  int64_t depth = 0;
+
+  static char *kwlist[] = {"l2size",   "securities", "transport", "pool",
+                           "snapshot", "memory",     "depth",     NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "ll|IlziL", kwlist, &l2size,
+                                   &securities, &transport, &pool, &snapshot,
+                                   &memory, &depth)) {
+    type->tp_free((PyObject *)self);
     return NULL;
+  }
 
-  self->context = me_alloc_context(l2size, securities, malloc);
+  if (snapshot != NULL && access(snapshot, F_OK) == 0) {
+    self->context = me_snapshot_load(snapshot, transport, malloc);
+    if (self->context == NULL || errno != 0) {
+      PyErr_SetFromErrnoWithFilename(PyExc_OSError, snapshot);
+      /* Loaded but for the transport, so it's only the mapping. */
+      if (self->context != NULL)
+        munmap(self->context->mapping, self->context->mapping_s);
+      type->tp_free((PyObject *)self);
+      return NULL;
+    }
+  } else if (memory != 0) {
+    if ((self->context = me_map_context(l2size, pool, securities, transport,
+                                        memory, malloc)) == NULL) {
+      PyErr_SetFromErrno(PyExc_OSError);
+      type->tp_free((PyObject *)self);
+      return NULL;
+    }
+  } else {
+    self->context =
+        me_alloc_context(l2size, pool, securities, transport, malloc);
+    if (self->context == NULL || errno != 0) {
+      PyErr_SetFromErrno(PyExc_OSError);
+      /* Half initialized, so there's only the memory to give back. */
+      free(self->context);
+      type->tp_free((PyObject *)self);
+      return NULL;
+    }
+  }
+  self->context->depth = depth;
+  if (snapshot != NULL) {
+    self->snapshot = strdup(snapshot);
+    self->context->checkpoint = self->snapshot;
+  }
 
   return (PyObject *)self;
 }
 
-static PyObject *mePyContext_run(MePyContext *self, PyObject *args) {
-  (void)args;
+/* Sets the threads of the engine from the arguments of run and start. */
+static int parse_run_args(MePyContext *self, PyObject *args, PyObject *kwds) {
+  int workers = 0;
+  int threads = 0;
+
+  static char *kwlist[] = {"workers", "threads", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ii", kwlist, &workers,
+                                   &threads))
+    return -1;
+  if (self->running) {
+    PyErr_SetString(PyExc_RuntimeError, "The engine is already running.");
+    return -1;
+  }
+
+  self->workers = workers;
+  self->context->threads = threads;
+  return 0;
+}
+
+static void *run_engine(void *arg) {
+  MePyContext *self = arg;
+
+  if (self->workers > 0)
+    me_run_sharded(self->context, self->workers, NULL, NULL);
+  else
+    me_run(self->context, NULL, NULL);
+  return NULL;
+}
+
+/* Raises OSError if the engine stopped on a journal failure. */
+static PyObject *journal_result(MePyContext *self) {
+  if (self->context->journaling && self->context->journal.error != 0) {
+    errno = self->context->journal.error;
+    return PyErr_SetFromErrno(PyExc_OSError);
+  }
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyObject *mePyContext_run(MePyContext *self, PyObject *args,
+                                 PyObject *kwds) {
+  if (parse_run_args(self, args, kwds) != 0) return NULL;
+
+  Py_BEGIN_ALLOW_THREADS;
+  run_engine(self);
+  Py_END_ALLOW_THREADS;
+
+  return journal_result(self);
+}
+
+static PyObject *mePyContext_start(MePyContext *self, PyObject *args,
+                                   PyObject *kwds) {
+  if (parse_run_args(self, args, kwds) != 0) return NULL;
+
+  if ((errno = pthread_create(&self->thread, NULL, run_engine, self)) != 0)
+    return PyErr_SetFromErrno(PyExc_OSError);
+  self->running = 1;
+
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyObject *mePyContext_join(MePyContext *self,
+                                  PyObject *Py_UNUSED(ignored)) {
+  if (self->running) {
+    Py_BEGIN_ALLOW_THREADS;
+    pthread_join(self->thread, NULL);
+    Py_END_ALLOW_THREADS;
+    self->running = 0;
+  }
+
+  return journal_result(self);
+}
+
+static PyObject *mePyContext_stop(MePyContext *self,
+                                  PyObject *Py_UNUSED(ignored)) {
+  if (self->running && (errno = me_stop(self->context)) != 0)
+    return PyErr_SetFromErrno(PyExc_OSError);
+  return mePyContext_join(self, NULL);
+}
+
+static PyObject *mePyContext_openJournal(MePyContext *self, PyObject *args,
+                                         PyObject *kwds) {
+  const char *path;
+  int64_t sync_every = 0;
+
+  static char *kwlist[] = {"path", "sync_every", NULL};
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|L", kwlist, &path,
+                                   &sync_every))
+    return NULL;
+
+  if ((errno = me_journal_open(self->context, path, sync_every)) != 0)
+    return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyObject *mePyContext_writeSnapshot(MePyContext *self,
+                                           PyObject *args) {
+  const char *path;
+
+  if (!PyArg_ParseTuple(args, "s", &path)) return NULL;
+
+  if ((errno = me_snapshot_write(self->context, path)) != 0)
+    return PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+
+  Py_INCREF(Py_None);
+  return Py_None;
+}
 
-  me_run(self->context, NULL, NULL);
+static PyObject *mePyContext_conflate(MePyContext *self,
+                                      PyObject *Py_UNUSED(ignored)) {
+  if ((errno = me_conflate(self->context)) != 0)
+    return PyErr_SetFromErrno(PyExc_OSError);
 
   Py_INCREF(Py_None);
   return Py_None;
 }
 
 static PyMethodDef mePyContextMethods[] = {
-    {"run", (PyCFunction)mePyContext_run, METH_NOARGS, "Runs the engine."},
+    {"run", (PyCFunction)(void (*)(void))mePyContext_run,
+     METH_VARARGS | METH_KEYWORDS,
+     "Runs the engine until it's stopped, without holding the GIL. With "
+     "workers > 0, runs it in sharded mode, otherwise with threads OpenMP "
+     "threads (0 for OpenMP's default)."},
+    {"start", (PyCFunction)(void (*)(void))mePyContext_start,
+     METH_VARARGS | METH_KEYWORDS,
+     "Like run, but returns right away, leaving the engine running on its "
+     "own threads."},
+    {"stop", (PyCFunction)mePyContext_stop, METH_NOARGS,
+     "Makes the engine started by start return once it's done with the "
+     "messages already sent, and joins it."},
+    {"join", (PyCFunction)mePyContext_join, METH_NOARGS,
+     "Waits for the engine started by start to return, as it does on a "
+     "PANIC message. Raises OSError if it stopped as the journal couldn't be "
+     "written."},
+    {"openJournal", (PyCFunction)(void (*)(void))mePyContext_openJournal,
+     METH_VARARGS | METH_KEYWORDS,
+     "Replays the journal at path, if any, and records every inbound message "
+     "to it from then on. sync_every > 0 syncs it every this many messages."},
+    {"writeSnapshot", (PyCFunction)mePyContext_writeSnapshot, METH_VARARGS,
+     "Writes the books to path. The engine must not be running."},
+    {"conflate", (PyCFunction)mePyContext_conflate, METH_NOARGS,
+     "Publishes the state of every security for ClientContext.getState."},
     {NULL},
 };
 
@@ -305,6 +797,21 @@ PyMODINIT_FUNC PyInit_melow(void) {
   /* Order types. */
   PyModule_AddIntConstant(m, "ME_ORDER_MARKET", ME_ORDER_MARKET);
   PyModule_AddIntConstant(m, "ME_ORDER_LIMIT", ME_ORDER_LIMIT);
+  PyModule_AddIntConstant(m, "ME_ORDER_IOC", ME_ORDER_IOC);
+  PyModule_AddIntConstant(m, "ME_ORDER_FOK", ME_ORDER_FOK);
+  PyModule_AddIntConstant(m, "ME_ORDER_STOP", ME_ORDER_STOP);
+  PyModule_AddIntConstant(m, "ME_ORDER_STOP_LIMIT", ME_ORDER_STOP_LIMIT);
+  PyModule_AddIntConstant(m, "ME_ORDER_ICEBERG", ME_ORDER_ICEBERG);
+
+  /* Transports. */
+  PyModule_AddIntConstant(m, "ME_TRANSPORT_SHM", ME_TRANSPORT_SHM);
+  PyModule_AddIntConstant(m, "ME_TRANSPORT_MQUEUE", ME_TRANSPORT_MQUEUE);
+
+  /* Memory flags. */
+  PyModule_AddIntConstant(m, "ME_MEMORY_HUGE_PAGES", ME_MEMORY_HUGE_PAGES);
+  PyModule_AddIntConstant(m, "ME_MEMORY_PREFAULT", ME_MEMORY_PREFAULT);
+  PyModule_AddIntConstant(m, "ME_MEMORY_LOCK", ME_MEMORY_LOCK);
+  PyModule_AddIntConstant(m, "ME_MEMORY_NUMA", ME_MEMORY_NUMA);
 
   /* Sides. */
   PyModule_AddIntConstant(m, "ME_SIDE_BUY", ME_SIDE_BUY);
@@ -320,10 +827,29 @@ PyMODINIT_FUNC PyInit_melow(void) {
   PyModule_AddIntConstant(m, "ME_MESSAGE_ORDER_EXECUTED",
                           ME_MESSAGE_ORDER_EXECUTED);
   PyModule_AddIntConstant(m, "ME_MESSAGE_PANIC", ME_MESSAGE_PANIC);
+  PyModule_AddIntConstant(m, "ME_MESSAGE_CHECKPOINT", ME_MESSAGE_CHECKPOINT);
+  PyModule_AddIntConstant(m, "ME_MESSAGE_DEPTH", ME_MESSAGE_DEPTH);
+  PyModule_AddIntConstant(m, "ME_MESSAGE_AMEND_ORDER", ME_MESSAGE_AMEND_ORDER);
+  PyModule_AddIntConstant(m, "ME_MESSAGE_MASS_CANCEL", ME_MESSAGE_MASS_CANCEL);
+
+  /* Mass cancellation flags. */
+  PyModule_AddIntConstant(m, "ME_MASS_CANCEL_BUY", ME_MASS_CANCEL_BUY);
+  PyModule_AddIntConstant(m, "ME_MASS_CANCEL_SELL", ME_MASS_CANCEL_SELL);
+  PyModule_AddIntConstant(m, "ME_MASS_CANCEL_OWNER", ME_MASS_CANCEL_OWNER);
+  PyModule_AddIntConstant(m, "ME_MASS_CANCEL_ORDERS", ME_MASS_CANCEL_ORDERS);
+
+  /* Depth actions. */
+  PyModule_AddIntConstant(m, "ME_DEPTH_ADD", ME_DEPTH_ADD);
+  PyModule_AddIntConstant(m, "ME_DEPTH_CHANGE", ME_DEPTH_CHANGE);
+  PyModule_AddIntConstant(m, "ME_DEPTH_DELETE", ME_DEPTH_DELETE);
 
   /* Usefull constants. */
+  PyModule_AddIntConstant(m, "ME_FRAME_MESSAGES", ME_FRAME_MESSAGES);
+  PyModule_AddIntConstant(m, "ME_MESSAGE_SIZE", sizeof(MeMessage));
+  PyModule_AddObject(m, "ME_MESSAGE_FIELDS", message_fields_tuple());
   PyModule_AddIntConstant(m, "ME_DEFAULT_CACHE_SIZE", 1610612736);
   PyModule_AddIntConstant(m, "ME_DEFAULT_SECURITIES_NUMBER", 400);
+  PyModule_AddIntConstant(m, "ME_DEFAULT_POOL_SIZE", 268435456);
 
   return m;
 }